@@ -37,6 +37,9 @@
 */
 /******************************************************************************/
 
+/* Simulator benchmark build uses sim_stdio_c_iface.cpp */
+#if !defined(SBITS_SIM)
+
 #include "sd_stdio_c_iface.h"
 #include <SPI.h>
 #include <SD.h>
@@ -398,3 +401,5 @@ SD_File_Delete_All(
 
 	return true;
 }
+
+#endif
@@ -72,6 +72,20 @@ serial_print(
 	return num;
 }
 
+int
+serial_write(
+	const uint8_t *data,
+	int length
+) {
+	int num;
+
+	num = Serial.write(data, length);
+#if DEBUG
+	Serial.flush();
+#endif
+	return num;
+}
+
 void
 serial_init(
 	int baud_rate
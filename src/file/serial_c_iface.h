@@ -82,6 +82,20 @@ serial_print(
 	const char *buffer
 );
 
+/**
+@brief	  	A binary write function wrapping Arduino's serial stream.
+@param		data
+				Pointer to the bytes to write.
+@param		length
+				Number of bytes to write.
+@return		The number of bytes written.
+*/
+extern int
+serial_write(
+	const uint8_t *data,
+	int length
+);
+
 /**
 @brief		Initializes serial port 0 for communications.
 @details	By default the port is set up at N-8-1.
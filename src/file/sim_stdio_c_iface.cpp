@@ -0,0 +1,379 @@
+/******************************************************************************/
+/**
+@file		sim_stdio_c_iface.cpp
+@author		Ramon Lawrence
+@brief		Definitions of stdio.h file functions for the emulated storage
+			device of the simulator benchmark build (SBITS_SIM).
+@details	Replaces sd_stdio_c_iface.cpp. Each read or write is one device
+			command on the SPI bus. See sbits_sim.h for the commands.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#if defined(SBITS_SIM)
+
+#include "sd_stdio_c_iface.h"
+#include "../sbits_sim.h"
+
+/**
+@brief		A file on the emulated storage device.
+*/
+struct _SD_File {
+	uint8_t		handle;			/**< Device file handle. */
+	uint32_t	pos;			/**< Current position. */
+	int8_t		eof;			/**< 1 if last read reached end of file. */
+};
+
+/**
+@brief		Starts SPI master at the highest clock (F_CPU/2).
+*/
+static void
+sim_spi_begin(
+) {
+	static uint8_t started = 0;
+
+	if (started) {
+		return;
+	}
+
+	/* SS (PB0), SCK (PB1) and MOSI (PB2) are outputs. SS must stay high in master mode. */
+	DDRB	|= _BV(PB0) | _BV(PB1) | _BV(PB2);
+	PORTB	|= _BV(PB0);
+	SPCR	= _BV(SPE) | _BV(MSTR);
+	SPSR	= _BV(SPI2X);
+	started = 1;
+}
+
+/**
+@brief		Sends byte and returns byte received.
+*/
+static uint8_t
+sim_spi_transfer(
+	uint8_t b
+) {
+	SPDR = b;
+
+	while (!(SPSR & _BV(SPIF))) {
+	}
+
+	return SPDR;
+}
+
+static void
+sim_send_header(
+	uint8_t		cmd,
+	uint8_t		handle,
+	uint32_t	pos,
+	uint16_t	len
+) {
+	sim_spi_transfer(cmd);
+	sim_spi_transfer(handle);
+
+	for (uint8_t i = 0; i < 4; i++) {
+		sim_spi_transfer((uint8_t) (pos >> (8 * i)));
+	}
+
+	sim_spi_transfer((uint8_t) len);
+	sim_spi_transfer((uint8_t) (len >> 8));
+}
+
+static void
+sim_send_string(
+	const char *s
+) {
+	do {
+		sim_spi_transfer((uint8_t) *s);
+	} while (*s++ != '\0');
+}
+
+/**
+@brief		Reads device reply byte after busy bytes.
+*/
+static uint8_t
+sim_wait(
+	uint8_t busy
+) {
+	uint8_t b;
+
+	while ((b = sim_spi_transfer(0xFF)) == busy) {
+	}
+
+	return b;
+}
+
+static uint32_t
+sim_size(
+	SD_FILE *stream
+) {
+	uint32_t size = 0;
+
+	sim_spi_transfer(SBITS_SIM_CMD_SIZE);
+	sim_spi_transfer(stream->handle);
+
+	for (uint8_t i = 0; i < 4; i++) {
+		size |= (uint32_t) sim_spi_transfer(0xFF) << (8 * i);
+	}
+
+	return size;
+}
+
+int
+sd_fclose(
+	SD_FILE *stream
+) {
+	if (stream) {
+		sim_spi_transfer(SBITS_SIM_CMD_CLOSE);
+		sim_spi_transfer(stream->handle);
+		sim_spi_transfer(0xFF);
+	}
+
+	delete stream;
+	return 0;
+}
+
+int
+sd_feof(
+	SD_FILE *stream
+) {
+	return stream->eof == 1 ? -1 : 0;
+}
+
+int
+sd_fflush(
+	SD_FILE *stream
+) {
+	/* Device writes through */
+	return 0;
+}
+
+int
+sd_fsetpos(
+	SD_FILE		*stream,
+	uint32_t	*pos
+) {
+	if (!stream) {
+		return 1;
+	}
+
+	stream->pos = *pos;
+	return 0;
+}
+
+int
+sd_fgetpos(
+	SD_FILE		*stream,
+	uint32_t	*pos
+) {
+	*pos = (stream) ? stream->pos : 0;
+	return 0;
+}
+
+/**
+@brief		Opens file on device. Modes are as for fopen(). Device creates or
+			truncates the file.
+*/
+SD_FILE *
+sd_fopen(
+	const char	*filename,
+	const char	*mode
+) {
+	sim_spi_begin();
+	sim_spi_transfer(SBITS_SIM_CMD_OPEN);
+	sim_send_string(filename);
+	sim_send_string(mode);
+
+	uint8_t handle = sim_spi_transfer(0xFF);
+
+	if (handle == SBITS_SIM_NO_FILE) {
+		return NULL;
+	}
+
+	_SD_File *file = new struct _SD_File ();
+
+	file->handle	= handle;
+	file->pos		= 0;
+	file->eof		= 0;
+
+	if (strcmp(mode, "a+") == 0) {
+		file->pos = sim_size(file);
+	}
+
+	return file;
+}
+
+size_t
+sd_fread(
+	void	*ptr,
+	size_t	size,
+	size_t	nmemb,
+	SD_FILE *stream
+) {
+	uint8_t		*buf		= (uint8_t *) ptr;
+	uint16_t	len			= size * nmemb;
+	uint16_t	num_bytes	= 0;
+
+	sim_send_header(SBITS_SIM_CMD_READ, stream->handle, stream->pos, len);
+	sim_wait(0xFF);
+
+	for (uint16_t i = 0; i < len; i++) {
+		buf[i] = sim_spi_transfer(0xFF);
+	}
+
+	num_bytes	= sim_spi_transfer(0xFF);
+	num_bytes	|= (uint16_t) sim_spi_transfer(0xFF) << 8;
+
+	stream->pos += num_bytes;
+
+	if (num_bytes < len) {
+		stream->eof = 1;
+	}
+
+	return num_bytes / size;
+}
+
+/**
+@brief		Sets position. Writing past the end of the file pads it with zeros.
+*/
+int
+sd_fseek(
+	SD_FILE				*stream,
+	unsigned long int	offset,
+	int					whence
+) {
+	if (NULL == stream) {
+		return -1;
+	}
+
+	stream->eof = 0;
+
+	switch (whence) {
+		case SEEK_SET:
+			stream->pos = offset;
+			return 0;
+
+		case SEEK_CUR:
+			stream->pos += offset;
+			return 0;
+
+		case SEEK_END:
+			stream->pos = sim_size(stream) + offset;
+			return 0;
+
+		default:
+			return -1;
+	}
+}
+
+long int
+sd_ftell(
+	SD_FILE *stream
+) {
+	return (stream) ? stream->pos : -1;
+}
+
+size_t
+sd_fwrite(
+	void	*ptr,
+	size_t	size,
+	size_t	nmemb,
+	SD_FILE *stream
+) {
+	uint8_t		*buf	= (uint8_t *) ptr;
+	uint16_t	len		= size * nmemb;
+
+	sim_send_header(SBITS_SIM_CMD_WRITE, stream->handle, stream->pos, len);
+
+	for (uint16_t i = 0; i < len; i++) {
+		sim_spi_transfer(buf[i]);
+	}
+
+	if (sim_wait(0x00) != SBITS_SIM_TOKEN) {
+		return 0;
+	}
+
+	stream->pos += len;
+	return nmemb;
+}
+
+int
+sd_remove(
+	char *filename
+) {
+	sim_spi_begin();
+	sim_spi_transfer(SBITS_SIM_CMD_REMOVE);
+	sim_send_string(filename);
+	return sim_spi_transfer(0xFF) == SBITS_SIM_TOKEN ? 0 : 1;
+}
+
+void
+sd_rewind(
+	SD_FILE *stream
+) {
+	stream->eof = 0;
+	stream->pos = 0;
+}
+
+int
+SD_File_Begin(
+	uint8_t csPin
+) {
+	sim_spi_begin();
+	return 1;
+}
+
+void
+sd_printint(
+	int i
+) {
+	Serial.println(i);
+}
+
+int
+SD_File_Exists(
+	char *filepath
+) {
+	SD_FILE *file = sd_fopen(filepath, "r");
+
+	if (file == NULL) {
+		return 0;
+	}
+
+	sd_fclose(file);
+	return 1;
+}
+
+int
+SD_File_Delete_All(
+) {
+	/* Files are removed on the host */
+	return true;
+}
+
+#endif
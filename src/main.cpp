@@ -37,6 +37,7 @@
 #include <SD.h>
 
 #include "test_sbits.h"
+#include "sbits_sim.h"
 
 Sd2Card card;
 SdVolume volume;
@@ -46,6 +47,15 @@ const int chipSelect = 4;
 
 void setup() 
 {
+#if defined(SBITS_SIM)
+  /* Simulator benchmark. Files are on emulated storage device. */
+  Serial.begin(115200);
+  SBITS_SIM_INIT();
+  runalltests_sbits();
+  Serial.flush();
+  SBITS_SIM_EXIT();
+#endif
+
   Serial.begin(9600);
 
   printf("\nInitializing SD card...");
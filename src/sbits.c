@@ -37,10 +37,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <time.h>
 #include <math.h>
 
 #include "sbits.h"
+#include "sbits_log.h"
 
 /**
  * Use binary search instead of value-based search
@@ -65,6 +67,140 @@ int8_t bitmapOverlap(uint8_t* bm1, uint8_t* bm2, int8_t size)
 	return 0;
 }
 
+/**
+@brief     	Returns 1 if all bits of bm1 are set in bm2, 0 otherwise.
+*/
+int8_t bitmapContains(uint8_t* bm1, uint8_t* bm2, int8_t size)
+{
+	for (int8_t i=0; i < size; i++)
+		if ((bm1[i] & bm2[i]) != bm1[i])
+			return 0;
+
+	return 1;
+}
+
+/**
+@brief     	Returns 1 if page or chunk bitmap may have records matching query bitmap, 0 otherwise.
+			Range bitmaps match if any bucket overlaps. Hash bitmaps match only if all hashed bits are set.
+*/
+int8_t bitmapMatch(sbitsState *state, void* query, void* bm)
+{
+	if (SBITS_USING_HASH_BMAP(state->parameters))
+		return bitmapContains((uint8_t*) query, (uint8_t*) bm, state->bitmapSize);
+	return bitmapOverlap((uint8_t*) query, (uint8_t*) bm, state->bitmapSize);
+}
+
+/**
+@brief     	Returns bucket of 32-bit value at start of data for buckets of equal width from min to max.
+			Values outside boundaries are in first or last bucket.
+*/
+int16_t adaptiveBucket(sbitsState *state, int32_t min, int32_t max, void *data)
+{
+	int32_t val;
+	int16_t numBuckets = state->bitmapSize * 8;
+
+	memcpy(&val, data, sizeof(int32_t));
+	if (val <= min || max <= min)
+		return 0;
+	if (val >= max)
+		return numBuckets - 1;
+	return (int16_t) (((int64_t) val - min) * numBuckets / ((int64_t) max - min + 1));
+}
+
+/**
+@brief     	Returns bucket of data value in bitmap, or -1 if updateBitmap sets no bit for value.
+@param     	state
+                SBITS algorithm state structure
+@param     	data
+            	Data value
+*/
+int16_t sbitsBitmapBucket(sbitsState *state, void *data)
+{
+	uint8_t bm[SBITS_MAX_BITMAP_SIZE];
+
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+		return adaptiveBucket(state, state->bitmapMin, state->bitmapMax, data);
+
+	memset(bm, 0, state->bitmapSize);
+	state->updateBitmap(data, bm);
+	for (int16_t i = 0; i < state->bitmapSize * 8; i++)
+		if (bm[i >> 3] & (128 >> (i & 7)))
+			return i;
+	return -1;
+}
+
+/**
+@brief     	Adds data value to page or chunk bitmap. Adaptive bitmaps use bucket boundaries of current segment. Range-encoded bitmaps set all bits from the value bucket
+			up (SBITS_RANGE_LE) or down (SBITS_RANGE_GE), stopping at the first bit already set.
+*/
+void updatePageBitmap(sbitsState *state, void *data, uint8_t *bm)
+{
+	if (!SBITS_USING_RANGE_BMAP(state->parameters) && !SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+	{
+		state->updateBitmap(data, bm);
+		return;
+	}
+
+	int16_t i = sbitsBitmapBucket(state, data);
+	if (i < 0)
+		return;
+	if (!SBITS_USING_RANGE_BMAP(state->parameters))
+	{
+		bm[i >> 3] |= 128 >> (i & 7);
+		return;
+	}
+	int8_t step = state->rangeBitmapDir == SBITS_RANGE_GE ? -1 : 1;
+	for ( ; i >= 0 && i < state->bitmapSize * 8 && !(bm[i >> 3] & (128 >> (i & 7))); i += step)
+		bm[i >> 3] |= 128 >> (i & 7);
+}
+
+/**
+@brief     	Adds value to statistics of current segment used to recompute bucket boundaries.
+*/
+void addSegmentValue(sbitsState *state, void *data)
+{
+	int32_t val;
+	int16_t bucket = sbitsBitmapBucket(state, data);
+
+	memcpy(&val, data, sizeof(int32_t));
+	if (state->segmentCount == 0 || val < state->segmentMin)
+		state->segmentMin = val;
+	if (state->segmentCount == 0 || val > state->segmentMax)
+		state->segmentMax = val;
+	state->segmentCount++;
+	if (bucket == 0 || bucket == state->bitmapSize * 8 - 1)
+		state->segmentEdgeCount++;
+}
+
+/**
+@brief     	Starts a new segment of pages with the same bucket boundaries. If values of last segment were skewed
+			(many in edge buckets or all in a few buckets), boundaries are recomputed from the range of last segment
+			plus a margin for drift. Boundaries are stored in the data page header and index page header.
+*/
+void startSegment(sbitsState *state)
+{
+	int64_t range = (int64_t) state->segmentMax - state->segmentMin;
+	if (state->segmentCount > 0 && (state->segmentEdgeCount * 100 > state->segmentCount * SBITS_ADAPT_EDGE_PERCENT
+			|| range * 4 < (int64_t) state->bitmapMax - state->bitmapMin))
+	{
+		int64_t margin = range / 8 + 1;
+		state->bitmapMin = (int32_t) (state->segmentMin - margin < INT32_MIN ? INT32_MIN : state->segmentMin - margin);
+		state->bitmapMax = (int32_t) (state->segmentMax + margin > INT32_MAX ? INT32_MAX : state->segmentMax + margin);
+		state->numBoundsChanges++;
+	}
+	state->segmentCount = 0;
+	state->segmentEdgeCount = 0;
+}
+
+/**
+@brief     	Stores current bucket boundaries in header of page.
+*/
+void setPageBounds(sbitsState *state, void *buf, count_t offset)
+{
+	memcpy((uint8_t*) buf + offset, &state->bitmapMin, sizeof(int32_t));
+	memcpy((uint8_t*) buf + offset + sizeof(int32_t), &state->bitmapMax, sizeof(int32_t));
+}
+
 void initBufferPageHeader(sbitsState *state, int pageNum)
 {
 	/* Initialize page header (first 16 bytes) */
@@ -77,27 +213,74 @@ void initBufferPageHeader(sbitsState *state, int pageNum)
     }	
 }
 
+/**
+@brief     	Initializes index write buffer page.
+@param     	state
+                SBITS algorithm state structure
+@param     	pageId
+                Logical id of data page of first index record on page
+*/
+void initIndexBufferPage(sbitsState *state, id_t pageId)
+{
+	void *buf = state->buffer + SBITS_INDEX_WRITE_BUFFER * state->pageSize;
+
+	/* Clear header and fine bitmaps. Records are copied in when added. */
+	memset(buf, 0, state->idxHeaderSize);
+
+	/* Add page id to minimum value spot in page */
+	*((id_t*) (buf + 8)) = pageId;
+
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+		setPageBounds(state, buf, SBITS_IDX_HEADER_SIZE);
+}
+
 void initBufferPage(sbitsState *state, int pageNum)
 {
 	/* Initialize page */
 	uint16_t i = 0;
 	void *buf = state->buffer + pageNum * state->pageSize;
+	count_t carryStart = 0, carryEnd = 0;
+
+	if (SBITS_USING_DERIVED_BMAP(state->parameters))
+	{	/* Carry last record to header of next page. Kept from previous page if no records (flushed empty page). */
+		count_t count = SBITS_GET_COUNT(buf);
+		int8_t *carry = (int8_t*) buf + state->derivedOffset;
+		if (count > 0)
+		{
+			memmove(carry, (int8_t*) buf + state->headerSize + (count-1) * state->recordSize, state->recordSize);
+			carry[state->recordSize] = 1;
+		}
+		carryStart = state->derivedOffset;
+		carryEnd = state->derivedOffset + state->recordSize + 1;
+	}
 
 	for (i = 0; i < state->pageSize; i++)
     {
+		if (i >= carryStart && i < carryEnd)
+			continue;
         ((int8_t*) buf)[i] = 0;
     }	
+	if (pageNum == 0)
+		memset(state->pageBitmap, 0, sizeof(state->pageBitmap));
 
-	/* Initialize header key min. Max and sum is already set to zero by the for-loop above */
-	void *min = SBITS_GET_MIN_KEY(buf, state);
-	/* Initialize min to all 1s */
-	for (i = 0; i < state->keySize; i++)
-    {
-        ((int8_t*) min)[i] = 1;
-    }		
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters) && pageNum == 0)
+	{	/* Segment is the pages of an index page, or an erase block if no index */
+		void *idxbuf = state->buffer + SBITS_INDEX_WRITE_BUFFER * state->pageSize;
+		if (state->indexFile != NULL ? SBITS_GET_COUNT(idxbuf) == 0 : state->nextPageWriteId % state->eraseSizeInPages == 0)
+		{
+			startSegment(state);
+			if (state->indexFile != NULL)
+				setPageBounds(state, idxbuf, SBITS_IDX_HEADER_SIZE);
+		}
+		if (state->boundsOffset != 0)
+			setPageBounds(state, buf, state->boundsOffset);
+	}
+
+	if (!SBITS_USING_MAX_MIN(state->parameters))
+		return;		/* No min/max in header. Space may be used by other header fields. */
 
-	/* Initialize data min. */
-	min = SBITS_GET_MIN_DATA(buf, state);
+	/* Initialize data min. Max and sum is already set to zero by the for-loop above */
+	void *min = SBITS_GET_MIN_DATA(buf, state);
 	/* Initialize min to all 1s */
 	for (i = 0; i < state->dataSize; i++)
     {
@@ -105,6 +288,18 @@ void initBufferPage(sbitsState *state, int pageNum)
     }	
 }
 
+/**
+@brief     	Returns bitmap of page being filled. Page header has bitmap unless it is only stored in index records.
+@param     	state
+                SBITS algorithm state structure
+*/
+void* sbitsPageBitmap(sbitsState *state)
+{
+	if (state->bitmapOffset == 0)
+		return state->pageBitmap;
+	return (void*) ((int8_t*) state->buffer + state->bitmapOffset);
+}
+
 /**
 @brief     	Return the smallest key in the node
 @param     	state
@@ -118,128 +313,1422 @@ void* sbitsGetMinKey(sbitsState *state, void *buffer)
 }
 
 /**
-@brief     	Return the smallest key in the node
+@brief     	Return the smallest key in the node
+@param     	state
+                SBITS algorithm state structure
+@param     	buffer
+                In memory page buffer with node data
+*/
+void* sbitsGetMaxKey(sbitsState *state, void *buffer)
+{
+	int16_t count =  SBITS_GET_COUNT(buffer); 	
+	return (void*) (buffer+state->headerSize+(count-1)*state->recordSize);
+}
+
+
+/**
+@brief     	Invalidates all query cache entries.
+@param     	state
+                SBITS state structure
+*/
+void sbitsClearQueryCache(sbitsState *state)
+{
+	for (int8_t i = 0; i < state->queryCacheSize; i++)
+		state->queryCache[i].valid = 0;
+	state->queryCacheClock = 0;
+}
+
+/**
+@brief     	Finds the query cache entry for the iterator query bitmap. If there is no entry,
+			the least recently used entry is replaced with an empty entry for the bitmap.
+			The candidate page set only depends on the query bitmap (and fine query bitmap, as
+			pages of skipped segments are not checked), so different data ranges that map to
+			the same buckets share an entry.
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+*/
+void sbitsLookupQueryCache(sbitsState *state, sbitsIterator *it)
+{
+	sbitsQueryCacheEntry *entry, *victim = NULL;
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+	int8_t fineSize = SBITS_USING_FINE_BMAP(state->parameters) && state->indexFile != NULL ? state->fineBitmapSize : 0;
+#endif
+
+	state->queryCacheClock++;
+	for (int8_t i = 0; i < state->queryCacheSize; i++)
+	{
+		entry = &(state->queryCache[i]);
+		if (entry->valid && memcmp(&(entry->queryBitmap), it->queryBitmap, state->bitmapSize) == 0
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+				&& memcmp(entry->fineQueryBitmap, it->fineQueryBitmap, fineSize) == 0
+#endif
+			)
+		{
+			state->queryCacheHits++;
+			goto found;
+		}
+
+		/* Prefer an unused entry, otherwise the least recently used one */
+		if (victim == NULL || (victim->valid && (!entry->valid || 
+				(uint16_t) (state->queryCacheClock - entry->lastUsed) > (uint16_t) (state->queryCacheClock - victim->lastUsed))))
+			victim = entry;
+	}
+
+	/* Not found. Start a new entry that will be filled in as the iterator checks pages. */
+	entry = victim;
+	entry->queryBitmap = 0;
+	memcpy(&(entry->queryBitmap), it->queryBitmap, state->bitmapSize);
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+	memcpy(entry->fineQueryBitmap, it->fineQueryBitmap, fineSize);
+#endif
+	entry->nextPageId = state->firstDataPageId;
+	entry->numPages = 0;
+	entry->valid = 1;
+
+found:
+	entry->lastUsed = state->queryCacheClock;
+	it->cacheEntry = entry;
+	it->cacheRec = 0;
+	it->cacheEnd = entry->numPages;
+}
+
+/**
+@brief     	Records that iterator checked a page not yet covered by its query cache entry.
+@param     	it
+            	SBITS iterator state structure
+@param		pageId
+				Logical id of page checked
+@param		overlap
+				1 if page bitmap overlaps query bitmap, 0 otherwise
+*/
+void sbitsAddQueryCachePage(sbitsIterator *it, id_t pageId, int8_t overlap)
+{
+	sbitsQueryCacheEntry *entry = it->cacheEntry;
+
+	if (pageId < entry->nextPageId)
+		return;		/* Already covered by entry */
+
+	if (overlap >= 1)
+	{
+		if (entry->numPages >= SBITS_QUERY_CACHE_MAX_PAGES)
+		{	/* Query is not selective enough to memoize. Release entry. */
+			entry->valid = 0;
+			it->cacheEntry = NULL;
+			return;
+		}
+		entry->pages[entry->numPages++] = pageId;
+	}
+	entry->nextPageId = pageId+1;
+}
+
+/**
+@brief     	Removes pages that were reclaimed when storage wrapped from all query cache entries.
+@param     	state
+                SBITS algorithm state structure
+*/
+void sbitsEvictQueryCache(sbitsState *state)
+{
+	for (int8_t i = 0; i < state->queryCacheSize; i++)
+	{
+		sbitsQueryCacheEntry *entry = &(state->queryCache[i]);
+		if (!entry->valid)
+			continue;
+
+		count_t num = 0;
+		while (num < entry->numPages && entry->pages[num] < state->firstDataPageId)
+			num++;
+		if (num > 0)
+		{
+			memmove(entry->pages, entry->pages+num, (entry->numPages-num)*sizeof(id_t));
+			entry->numPages -= num;
+		}
+		if (entry->nextPageId < state->firstDataPageId)
+			entry->nextPageId = state->firstDataPageId;
+	}
+}
+
+/**
+@brief     	Calculates record size, header sizes and number of records per data and index page
+			from the key, data, bitmap and page sizes and parameters. Removes parameters that cannot be used.
+@param     	state
+                SBITS algorithm state structure
+*/
+void sbitsInitLayout(sbitsState *state)
+{
+	state->recordSize = SBITS_ALIGN(state->keySize + state->dataSize);
+
+	if (SBITS_USING_BMAP(state->parameters) && (state->bitmapSize <= 0 || state->bitmapSize > SBITS_MAX_BITMAP_SIZE))
+	{
+		SBITS_ERROR(SBITS_EVENT_BITMAP_SIZE, SBITS_MAX_BITMAP_SIZE);
+		state->parameters &= ~(SBITS_USE_BMAP | SBITS_USE_INDEX);
+		state->bitmapSize = 0;
+	}
+
+	if (SBITS_USING_INDEX(state->parameters) && state->bufferSizeInBlocks < 4)
+	{
+		SBITS_ERROR(SBITS_EVENT_INDEX_BUFFERS);
+		state->parameters -= SBITS_USE_INDEX;
+	}
+
+	/* Calculate block header size. Header has only fields that are not redundant for the configuration: 
+		4 byte id, 2 for record count, bitmap (unless index records have it), min/max data (min/max key are first and last record key), ... */
+	state->headerSize = 6;
+	state->bitmapOffset = 0;
+	state->boundsOffset = 0;
+	if (SBITS_USING_BMAP(state->parameters) && !SBITS_USING_INDEX(state->parameters))
+	{
+		state->bitmapOffset = SBITS_BITMAP_OFFSET;
+		state->headerSize += state->bitmapSize;
+	}
+	state->headerSize = SBITS_ALIGN(state->headerSize);
+	if (SBITS_USING_MAX_MIN(state->parameters))
+	{
+		state->minMaxOffset = state->headerSize;
+		state->headerSize += SBITS_ALIGN(state->dataSize)*2;
+	}
+
+	if (SBITS_USING_DERIVED_BMAP(state->parameters))
+	{	/* Last record of previous page (followed by 1 byte valid flag) so derived value of first record can be computed */
+		if (!SBITS_USING_BMAP(state->parameters) || state->deriveData == NULL)
+		{
+			SBITS_ERROR(SBITS_EVENT_DERIVED_BMAP);
+			state->parameters -= SBITS_USE_DERIVED_BMAP;
+		}
+		else
+		{
+			state->headerSize = SBITS_ALIGN(state->headerSize);
+			state->derivedOffset = state->headerSize;
+			state->headerSize += state->recordSize + 1;
+		}
+	}
+
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+	{	/* Bucket boundaries of segment of page */
+		if (!SBITS_USING_BMAP(state->parameters) || SBITS_USING_HASH_BMAP(state->parameters) || SBITS_USING_MULTI_DIM(state->parameters)
+				|| (state->dataSize < 4 && !SBITS_USING_DERIVED_BMAP(state->parameters)))
+		{
+			SBITS_ERROR(SBITS_EVENT_ADAPTIVE_BMAP);
+			state->parameters -= SBITS_USE_ADAPTIVE_BMAP;
+		}
+		else if (state->bitmapOffset != 0)
+		{	/* Not needed if only index records have bitmaps */
+			state->boundsOffset = state->headerSize;
+			state->headerSize += SBITS_BOUNDS_SIZE;
+		}
+	}
+
+	/* Calculate number of records per page */
+	state->headerSize = SBITS_ALIGN(state->headerSize);
+	state->maxRecordsPerPage = (state->pageSize - state->headerSize) / state->recordSize;
+
+	if (SBITS_USING_MULTI_DIM(state->parameters)
+			&& (!SBITS_USING_BMAP(state->parameters) || SBITS_USING_HASH_BMAP(state->parameters) || state->buildBitmap == NULL || state->inDataRange == NULL))
+	{
+		SBITS_ERROR(SBITS_EVENT_MULTI_DIM);
+		state->parameters -= SBITS_USE_MULTI_DIM;
+	}
+
+	if (SBITS_USING_RANGE_BMAP(state->parameters)
+			&& (!SBITS_USING_BMAP(state->parameters) || SBITS_USING_HASH_BMAP(state->parameters) || SBITS_USING_MULTI_DIM(state->parameters)))
+	{
+		SBITS_ERROR(SBITS_EVENT_RANGE_BMAP);
+		state->parameters -= SBITS_USE_RANGE_BMAP;
+	}
+
+	if (SBITS_USING_RECORD_DIR(state->parameters))
+	{	/* Record directory has a bitmap for each chunk of records after rest of header */
+		if (!SBITS_USING_BMAP(state->parameters))
+		{
+			SBITS_ERROR(SBITS_EVENT_RECORD_DIR);
+			state->parameters -= SBITS_USE_RECORD_DIR;
+		}
+		else
+		{
+			if (state->recordDirChunkSize <= 0)
+				state->recordDirChunkSize = 16;
+			state->recordDirOffset = state->headerSize;
+			count_t space = state->pageSize - state->headerSize;
+			while (state->maxRecordsPerPage > 0
+					&& SBITS_ALIGN(SBITS_RECORD_DIR_CHUNKS(state, state->maxRecordsPerPage) * state->bitmapSize) + state->maxRecordsPerPage * state->recordSize > space)
+				state->maxRecordsPerPage--;
+			state->headerSize += SBITS_ALIGN(SBITS_RECORD_DIR_CHUNKS(state, state->maxRecordsPerPage) * state->bitmapSize);
+		}
+	}
+
+	if (SBITS_USING_VALUE_INDEX(state->parameters))
+	{	/* Run of (value, record number) entries for each erase block. Entries of erase block being filled are in buffer. */
+		if (state->valueSize <= 0 || state->valueSize > state->dataSize)
+			state->valueSize = state->dataSize;
+		state->valueEntriesPerPage = (state->pageSize - SBITS_VALUE_HEADER_SIZE) / SBITS_VALUE_ENTRY_SIZE(state);
+		uint32_t entries = (uint32_t) state->eraseSizeInPages * state->maxRecordsPerPage;
+		state->valueRunPages = (entries + state->valueEntriesPerPage - 1) / state->valueEntriesPerPage;
+		if (entries > 0xFFFF || state->bufferSizeInBlocks < SBITS_VALUE_BUILD_BUFFER + state->valueRunPages)
+		{
+			SBITS_ERROR(SBITS_EVENT_VALUE_BUFFERS, SBITS_VALUE_BUILD_BUFFER + state->valueRunPages);
+			state->parameters -= SBITS_USE_VALUE_INDEX;
+		}
+	}
+
+	if (SBITS_USING_WEAR_LEVEL(state->parameters) && (state->wearBlocks == NULL || SBITS_WEAR_NUM_BLOCKS(state) > 0xFFFF))
+	{
+		SBITS_ERROR(SBITS_EVENT_WEAR_BLOCKS);
+		state->parameters -= SBITS_USE_WEAR_LEVEL;
+	}
+
+	if (SBITS_USING_GAP_INDEX(state->parameters) && (state->gaps == NULL || state->maxGaps <= 0))
+	{
+		SBITS_ERROR(SBITS_EVENT_GAP_LIST);
+		state->parameters -= SBITS_USE_GAP_INDEX;
+	}
+
+	if (SBITS_USING_PROBE(state->parameters) && (state->probeBuffer == NULL || state->probePages < 2))
+	{
+		SBITS_ERROR(SBITS_EVENT_PROBE);
+		state->parameters -= SBITS_USE_PROBE;
+	}
+
+	if (!SBITS_USING_INDEX(state->parameters))
+		return;
+
+	state->maxIdxRecordsPerPage = (state->pageSize - 16) / state->bitmapSize;		/* 4 for id, 2 for count, 2 unused, 4 for minKey (pageId), 4 for maxKey (pageId) */
+	state->idxHeaderSize = SBITS_IDX_HEADER_SIZE;
+
+	if (SBITS_USING_COMPRESSED_INDEX(state->parameters))
+	{	/* Records are variable size. Minimum records on a full page is used to reserve index space and skip ahead. */
+		if (SBITS_USING_FINE_BMAP(state->parameters))
+		{
+			SBITS_ERROR(SBITS_EVENT_FINE_COMPRESSED);
+			state->parameters -= SBITS_USE_FINE_BMAP;
+		}
+		state->maxIdxRecordsPerPage = (state->pageSize - SBITS_IDX_HEADER_SIZE) / (1 + state->bitmapSize);
+	}
+
+	if (SBITS_USING_FINE_BMAP(state->parameters))
+	{	/* Fine bitmaps for each segment of eraseSizeInPages records are stored after the index page header */
+		if (state->fineBitmapSize <= 0 || state->fineBitmapSize > SBITS_MAX_FINE_BITMAP_SIZE || !SBITS_USING_BMAP(state->parameters)
+				|| SBITS_USING_HASH_BMAP(state->parameters) || SBITS_USING_MULTI_DIM(state->parameters) || SBITS_USING_RANGE_BMAP(state->parameters)
+				|| SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+		{
+			SBITS_ERROR(SBITS_EVENT_FINE_BMAP, SBITS_MAX_FINE_BITMAP_SIZE);
+			state->parameters -= SBITS_USE_FINE_BMAP;
+		}
+		else
+		{
+			count_t space = state->pageSize - SBITS_IDX_HEADER_SIZE;
+			while (state->maxIdxRecordsPerPage > 0 
+					&& SBITS_FINE_SEGMENTS(state, state->maxIdxRecordsPerPage) * state->fineBitmapSize + state->maxIdxRecordsPerPage * state->bitmapSize > space)
+				state->maxIdxRecordsPerPage--;
+			state->idxHeaderSize += SBITS_FINE_SEGMENTS(state, state->maxIdxRecordsPerPage) * state->fineBitmapSize;
+		}
+	}
+
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+	{	/* Bucket boundaries of index page follow header */
+		state->idxHeaderSize += SBITS_BOUNDS_SIZE;
+		state->maxIdxRecordsPerPage = (state->pageSize - state->idxHeaderSize) / (state->bitmapSize + SBITS_USING_COMPRESSED_INDEX(state->parameters));
+	}
+}
+
+/**
+@brief     	Returns number of index pages to reserve at end of storage.
+			Index space must cover all data pages plus an erase block, as the oldest index erase block is reclaimed
+			before the data pages it covers. Index space is a multiple of erase block size (minimum two erase blocks).
+@param     	state
+                SBITS algorithm state structure
+@param     	numPages
+                Number of pages in storage
+*/
+count_t sbitsNumIndexPages(sbitsState *state, id_t numPages)
+{
+	count_t numIdxPages = numPages / state->maxIdxRecordsPerPage + 1;
+	return ((numIdxPages + state->eraseSizeInPages - 1)/state->eraseSizeInPages + 1)*state->eraseSizeInPages;
+}
+
+/**
+@brief     	Chooses buffer count, query cache size, record directory density and whether to use bitmap and index
+			for a RAM and storage budget and workload. Caller must set pageSize, keySize, dataSize, eraseSizeInPages,
+			startAddress, and bitmapSize and functions before call. Caller then allocates buffer (bufferSizeInBlocks pages)
+			and query cache (queryCacheSize entries) before calling sbitsInit().
+@param     	state
+                SBITS algorithm state structure
+@param		ramBytes
+				RAM available for page buffers and query cache
+@param		storageBytes
+				Storage available for data and index
+@param		hints
+				Expected workload
+@param		estimate
+				Predicted I/O per operation (may be NULL)
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsConfigureForBudget(sbitsState *state, uint32_t ramBytes, uint32_t storageBytes, sbitsWorkloadHints *hints, sbitsCostEstimate *estimate)
+{
+	uint32_t ramLeft;
+	id_t numPages, numDataPages, numIdxPages = 0;
+
+	if (ramBytes < 2 * (uint32_t) state->pageSize)
+	{
+		SBITS_ERROR(SBITS_EVENT_BUDGET_RAM);
+		return -1;
+	}
+
+	/* Keep header and other options set by caller. Buffers, index, bitmap, record directory and query cache are chosen here. */
+	state->parameters &= SBITS_USE_MAX_MIN | SBITS_USE_SUM | SBITS_USE_FINE_BMAP | SBITS_USE_HASH_BMAP | SBITS_USE_MULTI_DIM | SBITS_USE_DERIVED_BMAP | SBITS_USE_COMPRESSED_INDEX | SBITS_USE_RANGE_BMAP | SBITS_USE_ADAPTIVE_BMAP | SBITS_USE_WEAR_LEVEL | SBITS_USE_GAP_INDEX | SBITS_USE_PROBE | SBITS_USE_WARM_START | SBITS_USE_VALUE_INDEX | SBITS_USE_PMEM;
+	state->bufferSizeInBlocks = 2;
+	state->queryCache = NULL;
+	state->queryCacheSize = 0;
+
+	/* Use whole erase blocks of storage. Set before layout, which divides storage between data, index and wear leveling blocks. */
+	numPages = storageBytes / state->pageSize;
+	numPages -= numPages % state->eraseSizeInPages;
+	state->endAddress = state->startAddress + numPages * state->pageSize;
+
+	if (hints->rangePercent > 0)
+	{	/* Bitmap to filter pages. Index avoids reading data pages if there is RAM for its two buffers. */
+		state->parameters |= SBITS_USE_BMAP;
+		if (ramBytes >= 4 * (uint32_t) state->pageSize)
+		{
+			state->parameters |= SBITS_USE_INDEX;
+			state->bufferSizeInBlocks = 4;
+		}
+	}
+	else
+	{	/* No data queries. Do not use space on pages for bitmap. */
+		state->bitmapSize = 0;
+		state->parameters &= ~SBITS_USE_FINE_BMAP;
+	}
+	int8_t buffers = state->bufferSizeInBlocks;
+
+	/* Value index uses page buffers from 4 up. Layout checks its run pages fit in all of the RAM and computes how many there are. */
+	if (SBITS_USING_VALUE_INDEX(state->parameters))
+		state->bufferSizeInBlocks = ramBytes / state->pageSize > INT8_MAX ? INT8_MAX : ramBytes / state->pageSize;
+
+	/* Record directory if a page has at least four chunks of records. Smaller chunks for selective queries. */
+	state->recordDirChunkSize = hints->selectivity < 25 ? 8 : 16;
+	sbitsInitLayout(state);
+	if (state->maxRecordsPerPage == 0)
+	{	/* Costs below are per record on a page */
+		SBITS_ERROR(SBITS_EVENT_BUDGET_RECORD, state->recordSize, state->pageSize);
+		return -1;
+	}
+	if (SBITS_USING_BMAP(state->parameters) && state->maxRecordsPerPage >= 4 * state->recordDirChunkSize)
+	{
+		state->parameters |= SBITS_USE_RECORD_DIR;
+		sbitsInitLayout(state);
+	}
+	if (SBITS_USING_VALUE_INDEX(state->parameters))
+		buffers = SBITS_VALUE_BUILD_BUFFER + state->valueRunPages;
+	state->bufferSizeInBlocks = buffers;
+	ramLeft = ramBytes - (uint32_t) state->bufferSizeInBlocks * state->pageSize;
+
+	/* Query cache with remaining RAM if queries repeat */
+	if (SBITS_USING_BMAP(state->parameters) && hints->repeatQueries && (size_t) state->bitmapSize <= sizeof(uint64_t))
+	{
+		uint32_t num = ramLeft / sizeof(sbitsQueryCacheEntry);
+		if (num > SBITS_BUDGET_MAX_QUERY_CACHE)
+			num = SBITS_BUDGET_MAX_QUERY_CACHE;
+		if (num > 0)
+		{
+			state->parameters |= SBITS_USE_QUERY_CACHE;
+			state->queryCacheSize = num;
+		}
+	}
+
+	if (SBITS_USING_INDEX(state->parameters))
+		numIdxPages = sbitsNumIndexPages(state, numPages);
+	numDataPages = numPages - numIdxPages;
+
+	SBITS_INFO(SBITS_EVENT_BUDGET, state->bufferSizeInBlocks, SBITS_USING_INDEX(state->parameters),
+			SBITS_USING_BMAP(state->parameters), SBITS_USING_RECORD_DIR(state->parameters) ? state->recordDirChunkSize : 0, state->queryCacheSize);
+
+	if (estimate == NULL)
+		return 0;
+
+	estimate->ramBytes = (uint32_t) state->bufferSizeInBlocks * state->pageSize + state->queryCacheSize * sizeof(sbitsQueryCacheEntry);
+
+	/* Put writes a page every maxRecordsPerPage records, and an index page every maxIdxRecordsPerPage data pages */
+	estimate->putIO = 1000 / state->maxRecordsPerPage;
+	if (SBITS_USING_INDEX(state->parameters))
+		estimate->putIO += 1000 / ((uint32_t) state->maxRecordsPerPage * state->maxIdxRecordsPerPage);
+
+	/* Get reads predicted page and, on average for irregular keys, half a page to correct the prediction */
+	#ifndef USE_BINARY_SEARCH
+	estimate->getIO = 1500;
+	#else
+	estimate->getIO = 1000;
+	for (id_t n = numDataPages; n > 1; n /= 2)
+		estimate->getIO += 1000;
+	#endif
+
+	/* Range query reads every data page unless index (or query cache for repeated queries) finds matching pages */
+	uint32_t matchIO = numDataPages * 10 * hints->selectivity;
+	estimate->rangeIO = numDataPages * 1000;
+	if (SBITS_USING_QUERY_CACHE(state->parameters))
+		estimate->rangeIO = matchIO;
+	else if (SBITS_USING_INDEX(state->parameters))
+		estimate->rangeIO = matchIO + (numDataPages / state->maxIdxRecordsPerPage + 1) * 1000;
+
+	SBITS_INFO(SBITS_EVENT_BUDGET_IO, estimate->putIO, estimate->getIO, estimate->rangeIO, estimate->ramBytes);
+	return 0;
+}
+
+/**
+@brief     	Swaps two value index entries.
+*/
+void swapValueEntries(uint8_t *a, uint8_t *b, count_t size)
+{
+	for (count_t i = 0; i < size; i++)
+	{
+		uint8_t t = a[i];
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+/**
+@brief     	Moves value index entry i down max-heap of n entries.
+*/
+void siftDownValueEntries(sbitsState *state, uint8_t *entries, uint32_t i, uint32_t n)
+{
+	count_t size = SBITS_VALUE_ENTRY_SIZE(state);
+	uint32_t child;
+
+	while ((child = 2*i + 1) < n)
+	{
+		if (child + 1 < n && state->compareData(entries + child*size, entries + (child+1)*size) < 0)
+			child++;
+		if (state->compareData(entries + i*size, entries + child*size) >= 0)
+			return;
+		swapValueEntries(entries + i*size, entries + child*size, size);
+		i = child;
+	}
+}
+
+/**
+@brief     	Adds value index entries for records of data page just written to entries of its erase block.
+			Once the last page of the erase block is written, entries are sorted by value (heapsort in place) and
+			written as the run of the erase block. Run is at the same position in value index file as erase block
+			is in data storage, so it is replaced when the erase block is reused.
+@param     	state
+                SBITS algorithm state structure
+@param		buffer
+				Data page
+@param		pageNum
+				Physical page id of data page
+*/
+void addValueIndexPage(sbitsState *state, void *buffer, id_t pageNum)
+{
+	uint8_t *entries = (uint8_t*) state->buffer + state->pageSize * SBITS_VALUE_BUILD_BUFFER;
+	count_t size = SBITS_VALUE_ENTRY_SIZE(state);
+	count_t count = SBITS_GET_COUNT(buffer);
+	count_t rec = (pageNum % state->eraseSizeInPages) * state->maxRecordsPerPage;
+
+	for (count_t i = 0; i < count; i++, rec++)
+	{	/* Entry is value followed by record number in erase block */
+		uint8_t *entry = entries + state->numValueEntries * size;
+		memcpy(entry, (uint8_t*) buffer + state->headerSize + i*state->recordSize + state->keySize, state->valueSize);
+		memcpy(entry + state->valueSize, &rec, sizeof(count_t));
+		state->numValueEntries++;
+	}
+
+	if ((pageNum + 1) % state->eraseSizeInPages != 0 && pageNum + 1 < state->endDataPage)
+		return;		/* Erase block is not full */
+
+	uint32_t n = state->numValueEntries;
+	for (uint32_t i = n / 2; i > 0; i--)
+		siftDownValueEntries(state, entries, i-1, n);
+	for (uint32_t i = n - 1; n > 0 && i > 0; i--)
+	{
+		swapValueEntries(entries, entries + i*size, size);
+		siftDownValueEntries(state, entries, 0, i);
+	}
+
+	/* Each run page has logical id of first data page of erase block and number of entries in run */
+	uint8_t *buf = (uint8_t*) state->buffer + state->pageSize * SBITS_VALUE_READ_BUFFER;
+	id_t firstPageId = *((id_t*) buffer) - pageNum % state->eraseSizeInPages;
+	id_t runPage = (pageNum / state->eraseSizeInPages) * state->valueRunPages;
+	for (count_t i = 0; i == 0 || i * state->valueEntriesPerPage < n; i++)
+	{
+		count_t num = n - i * state->valueEntriesPerPage;
+		if (num > state->valueEntriesPerPage)
+			num = state->valueEntriesPerPage;
+		memcpy(buf, &firstPageId, sizeof(id_t));
+		memcpy(buf + SBITS_VALUE_COUNT_OFFSET, &state->numValueEntries, sizeof(count_t));
+		memcpy(buf + SBITS_VALUE_HEADER_SIZE, entries + i * state->valueEntriesPerPage * size, num * size);
+
+		fseek(state->valueIndexFile, (runPage + i) * state->pageSize, SEEK_SET);
+		if (fwrite(buf, state->pageSize, 1, state->valueIndexFile) == 0)
+			SBITS_ERROR(SBITS_EVENT_VALUE_WRITE, runPage + i);
+		state->numIdxWrites++;
+	}
+	state->bufferedValuePageId = -1;
+	state->numValueEntries = 0;
+}
+
+/* Warm start file content before hot page ids and query cache entries */
+typedef struct {
+	uint32_t 	magic;
+	uint32_t 	endAddress;
+	count_t 	pageSize;
+	uint32_t 	parameters;
+	int8_t 		recordSize;
+	int8_t 		bitmapSize;
+	count_t 	headerSize;
+	int8_t 		wrappedMemory;
+	int8_t 		wrappedIdxMemory;
+	id_t 		nextPageId;
+	id_t 		nextPageWriteId;
+	id_t 		firstDataPage;
+	id_t 		firstDataPageId;
+	id_t 		erasedEndPage;
+	int32_t 	minKey;
+	id_t 		avgKeyDiff;
+	id_t 		nextIdxPageId;
+	id_t 		nextIdxPageWriteId;
+	id_t 		firstIdxPage;
+	id_t 		erasedEndIdxPage;
+	int8_t 		numHotPages;
+	int8_t 		queryCacheSize;
+	int32_t 	bitmapMin;
+	int32_t 	bitmapMax;
+	int32_t 	segmentMin;
+	int32_t 	segmentMax;
+	uint32_t 	segmentCount;
+	uint32_t 	segmentEdgeCount;
+	uint16_t 	wearNumBlocks;					/* Wear block entries after header (if SBITS_USE_WEAR_LEVEL) */
+	id_t 		wearErases[2];
+	int32_t 	maxKey;
+	int16_t 	maxGaps;						/* Gap list entries after query cache (if SBITS_USE_GAP_INDEX) */
+	int16_t 	numGaps;
+	int16_t 	nextGap;
+	int32_t 	gapsFromKey;
+} sbitsWarmHeader;
+
+#define SBITS_WARM_MAGIC	0x53425457
+
+/* Parameters that change page layout. Warm start requires same values. */
+#define SBITS_LAYOUT_PARAMETERS	(SBITS_USE_INDEX | SBITS_USE_MAX_MIN | SBITS_USE_SUM | SBITS_USE_BMAP | SBITS_USE_FINE_BMAP | SBITS_USE_RECORD_DIR | SBITS_USE_HASH_BMAP | SBITS_USE_MULTI_DIM | SBITS_USE_DERIVED_BMAP | SBITS_USE_COMPRESSED_INDEX | SBITS_USE_RANGE_BMAP | SBITS_USE_VALUE_INDEX | SBITS_USE_ADAPTIVE_BMAP | SBITS_USE_WEAR_LEVEL)
+
+/**
+@brief     	Adds page to list of recently read pages if not already in list.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Physical page id (index pages flagged with SBITS_HOT_INDEX_PAGE)
+*/
+void addHotPage(sbitsState *state, id_t pageNum)
+{
+	for (int8_t i = 0; i < state->numHotPages; i++)
+		if (state->hotPages[i] == pageNum)
+			return;
+
+	if (state->prefetching)
+		return;		/* List is being prefetched */
+
+	if (state->numHotPages < SBITS_HOT_PAGES)
+		state->hotPages[state->numHotPages++] = pageNum;
+	else
+	{	/* Replace oldest */
+		state->hotPages[state->nextHotPage] = pageNum;
+		state->nextHotPage = (state->nextHotPage + 1) % SBITS_HOT_PAGES;
+	}
+}
+
+/**
+@brief     	Copies storage location state into warm start header.
+@param     	state
+                SBITS algorithm state structure
+@param		hdr
+				Warm start header
+*/
+void fillWarmHeader(sbitsState *state, sbitsWarmHeader *hdr)
+{
+	hdr->magic = SBITS_WARM_MAGIC;
+	hdr->endAddress = state->endAddress;
+	hdr->pageSize = state->pageSize;
+	hdr->parameters = state->parameters & SBITS_LAYOUT_PARAMETERS;
+	hdr->recordSize = state->recordSize;
+	hdr->bitmapSize = state->bitmapSize;
+	hdr->headerSize = state->headerSize;
+	hdr->wrappedMemory = state->wrappedMemory;
+	hdr->wrappedIdxMemory = state->wrappedIdxMemory;
+	hdr->nextPageId = state->nextPageId;
+	hdr->nextPageWriteId = state->nextPageWriteId;
+	hdr->firstDataPage = state->firstDataPage;
+	hdr->firstDataPageId = state->firstDataPageId;
+	hdr->erasedEndPage = state->erasedEndPage;
+	hdr->minKey = state->minKey;
+	hdr->avgKeyDiff = state->avgKeyDiff;
+	hdr->nextIdxPageId = state->nextIdxPageId;
+	hdr->nextIdxPageWriteId = state->nextIdxPageWriteId;
+	hdr->firstIdxPage = state->firstIdxPage;
+	hdr->erasedEndIdxPage = state->erasedEndIdxPage;
+	hdr->numHotPages = state->numHotPages;
+	hdr->queryCacheSize = state->queryCacheSize;
+	hdr->bitmapMin = state->bitmapMin;
+	hdr->bitmapMax = state->bitmapMax;
+	hdr->segmentMin = state->segmentMin;
+	hdr->segmentMax = state->segmentMax;
+	hdr->segmentCount = state->segmentCount;
+	hdr->segmentEdgeCount = state->segmentEdgeCount;
+	hdr->wearNumBlocks = SBITS_USING_WEAR_LEVEL(state->parameters) ? state->wearNumBlocks : 0;
+	hdr->wearErases[0] = state->wearErases[0];
+	hdr->wearErases[1] = state->wearErases[1];
+	hdr->maxKey = state->maxKey;
+	hdr->maxGaps = SBITS_USING_GAP_INDEX(state->parameters) ? state->maxGaps : 0;
+	hdr->numGaps = state->numGaps;
+	hdr->nextGap = state->nextGap;
+	hdr->gapsFromKey = state->gapsFromKey;
+}
+
+/**
+@brief     	Saves storage location state, recently read page ids and query cache so that the next sbitsInit()
+			with SBITS_USE_WARM_START reopens the stored data and warms up. Call after sbitsFlush() at shutdown.
+@param     	state
+                SBITS state structure
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsCheckpoint(sbitsState *state)
+{
+	sbitsWarmHeader hdr;
+	fillWarmHeader(state, &hdr);
+
+	SD_FILE *fp = fopen("warmfile.bin", "w+b");
+	if (fp == NULL)
+	{
+		SBITS_ERROR(SBITS_EVENT_WARM_OPEN);
+		return -1;
+	}
+
+	int8_t err = fwrite(&hdr, sizeof(hdr), 1, fp) == 0;
+	if (hdr.wearNumBlocks > 0)
+		err |= fwrite(state->wearBlocks, sizeof(sbitsWearBlock) * hdr.wearNumBlocks, 1, fp) == 0;
+	if (hdr.numHotPages > 0)
+		err |= fwrite(state->hotPages, sizeof(id_t) * hdr.numHotPages, 1, fp) == 0;
+	if (hdr.queryCacheSize > 0)
+		err |= fwrite(state->queryCache, sizeof(sbitsQueryCacheEntry) * hdr.queryCacheSize, 1, fp) == 0;
+	if (hdr.maxGaps > 0)
+		err |= fwrite(state->gaps, sizeof(sbitsGap) * hdr.maxGaps, 1, fp) == 0;
+	fclose(fp);
+	return err ? -1 : 0;
+}
+
+/**
+@brief     	Returns 1 if warm start header has magic value and was saved with the same configuration, 0 otherwise.
+*/
+int8_t warmHeaderMatches(sbitsState *state, sbitsWarmHeader *hdr, uint32_t magic)
+{
+	return hdr->magic == magic && hdr->endAddress == state->endAddress 
+			&& hdr->pageSize == state->pageSize && hdr->parameters == (state->parameters & SBITS_LAYOUT_PARAMETERS)
+			&& hdr->recordSize == state->recordSize && hdr->bitmapSize == state->bitmapSize
+			&& hdr->headerSize == state->headerSize && hdr->numHotPages <= SBITS_HOT_PAGES
+			&& hdr->wearNumBlocks == (SBITS_USING_WEAR_LEVEL(state->parameters) ? state->wearNumBlocks : 0);
+}
+
+/**
+@brief     	Reads warm start file saved by sbitsCheckpoint() if it matches the configuration.
+@param     	state
+                SBITS algorithm state structure
+@param		hdr
+				Warm start file header read
+@return		Return open warm start file positioned after header if it can be used, NULL otherwise.
+*/
+SD_FILE* openWarmStart(sbitsState *state, sbitsWarmHeader *hdr)
+{
+	SD_FILE *fp = fopen("warmfile.bin", "r+b");
+	if (fp == NULL)
+		return NULL;
+
+	if (fread(hdr, sizeof(sbitsWarmHeader), 1, fp) == 0 || !warmHeaderMatches(state, hdr, SBITS_WARM_MAGIC))
+	{
+		SBITS_WARN(SBITS_EVENT_WARM_MISMATCH);
+		fclose(fp);
+		return NULL;
+	}
+
+	/* Block map is needed to find stored pages */
+	if (hdr->wearNumBlocks > 0 && fread(state->wearBlocks, sizeof(sbitsWearBlock) * hdr->wearNumBlocks, 1, fp) == 0)
+	{
+		for (uint16_t i = 0; i < state->wearNumBlocks; i++)
+		{
+			state->wearBlocks[i].block = i;
+			state->wearBlocks[i].erases = 0;
+		}
+		SBITS_WARN(SBITS_EVENT_WARM_MISMATCH);
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/**
+@brief     	Restores storage location state, hot page list and query cache from warm start file.
+			Hot pages are sorted in physical order (data pages before index pages) for prefetching.
+@param     	state
+                SBITS algorithm state structure
+@param		hdr
+				Warm start file header
+@param		fp
+				Warm start file positioned after header (NULL if restoring from persistent memory)
+*/
+void restoreWarmStart(sbitsState *state, sbitsWarmHeader *hdr, SD_FILE *fp)
+{
+	state->wrappedMemory = hdr->wrappedMemory;
+	state->wrappedIdxMemory = hdr->wrappedIdxMemory;
+	state->nextPageId = hdr->nextPageId;
+	state->nextPageWriteId = hdr->nextPageWriteId;
+	state->firstDataPage = hdr->firstDataPage;
+	state->firstDataPageId = hdr->firstDataPageId;
+	state->erasedEndPage = hdr->erasedEndPage;
+	state->minKey = hdr->minKey;
+	state->avgKeyDiff = hdr->avgKeyDiff;
+	state->nextIdxPageId = hdr->nextIdxPageId;
+	state->nextIdxPageWriteId = hdr->nextIdxPageWriteId;
+	state->firstIdxPage = hdr->firstIdxPage;
+	state->erasedEndIdxPage = hdr->erasedEndIdxPage;
+	state->bitmapMin = hdr->bitmapMin;
+	state->bitmapMax = hdr->bitmapMax;
+	state->segmentMin = hdr->segmentMin;
+	state->segmentMax = hdr->segmentMax;
+	state->segmentCount = hdr->segmentCount;
+	state->segmentEdgeCount = hdr->segmentEdgeCount;
+	state->wearErases[0] = hdr->wearErases[0];
+	state->wearErases[1] = hdr->wearErases[1];
+	state->maxKey = hdr->maxKey;
+
+	/* Gap list is only restored if it is the same size. Otherwise, it has gaps after the last key. */
+	state->gapsFromKey = hdr->maxKey;
+	if (SBITS_USING_GAP_INDEX(state->parameters) && hdr->maxGaps == state->maxGaps)
+	{
+		state->numGaps = hdr->numGaps;
+		state->nextGap = hdr->nextGap;
+		state->gapsFromKey = hdr->gapsFromKey;
+	}
+
+	if (state->indexFile != NULL)
+		initIndexBufferPage(state, state->nextPageId);
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters) && state->boundsOffset != 0)
+		setPageBounds(state, state->buffer, state->boundsOffset);
+
+	state->numHotPages = 0;
+	if (fp != NULL && hdr->numHotPages > 0 && fread(state->hotPages, sizeof(id_t) * hdr->numHotPages, 1, fp) != 0)
+		state->numHotPages = hdr->numHotPages;
+
+	/* Query cache entries are only restored if cache is the same size */
+	if (fp != NULL && state->queryCache != NULL && hdr->queryCacheSize == state->queryCacheSize)
+	{
+		fseek(fp, sizeof(sbitsWarmHeader) + hdr->wearNumBlocks * sizeof(sbitsWearBlock) + hdr->numHotPages * sizeof(id_t), SEEK_SET);
+		if (fread(state->queryCache, sizeof(sbitsQueryCacheEntry) * state->queryCacheSize, 1, fp) == 0)
+			sbitsClearQueryCache(state);
+	}
+
+	if (fp != NULL && state->numGaps > 0)
+	{
+		fseek(fp, sizeof(sbitsWarmHeader) + hdr->wearNumBlocks * sizeof(sbitsWearBlock) + hdr->numHotPages * sizeof(id_t)
+				+ hdr->queryCacheSize * sizeof(sbitsQueryCacheEntry), SEEK_SET);
+		if (fread(state->gaps, sizeof(sbitsGap) * state->maxGaps, 1, fp) == 0)
+		{
+			state->numGaps = 0;
+			state->nextGap = 0;
+			state->gapsFromKey = hdr->maxKey;
+		}
+	}
+
+	/* Sort hot pages by physical location */
+	for (int8_t i = 1; i < state->numHotPages; i++)
+	{
+		id_t pageNum = state->hotPages[i];
+		int8_t j = i - 1;
+		for ( ; j >= 0 && state->hotPages[j] > pageNum; j--)
+			state->hotPages[j+1] = state->hotPages[j];
+		state->hotPages[j+1] = pageNum;
+	}
+	state->nextHotPage = 0;
+	state->prefetching = state->numHotPages > 0;
+
+	if (state->valueIndexFile != NULL && state->nextPageWriteId < state->endDataPage)
+	{	/* Rebuild value index entries of erase block being filled */
+		for (id_t pageNum = state->nextPageWriteId - state->nextPageWriteId % state->eraseSizeInPages; pageNum < state->nextPageWriteId; pageNum++)
+			if (readPage(state, pageNum) == 0)
+				addValueIndexPage(state, state->buffer + state->pageSize, pageNum);
+	}
+	SBITS_INFO(SBITS_EVENT_WARM_START, state->nextPageId, state->numHotPages);
+}
+
+/* Persistent memory is a selector byte (slot 0 or 1) followed by two slots. Each slot has a warm start header, the
+	bitmap of the output page, the output page, the index write page, the wear block map and the gap list. Page writes and flushes
+	save state in the other slot, then switch the selector, so a slot is always consistent. Each put adds its record
+	to the current slot and writes the page header with the count last. */
+#define SBITS_PMEM_MAGIC		0x53425450
+#define SBITS_PMEM_SLOTS		4							/* Offset of first slot */
+#define SBITS_PMEM_BITMAP		sizeof(sbitsWarmHeader)		/* Offsets in slot */
+#define SBITS_PMEM_PAGE			(SBITS_PMEM_BITMAP + SBITS_MAX_BITMAP_SIZE)
+#define SBITS_PMEM_INDEX_PAGE(s)	(SBITS_PMEM_PAGE + (s)->pageSize)
+#define SBITS_PMEM_WEAR(s)		(SBITS_PMEM_PAGE + 2 * (uint32_t) (s)->pageSize)
+
+/**
+@brief     	Returns offset of gap list in persistent memory slot.
+*/
+uint32_t pmemGapOffset(sbitsState *state)
+{
+	uint32_t offset = SBITS_PMEM_WEAR(state);
+	if (SBITS_USING_WEAR_LEVEL(state->parameters))
+		offset += SBITS_WEAR_NUM_BLOCKS(state) * sizeof(sbitsWearBlock);
+	return offset;
+}
+
+/**
+@brief     	Returns bytes in persistent memory slot.
+*/
+uint32_t pmemSlotSize(sbitsState *state)
+{
+	uint32_t size = pmemGapOffset(state);
+	if (SBITS_USING_GAP_INDEX(state->parameters))
+		size += state->maxGaps * sizeof(sbitsGap);
+	return size;
+}
+
+/**
+@brief     	Returns bytes of persistent memory used. Call before sbitsInit() after setting page size, storage
+			addresses, erase size and parameters.
+@param     	state
+                SBITS state structure
+*/
+uint32_t sbitsPmemSize(sbitsState *state)
+{
+	return SBITS_PMEM_SLOTS + 2 * pmemSlotSize(state);
+}
+
+/**
+@brief     	Writes bytes at offset in current persistent memory slot.
+*/
+void pmemStore(sbitsState *state, uint32_t offset, const void *data, uint32_t length)
+{
+	state->pmemWrite(state->pmem, state->pmemSlot + offset, data, length);
+	state->pmemBytes += length;
+}
+
+/**
+@brief     	Saves storage location state, output page and index write page in the unused persistent memory slot
+			and makes it the current slot. Called after page writes, so that no page is written twice or lost.
+@param     	state
+                SBITS algorithm state structure
+*/
+void pmemCommit(sbitsState *state)
+{
+	sbitsWarmHeader hdr;
+	fillWarmHeader(state, &hdr);
+	hdr.magic = SBITS_PMEM_MAGIC;
+	hdr.numHotPages = 0;
+	hdr.queryCacheSize = 0;
+
+	/* Pages written must be in storage before the slot that says they are is used */
+	fflush(state->file);
+	if (state->indexFile != NULL && state->indexFile != state->file)
+		fflush(state->indexFile);
+	if (state->valueIndexFile != NULL)
+		fflush(state->valueIndexFile);
+
+	uint8_t slot = state->pmemSlot == SBITS_PMEM_SLOTS;
+	state->pmemSlot = SBITS_PMEM_SLOTS + slot * pmemSlotSize(state);
+
+	pmemStore(state, 0, &hdr, sizeof(hdr));
+	pmemStore(state, SBITS_PMEM_BITMAP, state->pageBitmap, SBITS_MAX_BITMAP_SIZE);
+	pmemStore(state, SBITS_PMEM_PAGE, state->buffer, state->headerSize + SBITS_GET_COUNT(state->buffer) * state->recordSize);
+	if (state->indexFile != NULL)
+		pmemStore(state, SBITS_PMEM_INDEX_PAGE(state), state->buffer + SBITS_INDEX_WRITE_BUFFER * state->pageSize, state->pageSize);
+	if (hdr.wearNumBlocks > 0)
+		pmemStore(state, SBITS_PMEM_WEAR(state), state->wearBlocks, hdr.wearNumBlocks * sizeof(sbitsWearBlock));
+	if (hdr.numGaps > 0)
+		pmemStore(state, pmemGapOffset(state), state->gaps, hdr.numGaps * sizeof(sbitsGap));
+
+	state->pmemWrite(state->pmem, 0, &slot, 1);
+	state->pmemBytes++;
+}
+
+/**
+@brief     	Saves record just added to output page in current persistent memory slot. Page header is written last
+			so that the record count only includes complete records.
+@param     	state
+                SBITS algorithm state structure
+@param		rec
+				Record number on output page
+*/
+void pmemSaveRecord(sbitsState *state, count_t rec)
+{
+	count_t offset = state->headerSize + rec * state->recordSize;
+	pmemStore(state, SBITS_PMEM_PAGE + offset, state->buffer + offset, state->recordSize);
+
+	if (rec == 0)
+		pmemStore(state, offsetof(sbitsWarmHeader, minKey), &state->minKey, sizeof(int32_t));
+	if (SBITS_USING_BMAP(state->parameters) && state->bitmapOffset == 0)
+		pmemStore(state, SBITS_PMEM_BITMAP, state->pageBitmap, state->bitmapSize);
+	if (SBITS_USING_FINE_BMAP(state->parameters) && state->indexFile != NULL)
+		pmemStore(state, SBITS_PMEM_INDEX_PAGE(state), state->buffer + SBITS_INDEX_WRITE_BUFFER * state->pageSize, state->idxHeaderSize);
+	if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+	{
+		int32_t segment[4] = { state->segmentMin, state->segmentMax, (int32_t) state->segmentCount, (int32_t) state->segmentEdgeCount };
+		pmemStore(state, offsetof(sbitsWarmHeader, segmentMin), segment, sizeof(segment));
+	}
+	pmemStore(state, SBITS_PMEM_PAGE, state->buffer, state->headerSize);
+}
+
+/**
+@brief     	Saves gap list entry just added and gap list position in current persistent memory slot.
+@param     	state
+                SBITS algorithm state structure
+@param		i
+				Gap list entry
+*/
+void pmemSaveGap(sbitsState *state, int16_t i)
+{
+	pmemStore(state, pmemGapOffset(state) + i * sizeof(sbitsGap), &state->gaps[i], sizeof(sbitsGap));
+	pmemStore(state, offsetof(sbitsWarmHeader, numGaps), &state->numGaps, sizeof(int16_t));
+	pmemStore(state, offsetof(sbitsWarmHeader, nextGap), &state->nextGap, sizeof(int16_t));
+	pmemStore(state, offsetof(sbitsWarmHeader, gapsFromKey), &state->gapsFromKey, sizeof(int32_t));
+}
+
+/**
+@brief     	Reads header of current persistent memory slot and the wear block map.
+@param     	state
+                SBITS algorithm state structure
+@param		hdr
+				Header read
+@return		Return 1 if persistent memory has state saved with the same configuration, 0 otherwise.
+*/
+int8_t openPmem(sbitsState *state, sbitsWarmHeader *hdr)
+{
+	uint8_t slot;
+	state->pmemRead(state->pmem, 0, &slot, 1);
+	if (slot > 1)
+		return 0;
+
+	state->pmemSlot = SBITS_PMEM_SLOTS + slot * pmemSlotSize(state);
+	state->pmemRead(state->pmem, state->pmemSlot, hdr, sizeof(sbitsWarmHeader));
+	if (!warmHeaderMatches(state, hdr, SBITS_PMEM_MAGIC))
+	{
+		state->pmemSlot = 0;
+		return 0;
+	}
+	if (hdr->wearNumBlocks > 0)
+		state->pmemRead(state->pmem, state->pmemSlot + SBITS_PMEM_WEAR(state), state->wearBlocks, hdr->wearNumBlocks * sizeof(sbitsWearBlock));
+	return 1;
+}
+
+/**
+@brief     	Restores storage location state, output page and index write page from current persistent memory slot.
+@param     	state
+                SBITS algorithm state structure
+@param		hdr
+				Header of current slot
+*/
+void restorePmem(sbitsState *state, sbitsWarmHeader *hdr)
+{
+	restoreWarmStart(state, hdr, NULL);
+
+	uint32_t slot = state->pmemSlot;
+	state->pmemRead(state->pmem, slot + SBITS_PMEM_BITMAP, state->pageBitmap, SBITS_MAX_BITMAP_SIZE);
+	state->pmemRead(state->pmem, slot + SBITS_PMEM_PAGE, state->buffer, state->headerSize);
+	count_t count = SBITS_GET_COUNT(state->buffer);
+	if (count > state->maxRecordsPerPage)
+		count = SBITS_GET_COUNT(state->buffer) = 0;
+	state->pmemRead(state->pmem, slot + SBITS_PMEM_PAGE + state->headerSize, state->buffer + state->headerSize, count * state->recordSize);
+	if (state->indexFile != NULL)
+		state->pmemRead(state->pmem, slot + SBITS_PMEM_INDEX_PAGE(state), state->buffer + SBITS_INDEX_WRITE_BUFFER * state->pageSize, state->pageSize);
+	if (state->numGaps > 0)
+		state->pmemRead(state->pmem, slot + pmemGapOffset(state), state->gaps, state->numGaps * sizeof(sbitsGap));
+	if (count > 0)
+		state->maxKey = sbitsReadInt32(state->buffer + state->headerSize + (count - 1) * state->recordSize);
+	SBITS_INFO(SBITS_EVENT_PMEM_START, count);
+}
+
+/**
+@brief     	Reads the next page saved as recently read by the last checkpoint (in physical order).
+			Call when idle after a warm start until it returns 0.
+@param     	state
+                SBITS state structure
+@return		Return 1 if a page was read and more remain, 0 if no more pages to prefetch.
+*/
+int8_t sbitsPrefetch(sbitsState *state)
+{
+	if (!state->prefetching)
+		return 0;
+
+	id_t pageNum = state->hotPages[state->nextHotPage++];
+	if (pageNum & SBITS_HOT_INDEX_PAGE)
+	{
+		if (state->indexFile != NULL)
+			readIndexPage(state, pageNum & ~SBITS_HOT_INDEX_PAGE);
+	}
+	else
+		readPage(state, pageNum);
+
+	if (state->nextHotPage < state->numHotPages)
+		return 1;
+
+	/* Done. List continues as recently read pages. */
+	state->prefetching = 0;
+	state->nextHotPage = 0;
+	return 0;
+}
+
+/**
+@brief     	Initialize SBITS structure.
+@param     	state
+                SBITS algorithm state structure
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsInit(sbitsState *state)
+{
+	SBITS_INFO(SBITS_EVENT_INIT);
+	SBITS_INFO(SBITS_EVENT_INIT_BUFFERS, state->bufferSizeInBlocks, state->pageSize);	
+	SBITS_INFO(SBITS_EVENT_INIT_OPTIONS, SBITS_USING_INDEX(state->parameters), SBITS_USING_MAX_MIN(state->parameters),
+								SBITS_USING_SUM(state->parameters), SBITS_USING_BMAP(state->parameters));
+	
+	state->file = NULL;
+ 	state->indexFile = NULL;
+	state->valueIndexFile = NULL;
+	state->dataMap = NULL;
+	state->indexMap = NULL;
+	state->nextPageId = 0;
+	state->nextPageWriteId = 0;
+	state->wrappedMemory = 0;
+
+	state->minKey = 0;
+	state->maxKey = 0;
+	state->numGaps = 0;
+	state->nextGap = 0;
+	state->gapsFromKey = 0;
+	state->probeBias = 0;
+	state->probeSpread = 0;
+	state->bufferedPageId = -1;
+	state->bufferedIndexPageId = -1;
+	state->bufferedValuePageId = -1;
+	state->numValueEntries = 0;
+	state->segmentCount = 0;
+	state->segmentEdgeCount = 0;
+	state->numHotPages = 0;
+	state->nextHotPage = 0;
+	state->prefetching = 0;
+	state->pmemSlot = 0;
+	if (SBITS_USING_PMEM(state->parameters) && (state->pmemRead == NULL || state->pmemWrite == NULL))
+	{
+		SBITS_ERROR(SBITS_EVENT_PMEM);
+		state->parameters -= SBITS_USE_PMEM;
+	}
+
+	/* Calculate header sizes and number of records per data and index page */
+	sbitsInitLayout(state);
+	SBITS_INFO(SBITS_EVENT_INIT_RECORD, state->recordSize);
+	SBITS_INFO(SBITS_EVENT_INIT_PAGE, state->headerSize, state->maxRecordsPerPage);	
+#if defined(SBITS_ALIGN_RECORDS)
+	if (state->keySize % SBITS_ALIGN_RECORDS != 0)
+	{
+		SBITS_ERROR(SBITS_EVENT_ALIGN_KEY, SBITS_ALIGN_RECORDS);
+		return -1;
+	}
+	/* Padding of header and records costs space on every page */
+	SBITS_INFO(SBITS_EVENT_ALIGN, SBITS_ALIGN_RECORDS,
+			state->recordSize - state->keySize - state->dataSize, (state->pageSize - state->headerSize) / (state->keySize + state->dataSize));
+#endif
+	 
+	/* Allocate first page of buffer as output page. There is no previous record for a derived value. */
+	memset(state->buffer, 0, state->pageSize);
+	initBufferPage(state, 0); 
+  	resetStats(state);
+
+	/* Query cache is only used with bitmaps that fit in the 64-bit query bitmap and have the same boundaries for all pages */
+	if (SBITS_USING_QUERY_CACHE(state->parameters) && SBITS_USING_BMAP(state->parameters) && state->queryCache != NULL 
+			&& state->queryCacheSize > 0 && (size_t) state->bitmapSize <= sizeof(uint64_t) && !SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+	{
+		sbitsClearQueryCache(state);
+	}
+	else
+	{
+		state->queryCache = NULL;
+		state->queryCacheSize = 0;
+	}
+
+	id_t numPages = (state->endAddress - state->startAddress) / state->pageSize;
+
+	if (numPages < (id_t) (SBITS_USING_INDEX(state->parameters)*2+2+SBITS_USING_WEAR_LEVEL(state->parameters)) * state->eraseSizeInPages)
+	{
+		SBITS_ERROR(SBITS_EVENT_STORAGE_SIZE, numPages);		
+		return -1;
+	}
+
+	state->startDataPage = 0;
+	state->endDataPage = state->endAddress / state->pageSize;	
+	if (SBITS_USING_WEAR_LEVEL(state->parameters))
+	{	/* Data blocks, index blocks and one spare block in one file. Block map starts as identity. */
+		state->wearNumBlocks = SBITS_WEAR_NUM_BLOCKS(state);
+		state->endDataPage = (id_t) (state->wearNumBlocks - 1) * state->eraseSizeInPages;
+		for (uint16_t i = 0; i < state->wearNumBlocks; i++)
+		{
+			state->wearBlocks[i].block = i;
+			state->wearBlocks[i].erases = 0;
+		}
+		state->wearErases[0] = 0;
+		state->wearErases[1] = 0;
+	}
+	state->firstDataPage = 0;
+	state->firstDataPageId = 0;
+	state->erasedEndPage = 0;	
+	state->avgKeyDiff = 1;	
+
+	/* Reopen existing files if there is a matching warm start file */
+	sbitsWarmHeader warmHeader;
+	SD_FILE *warmFile = NULL;
+	if (SBITS_USING_WARM_START(state->parameters))
+		warmFile = openWarmStart(state, &warmHeader);
+	int8_t reopen = warmFile != NULL;
+	int8_t pmemRestore = SBITS_USING_PMEM(state->parameters) && openPmem(state, &warmHeader);
+	if (pmemRestore)
+	{	/* Persistent memory has latest state. Warm start file may be older. */
+		if (warmFile != NULL)
+			fclose(warmFile);
+		warmFile = NULL;
+		reopen = 1;
+	}
+
+ 	/* Setup data file. */    
+	if (reopen)
+		state->file = fopen("datafile.bin", "r+b");
+	if (state->file == NULL)
+	    state->file = fopen("datafile.bin", "w+b");	
+    if (state->file == NULL) 
+	{
+        SBITS_ERROR(SBITS_EVENT_FILE_OPEN);
+        return -1;
+    }   	
+
+	if (SBITS_USING_INDEX(state->parameters))
+	{	/* Allocate file and buffer for index */
+		/* Setup index file. Index blocks are in data file with wear leveling. */  			
+		if (SBITS_USING_WEAR_LEVEL(state->parameters))
+			state->indexFile = state->file;
+		if (reopen && state->indexFile == NULL)
+			state->indexFile = fopen("idxfile.bin", "r+b");
+		if (state->indexFile == NULL)
+			state->indexFile = fopen("idxfile.bin", "w+b");
+		if (state->indexFile == NULL) 
+		{
+			SBITS_ERROR(SBITS_EVENT_INDEX_OPEN);
+			return -1;
+		}
+		SBITS_INFO(SBITS_EVENT_INDEX_PAGE, state->maxIdxRecordsPerPage);
+
+		/* Allocate third page of buffer as index output page. Page id of first index record is next data page. */
+		initIndexBufferPage(state, state->nextPageId);
+		
+		state->nextIdxPageId = 0;
+		state->nextIdxPageWriteId = 0;
+
+		count_t numIdxPages = sbitsNumIndexPages(state, numPages);
+		
+		/* Index pages are at the end of the memory space */
+		state->endIdxPage = state->endDataPage;
+		state->endDataPage -= numIdxPages;
+		state->startIdxPage = state->endDataPage+1;		
+		// state->firstIdxPage = state->startIdxPage;
+		state->firstIdxPage =0;		/* TODO: Decide how to handle if share memory space. For now, having logical pages start from 0 rather than the physical page id after the data block */
+		state->erasedEndIdxPage = 0;
+		state->wrappedIdxMemory = 0;
+	}
+
+	if (SBITS_USING_VALUE_INDEX(state->parameters))
+	{	/* Runs for each data erase block in same order as data */
+		if (reopen)
+			state->valueIndexFile = fopen("validxfile.bin", "r+b");
+		if (state->valueIndexFile == NULL)
+			state->valueIndexFile = fopen("validxfile.bin", "w+b");
+		if (state->valueIndexFile == NULL) 
+		{
+			SBITS_ERROR(SBITS_EVENT_VALUE_OPEN);
+			return -1;
+		}
+		SBITS_INFO(SBITS_EVENT_VALUE_PAGE, state->valueEntriesPerPage, state->valueRunPages);
+	}
+
+	if (warmFile != NULL)
+	{
+		restoreWarmStart(state, &warmHeader, warmFile);
+		fclose(warmFile);
+	}
+	if (pmemRestore)
+		restorePmem(state, &warmHeader);
+	else if (SBITS_USING_PMEM(state->parameters))
+		pmemCommit(state);
+	return 0;
+}
+
+/**
+@brief     	Encodes bitmap as compressed index record. A sparse bitmap is stored as the number of set buckets
+			followed by the bucket numbers. Otherwise, it is stored as SBITS_IDX_RAW followed by the bitmap.
+@param     	state
+                SBITS algorithm state structure
+@param     	bm
+                Bitmap
+@param     	rec
+                Record created (at most 1 + bitmapSize bytes)
+@return		Return size of record in bytes.
+*/
+count_t sbitsEncodeIndexRecord(sbitsState *state, uint8_t *bm, uint8_t *rec)
+{
+	uint8_t n = 0;
+
+	for (uint16_t i = 0; i < state->bitmapSize * 8; i++)
+	{
+		if ((bm[i >> 3] & (128 >> (i & 7))) == 0)
+			continue;
+		if (n + 1 >= state->bitmapSize)
+		{	/* List would not be smaller than bitmap */
+			rec[0] = SBITS_IDX_RAW;
+			memcpy(rec + 1, bm, state->bitmapSize);
+			return 1 + state->bitmapSize;
+		}
+		rec[1 + n++] = (uint8_t) i;
+	}
+	rec[0] = n;
+	return 1 + n;
+}
+
+/**
+@brief     	Returns size of compressed index record in bytes.
+*/
+count_t sbitsIndexRecordSize(sbitsState *state, uint8_t *rec)
+{
+	return rec[0] == SBITS_IDX_RAW ? 1 + state->bitmapSize : 1 + rec[0];
+}
+
+/**
+@brief     	Tests query bitmap against compressed index record without decoding it.
+@return		Return 1 if page of index record may have matching records, 0 otherwise.
+*/
+int8_t sbitsMatchIndexRecord(sbitsState *state, uint8_t *query, uint8_t *rec)
+{
+	if (rec[0] == SBITS_IDX_RAW)
+		return bitmapMatch(state, query, rec + 1);
+
+	uint8_t found = 0;
+	for (uint8_t i = 0; i < rec[0]; i++)
+	{
+		uint8_t b = rec[1 + i];
+		if (query[b >> 3] & (128 >> (b & 7)))
+		{
+			if (!SBITS_USING_HASH_BMAP(state->parameters))
+				return 1;
+			found++;
+		}
+	}
+	if (!SBITS_USING_HASH_BMAP(state->parameters))
+		return 0;
+
+	/* Hash bitmaps match only if every query bit is in list */
+	uint8_t bits = 0;
+	for (uint16_t i = 0; i < state->bitmapSize * 8; i++)
+		bits += (query[i >> 3] >> (7 - (i & 7))) & 1;
+	return found == bits;
+}
+
+/**
+@brief     	Adds index record with bitmap of page in output buffer (just written) to index write buffer.
+			Index page is written once it is full.
+@param     	state
+                SBITS algorithm state structure
+*/
+void addIndexRecord(sbitsState *state)
+{
+	void *buf = (void*) (state->buffer + state->pageSize*(SBITS_INDEX_WRITE_BUFFER));
+	count_t idxcount =  SBITS_GET_COUNT(buf); 
+
+	SBITS_INC_COUNT(buf);			
+
+	/* Copy record onto index page */
+	void *bm = sbitsPageBitmap(state);	
+	if (SBITS_USING_COMPRESSED_INDEX(state->parameters))
+	{	/* Records are appended. Page is written when the largest record may not fit. */
+		count_t used = SBITS_GET_IDX_USED(buf);
+		if (used == 0)
+			used = state->idxHeaderSize;
+		used += sbitsEncodeIndexRecord(state, (uint8_t*) bm, (uint8_t*) buf + used);
+		SBITS_GET_IDX_USED(buf) = used;
+		if (used + 1 + state->bitmapSize > state->pageSize)
+		{
+			writeIndexPage(state, buf);
+			initIndexBufferPage(state, state->nextPageId);
+		}
+		return;
+	}
+	memcpy( (void*) (buf + state->idxHeaderSize + state->bitmapSize * idxcount), bm, state->bitmapSize);					
+
+	if (idxcount+1 >= state->maxIdxRecordsPerPage)			
+	{	/* Save index page. Written when full (rather than on next insert) so fine bitmap of next data page has a segment. */ 
+		writeIndexPage(state, buf);
+		initIndexBufferPage(state, state->nextPageId);
+	}
+}
+
+/**
+@brief     	Computes derived value of record on page from the record before it. The record before the first
+			record on a page is the last record of the previous page saved in the page header.
 @param     	state
                 SBITS algorithm state structure
-@param     	buffer
-                In memory page buffer with node data
+@param     	buf
+                Page
+@param     	rec
+                Record number on page
+@param     	derived
+                Derived value (SBITS_MAX_DERIVED_SIZE bytes)
 */
-void* sbitsGetMaxKey(sbitsState *state, void *buffer)
+void sbitsDeriveData(sbitsState *state, void *buf, count_t rec, void *derived)
 {
-	int16_t count =  SBITS_GET_COUNT(buffer); 	
-	return (void*) (buffer+state->headerSize+(count-1)*state->recordSize);
-}
+	int8_t *record = (int8_t*) buf + state->headerSize + rec * state->recordSize;
+	int8_t *prev = NULL;
+
+	if (rec > 0)
+		prev = record - state->recordSize;
+	else if (((int8_t*) buf)[state->derivedOffset + state->recordSize] == 1)
+		prev = (int8_t*) buf + state->derivedOffset;
 
+	memset(derived, 0, SBITS_MAX_DERIVED_SIZE);
+	state->deriveData(prev, prev == NULL ? NULL : prev + state->keySize, record, record + state->keySize, derived);
+}
 
 /**
-@brief     	Initialize SBITS structure.
+@brief     	Adds gap to gap list if key is more than the gap threshold after the last key inserted.
+			The oldest gap is replaced when the list is full.
 @param     	state
                 SBITS algorithm state structure
-@return		Return 0 if success. Non-zero value if error.
+@param     	key
+                Key of record being inserted
 */
-int8_t sbitsInit(sbitsState *state)
+void addGap(sbitsState *state, int32_t key)
 {
-	printf("Initializing SBITS.\n");
-	printf("Buffer size: %d  Page size: %d\n", state->bufferSizeInBlocks, state->pageSize);	
-	state->recordSize = state->keySize + state->dataSize;
-	printf("Record size: %d\n", state->recordSize);
-	printf("Use index: %d  Max/min: %d Sum: %d Bmap: %d\n", SBITS_USING_INDEX(state->parameters), SBITS_USING_MAX_MIN(state->parameters),
-								SBITS_USING_SUM(state->parameters), SBITS_USING_BMAP(state->parameters));
-	
-	state->file = NULL;
- 	state->indexFile = NULL;
-	state->nextPageId = 0;
-	state->nextPageWriteId = 0;
-	state->wrappedMemory = 0;
-
-	/* Calculate block header size */
-	/* Header size fixed: 8 bytes: 4 byte id, 2 for record count, X for bitmap. */	
-	state->headerSize = 6 + state->bitmapSize;
-	if (SBITS_USING_MAX_MIN(state->parameters))
-		state->headerSize += state->keySize*2 + state->dataSize*2;
-
-	state->minKey = 0;
-	state->bufferedPageId = -1;
-	state->bufferedIndexPageId = -1;
-
-	/* Calculate number of records per page */
-	state->maxRecordsPerPage = (state->pageSize - state->headerSize) / state->recordSize;
-	printf("Header size: %d  Records per page: %d\n", state->headerSize, state->maxRecordsPerPage);	
-	 
-	/* Allocate first page of buffer as output page */
-	initBufferPage(state, 0); 
-  	resetStats(state);
-
-	id_t numPages = (state->endAddress - state->startAddress) / state->pageSize;
-
-	if (numPages < (SBITS_USING_INDEX(state->parameters)*2+2) * state->eraseSizeInPages)
-	{
-		printf("ERROR: Number of pages allocated must be at least twice erase block size for SBITS and four times when using indexing. Memory pages: %d\n", numPages);		
-		return -1;
+	uint32_t threshold = state->gapThreshold;
+	if (threshold == 0)
+	{	/* Average key difference is estimated once a page is written */
+		if (state->nextPageId == 0)
+			return;
+		threshold = SBITS_GAP_FACTOR * state->avgKeyDiff;
 	}
+	if ((uint32_t) key - (uint32_t) state->maxKey <= threshold)
+		return;
 
-	state->startDataPage = 0;
-	state->endDataPage = state->endAddress / state->pageSize;	
-	state->firstDataPage = 0;
-	state->firstDataPageId = 0;
-	state->erasedEndPage = 0;	
-	state->avgKeyDiff = 1;	
-
- 	/* Setup data file. */    
-    state->file = fopen("datafile.bin", "w+b");	
-    if (state->file == NULL) 
-	{
-        printf("Error: Can't open file!\n");
-        return -1;
-    }   	
-
-	if (SBITS_USING_INDEX(state->parameters))
-	{	/* Allocate file and buffer for index */
-		if (state->bufferSizeInBlocks < 4)
-		{
-			printf("ERROR: SBITS using index requires at least 4 page buffers. Defaulting to without index.\n");
-			state->parameters -= SBITS_USE_INDEX;
-		}
-		else
-		{
-			/* Setup index file. */  			
-			state->indexFile = fopen("idxfile.bin", "w+b");
-			if (state->indexFile == NULL) 
-			{
-				printf("Error: Can't open index file!\n");
-				return -1;
-			}
-			
-			state->maxIdxRecordsPerPage = (state->pageSize - 16) / state->bitmapSize;		/* 4 for id, 2 for count, 2 unused, 4 for minKey (pageId), 4 for maxKey (pageId) */
-
-			/* Allocate third page of buffer as index output page */
-			initBufferPage(state, SBITS_INDEX_WRITE_BUFFER);
-			
-			/* Add page id to minimum value spot in page */
-			void *buf = state->buffer + state->pageSize*(SBITS_INDEX_WRITE_BUFFER);			
-			id_t* ptr = ((id_t*) (buf + 8));
-			*ptr = state->nextPageId;
-			
-			state->nextIdxPageId = 0;
-			state->nextIdxPageWriteId = 0;
-
-			count_t numIdxPages = numPages / 100;			/* Index overhead is about 1% of data size */
-			if (numIdxPages < state->eraseSizeInPages * 2)
-				numIdxPages = state->eraseSizeInPages * 2;	/* Minimum index space is two erase blocks */
-			else											/* Ensure index space is a multiple of erase block size */
-				numIdxPages = ((numIdxPages/state->eraseSizeInPages)+1)*state->eraseSizeInPages;
-			
-			/* Index pages are at the end of the memory space */
-			state->endIdxPage = state->endDataPage;
-			state->endDataPage -= numIdxPages;
-			state->startIdxPage = state->endDataPage+1;		
-			// state->firstIdxPage = state->startIdxPage;
-			state->firstIdxPage =0;		/* TODO: Decide how to handle if share memory space. For now, having logical pages start from 0 rather than the physical page id after the data block */
-			state->erasedEndIdxPage = 0;
-			state->wrappedIdxMemory = 0;
-		}
+	int16_t i = state->nextGap;
+	if (state->numGaps < state->maxGaps)
+		i = state->numGaps++;
+	else
+	{	/* Gaps before end of replaced gap are no longer all in list */
+		state->gapsFromKey = state->gaps[i].endKey;
+		state->nextGap = (i + 1) % state->maxGaps;
 	}
-	return 0;
+	state->gaps[i].startKey = state->maxKey;
+	state->gaps[i].endKey = key;
+	if (SBITS_USING_PMEM(state->parameters))
+		pmemSaveGap(state, i);
 }
 
 /**
@@ -260,47 +1749,21 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data)
 	/* Write current page if full */
 	if (count >= state->maxRecordsPerPage)
 	{
-		id_t pageNum = writePage(state, state->buffer);
+		writePage(state, state->buffer);
 		/*
-		printf("PN: %d PP: %d MK: %d MK: %d MD: %d MD: %d",  pageNum, state->nextPageWriteId-1, *((int32_t*) SBITS_GET_MIN_KEY(state->buffer, state)),
-							*((int32_t*) SBITS_GET_MAX_KEY(state->buffer, state)),
+		printf("PP: %d MK: %d MK: %d MD: %d MD: %d", state->nextPageWriteId-1, *((int32_t*) sbitsGetMinKey(state, state->buffer)),
+							*((int32_t*) sbitsGetMaxKey(state, state->buffer)),
 							*((int32_t*) SBITS_GET_MIN_DATA(state->buffer, state)),
 							*((int32_t*) SBITS_GET_MAX_DATA(state->buffer, state))
 							);
 		
-		printf("Page: %d  ", pageNum);
-		char *bm = SBITS_GET_BITMAP(state->buffer);
+		char *bm = sbitsPageBitmap(state);
 		printBitmap(bm);	
 		*/
 
 		/* Save record in index file */
 		if (state->indexFile != NULL)		
-		{			
-			void *buf = (void*) (state->buffer + state->pageSize*(SBITS_INDEX_WRITE_BUFFER));
-			count_t idxcount =  SBITS_GET_COUNT(buf); 
-			// printf("Count: %d \n", idxcount);
-			if (idxcount >= state->maxIdxRecordsPerPage)			
-			{	/* Save index page */ 
-				writeIndexPage(state, buf);
-				
-				idxcount = 0;
-				initBufferPageHeader(state, SBITS_INDEX_WRITE_BUFFER);
-
-				/* Add page id to minimum value spot in page */
-				id_t *ptr = (id_t*) (buf + 8);
-				*ptr = pageNum;				
-			}
-						
-			SBITS_INC_COUNT(buf);			
-
-			/* Copy record onto index page */
-			void *bm = SBITS_GET_BITMAP(state->buffer);	
-			uint32_t val = state->bitmapSize;
-			val = (SBITS_IDX_HEADER_SIZE) + val * idxcount;
-			// printBitmap(bm);
-			// printf("Count: %d Offset: %lu Ptr: %lu\n", idxcount, val, buf);
-			memcpy( (void*) (buf + val), bm, state->bitmapSize);					
-		}
+			addIndexRecord(state);
 
 		/* Update estimate of average key difference. */
 		int32_t numBlocks = state->nextPageWriteId-1;		
@@ -312,13 +1775,15 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data)
 			numBlocks = 1;
 
 		// #ifndef USE_BINARY_SEARCH
-		state->avgKeyDiff = ( *((uint32_t*) sbitsGetMaxKey(state, state->buffer)) - state->minKey) / numBlocks / state->maxRecordsPerPage; 
+		state->avgKeyDiff = ( (uint32_t) sbitsReadInt32(sbitsGetMaxKey(state, state->buffer)) - state->minKey) / numBlocks / state->maxRecordsPerPage; 
 		// printf("Numb: %lu Avg key diff: %lu\n", numBlocks, state->avgKeyDiff);
 		// printf("MK: %lu MK: %lu\n", *((uint32_t*) sbitsGetMaxKey(state, state->buffer)), state->minKey);
 		// #endif
 
 		count = 0;
 		initBufferPage(state, 0);		
+		if (SBITS_USING_PMEM(state->parameters))
+			pmemCommit(state);
 	}
 
 	/* Copy record onto page */
@@ -328,19 +1793,19 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data)
 	/* Update count */
 	SBITS_INC_COUNT(state->buffer);	
 
+	if (SBITS_USING_GAP_INDEX(state->parameters) && state->minKey != 0)
+		addGap(state, *((int32_t*) key));
+	state->maxKey = *((int32_t*) key);
+
 	/* Set minimum key for first record insert */
 	if (state->minKey == 0)
 		state->minKey = *((int32_t*) key);
 
 	if (SBITS_USING_MAX_MIN(state->parameters))
-	{	/* Update MIN/MAX */
+	{	/* Update MIN/MAX. Keys are inserted in ascending order so min/max key are the first and last record. */
 		void *ptr;
 		if (count != 0)
 		{		
-			/* Since keys are inserted in ascending order, every insert will update max. Min will never change after first record. */	
-			ptr = SBITS_GET_MAX_KEY(state->buffer, state);			
-			memcpy(ptr, key, state->keySize);
-			
 			ptr = SBITS_GET_MIN_DATA(state->buffer, state);
 			if (state->compareData(data,ptr) < 0)
 				memcpy(ptr, data, state->dataSize);
@@ -350,11 +1815,6 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data)
 		}
 		else
 		{	/* First record inserted */
-			ptr = SBITS_GET_MIN_KEY(state->buffer, state);
-			memcpy(ptr, key, state->keySize);
-			ptr = SBITS_GET_MAX_KEY(state->buffer, state);
-			memcpy(ptr, key, state->keySize);
-
 			ptr = SBITS_GET_MIN_DATA(state->buffer, state);
 			memcpy(ptr, data, state->dataSize);
 			ptr = SBITS_GET_MAX_DATA(state->buffer, state);
@@ -364,9 +1824,31 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data)
 
 	if (SBITS_USING_BMAP(state->parameters))
 	{	/* Update bitmap */		
-		void *bm = SBITS_GET_BITMAP(state->buffer);
-		state->updateBitmap(data, bm);
+		void *bm = sbitsPageBitmap(state);
+		uint8_t derived[SBITS_MAX_DERIVED_SIZE];
+		if (SBITS_USING_DERIVED_BMAP(state->parameters))
+		{	/* Bitmaps are on value derived from this and previous record */
+			sbitsDeriveData(state, state->buffer, count, derived);
+			data = derived;
+		}
+		if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+			addSegmentValue(state, data);
+		updatePageBitmap(state, data, bm);
+
+		if (SBITS_USING_RECORD_DIR(state->parameters))
+		{	/* Update bitmap of chunk of records on page */
+			updatePageBitmap(state, data, state->buffer + state->recordDirOffset + (count / state->recordDirChunkSize) * state->bitmapSize);
+		}
+
+		if (SBITS_USING_FINE_BMAP(state->parameters) && state->indexFile != NULL)
+		{	/* Update fine bitmap of segment that index record of this page will be in */
+			void *buf = state->buffer + state->pageSize*SBITS_INDEX_WRITE_BUFFER;
+			count_t segment = SBITS_GET_COUNT(buf) / state->eraseSizeInPages;
+			state->updateFineBitmap(data, buf + SBITS_IDX_HEADER_SIZE + segment*state->fineBitmapSize);
+		}
 	}
+	if (SBITS_USING_PMEM(state->parameters))
+		pmemSaveRecord(state, count);
 	
 	return 0;	
 }
@@ -418,6 +1900,117 @@ id_t sbitsSearchNode(sbitsState *state, void *buffer, void* key, id_t pageId, in
 }
 
 
+/**
+@brief     	Updates running averages of error of predicted page of sbitsGet() (scaled by 16).
+@param     	state
+                SBITS algorithm state structure
+@param     	predicted
+                Predicted logical page
+@param     	pageId
+                Logical page with key range containing key
+*/
+void updateProbeError(sbitsState *state, int32_t predicted, int32_t pageId)
+{
+	int32_t error = pageId - predicted;
+	state->probeBias += (error * 16 - state->probeBias) / 8;
+	state->probeSpread += ((error < 0 ? -error : error) * 16 - state->probeSpread) / 8;
+}
+
+/**
+@brief     	Reads predicted data page of sbitsGet() and its likely neighbours with one read into probeBuffer.
+			Pages read are centered on the average prediction error and cover its average absolute error
+			(up to probePages pages). Only pages in consecutive file locations are read.
+@param     	state
+                SBITS algorithm state structure
+@param     	key
+                Key for record
+@param     	pageId
+                Predicted logical page. Set to page to read next if key is not in pages read.
+@param     	first
+                First logical page that may have key. Updated if key is not in pages read.
+@param     	last
+                Last logical page that may have key. Updated if key is not in pages read.
+@return		Return 1 if page with key range containing key is in read buffer, -1 if key is not stored,
+			0 if key is not in pages read.
+*/
+int8_t sbitsProbePages(sbitsState *state, void *key, int32_t *pageId, int32_t *first, int32_t *last)
+{
+	int32_t n = 1 + 2 * ((state->probeSpread + 15) / 16);
+	if (n > state->probePages)
+		n = state->probePages;
+	int32_t start = *pageId + state->probeBias / 16 - (n - 1) / 2;
+	if (start + n - 1 > *last)
+		start = *last - n + 1;
+	if (start < *first)
+		start = *first;
+	if (start + n - 1 > *last)
+		n = *last - start + 1;
+	if (n < 2)
+		return 0;
+
+	/* Pages must be in consecutive locations in file to read at once */
+	id_t physPageId = start + state->firstDataPage;
+	if (physPageId >= state->endDataPage)
+		physPageId = physPageId - state->endDataPage;
+	id_t storagePage = sbitsStoragePage(state, physPageId, 0);
+	int32_t i;
+	for (i = 1; i < n; i++)
+	{
+		if (physPageId + (id_t) i >= state->endDataPage || sbitsStoragePage(state, physPageId + i, 0) != storagePage + (id_t) i)
+			break;
+	}
+	n = i;
+
+	fseek(state->file, storagePage * state->pageSize, SEEK_SET);
+	if (fread(state->probeBuffer, state->pageSize, n, state->file) != (size_t) n)
+	{
+		SBITS_ERROR(SBITS_EVENT_READ, n);
+		return 0;
+	}
+	state->numReads += n;
+	state->numProbes++;
+
+	/* Find first page with largest key at least key */
+	void *page = NULL;
+	for (i = 0; i < n; i++)
+	{
+		page = (int8_t*) state->probeBuffer + i * state->pageSize;
+		if (state->compareKey(key, sbitsGetMaxKey(state, page)) <= 0)
+			break;
+	}
+
+	if (i == n)
+	{	/* Key is larger than largest record in pages read */
+		*first = start + n;
+		*pageId = start + n - 1 + (*((int32_t*) key) - sbitsReadInt32(sbitsGetMaxKey(state, page))) / (state->maxRecordsPerPage * state->avgKeyDiff) + 1;
+		if (*pageId > *last)
+			*pageId = *last;
+		return *first > *last ? -1 : 0;
+	}
+	if (state->compareKey(key, sbitsGetMinKey(state, page)) >= 0)
+	{	/* Found correct page. Copy it to read buffer. */
+		*pageId = start + i;
+		memcpy(state->buffer + state->pageSize, page, state->pageSize);
+		state->bufferedPageId = physPageId + i;
+		if (SBITS_USING_WARM_START(state->parameters))
+			addHotPage(state, physPageId + i);
+		state->probeHits++;
+		return 1;
+	}
+	if (i > 0)
+	{	/* Key is between largest key of a page and smallest key of next page */
+		*pageId = start + i;
+		return -1;
+	}
+
+	/* Key is less than smallest record in pages read */
+	*last = start - 1;
+	*pageId = start + (*((int32_t*) key) - sbitsReadInt32(sbitsGetMinKey(state, page))) / state->maxRecordsPerPage / ((int32_t) state->avgKeyDiff) - 1;
+	if (*pageId < *first)
+		*pageId = *first;
+	return *first > *last ? -1 : 0;
+}
+
 /**
 @brief     	Given a key, returns data associated with key.
 			Note: Space for data must be already allocated.
@@ -461,8 +2054,20 @@ int8_t sbitsGet(sbitsState *state, void* key, void *data)
 			pageId = state->nextPageWriteId-1;		/* Logical page would be beyond maximum. Set to last page. */
 	}		
 	int32_t offset = 0;
-	
-	while (1)
+	int32_t predicted = pageId;
+	int8_t probe = 0;
+
+	if (SBITS_USING_PROBE(state->parameters) && state->dataMap == NULL)
+	{	/* Read predicted page and neighbours at once */
+		probe = sbitsProbePages(state, key, &pageId, &first, &last);
+		if (probe == -1)
+		{
+			updateProbeError(state, predicted, pageId);
+			return -1;
+		}
+	}
+
+	while (probe == 0)
 	{
 		/* Move logical page number to physical page id based on location of first data page */
 		int32_t physPageId = pageId + state->firstDataPage;
@@ -482,7 +2087,7 @@ int8_t sbitsGet(sbitsState *state, void* key, void *data)
 		if (state->compareKey(key,sbitsGetMinKey(state,buf)) < 0)
 		{	/* Key is less than smallest record in block. */
 			last = pageId - 1;	
-			offset = (*((int32_t*) key) - *((int32_t*) sbitsGetMinKey(state,buf))) / state->maxRecordsPerPage / ((int32_t) state->avgKeyDiff) - 1;					
+			offset = (*((int32_t*) key) - sbitsReadInt32(sbitsGetMinKey(state,buf))) / state->maxRecordsPerPage / ((int32_t) state->avgKeyDiff) - 1;					
 			if (pageId + offset < first)
 				offset = first-pageId;
 			pageId += offset;
@@ -491,7 +2096,7 @@ int8_t sbitsGet(sbitsState *state, void* key, void *data)
 		else if (state->compareKey(key,sbitsGetMaxKey(state,buf)) > 0)
 		{	/* Key is larger than largest record in block. */
 			first = pageId + 1;
-			offset = (*((int32_t*) key) - *((int32_t*) sbitsGetMaxKey(state,buf))) / (state->maxRecordsPerPage * state->avgKeyDiff) + 1;	
+			offset = (*((int32_t*) key) - sbitsReadInt32(sbitsGetMaxKey(state,buf))) / (state->maxRecordsPerPage * state->avgKeyDiff) + 1;	
 			if (pageId + offset > last)
 				offset = last-pageId;
 			pageId += offset;
@@ -501,6 +2106,8 @@ int8_t sbitsGet(sbitsState *state, void* key, void *data)
 			break;
 		}
 	}
+	if (SBITS_USING_PROBE(state->parameters))
+		updateProbeError(state, predicted, pageId);
 	#else
 	/* Regular binary search */
 	pageId = (first+last)/2;
@@ -511,83 +2118,418 @@ int8_t sbitsGet(sbitsState *state, void* key, void *data)
 		if (physPageId >= state->endDataPage)
 			physPageId = physPageId - state->endDataPage;
 
-		/* Read page into buffer */
-		if (readPage(state, physPageId) != 0)
-			return -1;
-		numReads++;
+		/* Read page into buffer */
+		if (readPage(state, physPageId) != 0)
+			return -1;
+		numReads++;
+
+		if (first >= last)
+			break;
+
+		if (state->compareKey(key,sbitsGetMinKey(state,buf)) < 0)
+		{	/* Key is less than smallest record in block. */
+			last = pageId - 1;	
+			pageId = (first+last)/2;						
+		}
+		else if (state->compareKey(key,sbitsGetMaxKey(state,buf)) > 0)
+		{	/* Key is larger than largest record in block. */
+			first = pageId + 1;
+			pageId = (first+last)/2;			
+		}
+		else
+		{	/* Found correct block */
+			break;
+		}
+	}
+	#endif		
+	// printf("Key: %lu Num reads: %d\n", *((int32_t*) key), numReads);
+	id_t nextId = sbitsSearchNode(state, buf, key, nextId, 0);
+	if (nextId != -1)
+	{	/* Key found */
+		memcpy(data, (void*) (buf+state->headerSize+state->recordSize*nextId+state->keySize), state->dataSize);
+		return 0;
+	}
+	return -1;
+}
+
+/**
+@brief     	Copies gaps in keys that overlap a key range from the gap list (no pages are read). Gaps are in key order.
+			The list only has all gaps with keys after state->gapsFromKey.
+@param     	state
+                SBITS algorithm state structure (with SBITS_USE_GAP_INDEX)
+@param     	minKey
+                Smallest key of range (NULL if none)
+@param     	maxKey
+                Largest key of range (NULL if none)
+@param     	gaps
+                Pre-allocated memory for gaps
+@param     	maxGaps
+                Number of gaps that fit in gaps
+@return		Return number of gaps copied.
+*/
+int16_t sbitsFindGaps(sbitsState *state, void *minKey, void *maxKey, sbitsGap *gaps, int16_t maxGaps)
+{
+	int16_t n = 0;
+	if (!SBITS_USING_GAP_INDEX(state->parameters))
+		return 0;
+
+	/* Oldest gap is at nextGap */
+	for (int16_t i = 0; i < state->numGaps && n < maxGaps; i++)
+	{
+		sbitsGap *gap = &state->gaps[(state->nextGap + i) % state->maxGaps];
+		if ((minKey != NULL && gap->endKey <= *((int32_t*) minKey)) || (maxKey != NULL && gap->startKey >= *((int32_t*) maxKey)))
+			continue;
+		gaps[n++] = *gap;
+	}
+	return n;
+}
+
+/**
+@brief     	Returns 1 if iterator data bounds select a single data value, 0 otherwise.
+*/
+int8_t sbitsIsEqualityQuery(sbitsState *state, sbitsIterator *it)
+{
+	if (it->minData == NULL || it->maxData == NULL)
+		return 0;
+	return it->minData == it->maxData || state->compareData(it->minData, it->maxData) == 0;
+}
+
+/**
+@brief     	Returns 1 if page or chunk bitmap may have records matching iterator, 0 otherwise.
+			Range-encoded bitmaps are checked by testing the one query bucket.
+*/
+int8_t iteratorMatch(sbitsState *state, sbitsIterator *it, uint8_t *bm)
+{
+	if (SBITS_USING_RANGE_BMAP(state->parameters))
+		return (bm[it->queryBucket >> 3] & (128 >> (it->queryBucket & 7))) != 0;
+	return bitmapMatch(state, it->queryBitmap, bm);
+}
+
+/**
+@brief     	Builds query bitmap of iterator for bucket boundaries of a segment (if SBITS_USE_ADAPTIVE_BMAP).
+			Called as iterator reads index and data pages, so query bitmap is only rebuilt when boundaries change.
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+@param     	bounds
+            	Minimum and maximum 32-bit value of boundaries
+*/
+void setQueryBounds(sbitsState *state, sbitsIterator *it, void *bounds)
+{
+	int32_t min, max;
+
+	memcpy(&min, bounds, sizeof(int32_t));
+	memcpy(&max, (uint8_t*) bounds + sizeof(int32_t), sizeof(int32_t));
+	if (min == it->queryBitmapMin && max == it->queryBitmapMax)
+		return;
+	it->queryBitmapMin = min;
+	it->queryBitmapMax = max;
+
+	uint8_t *bm = (uint8_t*) it->queryBitmapData;
+	memset(bm, 0, sizeof(it->queryBitmapData));
+	if (SBITS_USING_RANGE_BMAP(state->parameters))
+	{
+		it->queryBucket = adaptiveBucket(state, min, max, state->rangeBitmapDir == SBITS_RANGE_GE ? it->minData : it->maxData);
+		bm[it->queryBucket >> 3] = 128 >> (it->queryBucket & 7);
+		return;
+	}
+
+	int16_t last = it->maxData != NULL ? adaptiveBucket(state, min, max, it->maxData) : state->bitmapSize * 8 - 1;
+	for (int16_t i = it->minData != NULL ? adaptiveBucket(state, min, max, it->minData) : 0; i <= last; i++)
+		bm[i >> 3] |= 128 >> (i & 7);
+}
+
+/**
+@brief     	Initialize iterator on sbits structure.
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+*/
+void sbitsInitIterator(sbitsState *state, sbitsIterator *it)
+{
+	/* Build query bitmap (if used) */
+	it->queryBitmap = NULL;
+	it->cacheEntry = NULL;
+	it->valueBlock = -1;
+	it->lastIdxIterRec = 20000;		/* Flag to indicate that not using index */	
+	if (SBITS_USING_BMAP(state->parameters))
+	{
+		/* Verify that bitmap index is useful (must have set either min or max data value). Hash bitmaps only help equality.
+			Range-encoded bitmaps only help with the bound on their side. */
+		it->queryBucket = -1;
+		void *bound = state->rangeBitmapDir == SBITS_RANGE_GE ? it->minData : it->maxData;
+		if (SBITS_USING_RANGE_BMAP(state->parameters) && bound != NULL)
+			it->queryBucket = sbitsBitmapBucket(state, bound);
+		if ((it->minData != NULL || it->maxData != NULL) && (!SBITS_USING_HASH_BMAP(state->parameters) || sbitsIsEqualityQuery(state, it))
+				&& (!SBITS_USING_RANGE_BMAP(state->parameters) || it->queryBucket >= 0))
+		{	/* Query bitmap is stored in iterator so iterators do not allocate memory */
+			/*
+			buildBitmapInt16FromRange(state, it->minData, it->maxData, it->queryBitmapData);
+			*/
+			memset(it->queryBitmapData, 0, sizeof(it->queryBitmapData));
+			if (SBITS_USING_HASH_BMAP(state->parameters))
+				state->updateBitmap(it->minData, it->queryBitmapData);
+			else if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+			{	/* Boundaries differ by segment. Query bitmap is built when first page is read. */
+				it->queryBitmapMin = INT32_MAX;
+				it->queryBitmapMax = INT32_MIN;
+			}
+			else if (SBITS_USING_RANGE_BMAP(state->parameters))
+				((uint8_t*) it->queryBitmapData)[it->queryBucket >> 3] = 128 >> (it->queryBucket & 7);
+			else if (SBITS_USING_MULTI_DIM(state->parameters))
+				state->buildBitmap(it->minData, it->maxData, it->queryBitmapData);
+			else
+				buildBitmapFromRange(state->updateBitmap, state->bitmapSize, it->minData, it->maxData, it->queryBitmapData);
+			
+			// printBitmap((char*) bm);			
+			it->queryBitmap = it->queryBitmapData;
+
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+			if (SBITS_USING_FINE_BMAP(state->parameters) && state->indexFile != NULL)
+			{
+				memset(it->fineQueryBitmap, 0, state->fineBitmapSize);
+				buildBitmapFromRange(state->updateFineBitmap, state->fineBitmapSize, it->minData, it->maxData, it->fineQueryBitmap);
+			}
+#endif
+
+			/* Reuse candidate pages found by previous queries with the same bitmap */
+			if (state->queryCache != NULL)
+				sbitsLookupQueryCache(state, it);
+
+			/* Setup for reading index file */
+			if (state->indexFile != NULL)
+			{
+				it->lastIdxIterPage = state->firstIdxPage;
+				it->lastIdxIterRec = 10000;	/* Force to read next index page */	
+				it->wrappedIdxMemory = 0;				
+			}			
+		}
+	}
+
+	/* Read first page into memory */
+	it->lastIterPage = state->firstDataPage-1;
+	it->lastIterRec = 10000;	/* Force to read next page */	
+	it->wrappedMemory = 0;
+
+	if (it->cacheEntry != NULL)
+	{	/* Only scan pages that were not checked when cache entry was built */
+		id_t physPageId = it->cacheEntry->nextPageId % (state->endDataPage - state->startDataPage);
+		it->lastIterPage = physPageId-1;
+		if (state->wrappedMemory != 0 && physPageId < state->firstDataPage)
+			it->wrappedMemory = 1;
+
+		if (it->lastIdxIterRec == 10000 && !SBITS_USING_COMPRESSED_INDEX(state->parameters))
+		{	/* Skip index pages with only checked pages. Assumes full index pages so may fall short but never beyond. */
+			id_t numIdxPages = state->endIdxPage - state->startIdxPage + 1;
+			it->lastIdxIterPage += (it->cacheEntry->nextPageId - state->firstDataPageId) / state->maxIdxRecordsPerPage;
+			if (it->lastIdxIterPage >= numIdxPages)
+			{
+				it->lastIdxIterPage -= numIdxPages;
+				it->wrappedIdxMemory = 1;
+			}
+		}
+	}
+}
+
+/**
+@brief     	Initialize iterator for records with data value equal to data. Key bounds (minKey, maxKey)
+			must be set in iterator before call. With hash bitmaps (SBITS_USE_HASH_BMAP), only pages
+			whose bitmap has all hashed bits of the value are read.
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+@param     	data
+            	Data value to find
+*/
+void sbitsInitEqualityIterator(sbitsState *state, sbitsIterator *it, void *data)
+{
+	it->minData = data;
+	it->maxData = data;
+	sbitsInitIterator(state, it);
+}
+
+/**
+@brief     	Returns 1 if erase block searched by iterator is being filled, so its value index entries are unsorted in buffer.
+*/
+int8_t valueBlockBuffered(sbitsState *state, sbitsIterator *it)
+{
+	return it->valueBlock == it->lastValueBlock && state->nextPageWriteId % state->eraseSizeInPages != 0
+				&& state->nextPageWriteId < state->endDataPage;
+}
+
+/**
+@brief     	Returns value index entry i of erase block searched by iterator (NULL if read error).
+*/
+uint8_t* getValueEntry(sbitsState *state, sbitsIterator *it, count_t i)
+{
+	count_t size = SBITS_VALUE_ENTRY_SIZE(state);
+
+	if (valueBlockBuffered(state, it))
+		return (uint8_t*) state->buffer + state->pageSize*SBITS_VALUE_BUILD_BUFFER + i*size;
+	if (readValuePage(state, it->valueBlock * state->valueRunPages + i / state->valueEntriesPerPage) != 0)
+		return NULL;
+	return (uint8_t*) state->buffer + state->pageSize*SBITS_VALUE_READ_BUFFER + SBITS_VALUE_HEADER_SIZE + (i % state->valueEntriesPerPage) * size;
+}
+
+/**
+@brief     	Starts search of erase block in iterator. Binary search of run finds first entry with value >= minData.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t startValueBlock(sbitsState *state, sbitsIterator *it)
+{
+	it->valueEntry = 0;
+	if (valueBlockBuffered(state, it))
+	{	/* Entries of erase block being filled are not sorted */
+		it->valueEnd = state->numValueEntries;
+		return 0;
+	}
 
-		if (first >= last)
-			break;
+	if (readValuePage(state, it->valueBlock * state->valueRunPages) != 0)
+		return -1;
+	uint8_t *buf = (uint8_t*) state->buffer + state->pageSize*SBITS_VALUE_READ_BUFFER;
+	it->valueEnd = *((count_t*) (buf + SBITS_VALUE_COUNT_OFFSET));
+	if (*((id_t*) buf) < state->firstDataPageId)
+		it->valueEnd = 0;		/* Run of erased data */
 
-		if (state->compareKey(key,sbitsGetMinKey(state,buf)) < 0)
-		{	/* Key is less than smallest record in block. */
-			last = pageId - 1;	
-			pageId = (first+last)/2;						
-		}
-		else if (state->compareKey(key,sbitsGetMaxKey(state,buf)) > 0)
-		{	/* Key is larger than largest record in block. */
-			first = pageId + 1;
-			pageId = (first+last)/2;			
-		}
+	count_t first = 0, last = it->valueEnd;
+	while (it->minData != NULL && first < last)
+	{
+		count_t middle = (first + last) / 2;
+		uint8_t *entry = getValueEntry(state, it, middle);
+		if (entry == NULL)
+			return -1;
+		if (state->compareData(entry, it->minData) < 0)
+			first = middle + 1;
 		else
-		{	/* Found correct block */
-			break;
-		}
-	}
-	#endif		
-	// printf("Key: %lu Num reads: %d\n", *((int32_t*) key), numReads);
-	id_t nextId = sbitsSearchNode(state, buf, key, nextId, 0);
-	if (nextId != -1)
-	{	/* Key found */
-		memcpy(data, (void*) (buf+state->headerSize+state->recordSize*nextId+state->keySize), state->dataSize);
-		return 0;
+			last = middle;
 	}
-	return -1;
+	it->valueEntry = first;
+	return 0;
 }
 
-
 /**
-@brief     	Initialize iterator on sbits structure.
+@brief     	Initialize iterator for records with data value in [minData, maxData] using value index
+			(SBITS_USE_VALUE_INDEX). Set minKey, maxKey, minData and maxData in iterator before call.
+			Each erase block is found by binary search of its sorted run, so records are returned in
+			order of erase block and then data value (not key order).
 @param     	state
                 SBITS algorithm state structure
 @param     	it
             	SBITS iterator state structure
 */
-void sbitsInitIterator(sbitsState *state, sbitsIterator *it)
+void sbitsInitValueIterator(sbitsState *state, sbitsIterator *it)
 {
-	/* Build query bitmap (if used) */
+	if (state->valueIndexFile == NULL)
+	{	/* Scan data pages */
+		sbitsInitIterator(state, it);
+		return;
+	}
+
 	it->queryBitmap = NULL;
-	it->lastIdxIterRec = 20000;		/* Flag to indicate that not using index */	
-	if (SBITS_USING_BMAP(state->parameters))
+	it->cacheEntry = NULL;
+	it->valueBlock = state->firstDataPage / state->eraseSizeInPages;
+	it->lastValueBlock = it->valueBlock;
+	it->valueEntry = 0;
+	it->valueEnd = 0;
+	if (state->nextPageId == state->firstDataPageId)
+		return;		/* No data */
+
+	it->lastValueBlock = (state->nextPageWriteId - 1) / state->eraseSizeInPages;
+	if (startValueBlock(state, it) != 0)
+		it->lastValueBlock = it->valueBlock;
+}
+
+/**
+@brief     	Return next key, data pair for iterator using value index.
+*/
+int8_t sbitsNextByValue(sbitsState *state, sbitsIterator *it, void **key, void **data)
+{
+	void *buf = state->buffer + state->pageSize;
+	int32_t numBlocks = (state->endDataPage - state->startDataPage + state->eraseSizeInPages - 1) / state->eraseSizeInPages;
+
+	while (1)
 	{
-		/* Verify that bitmap index is useful (must have set either min or max data value) */
-		if (it->minData != NULL || it->maxData != NULL)		
-		{	/*
-			uint16_t *bm = malloc(sizeof(uint16_t));		
-			*bm = 0;
-			buildBitmapInt16FromRange(state, it->minData, it->maxData, bm);
-			*/
-			uint64_t *bm = malloc(sizeof(uint64_t));		
-			*bm = 0;
-			buildBitmapInt64FromRange(state, it->minData, it->maxData, bm);
-			
-			// printBitmap((char*) bm);			
-			it->queryBitmap = bm;
+		if (it->valueEntry >= it->valueEnd)
+		{	/* Search next erase block */
+			if (it->valueBlock == it->lastValueBlock)
+				return 0;
+			it->valueBlock = (it->valueBlock + 1) % numBlocks;
+			if (startValueBlock(state, it) != 0)
+				return 0;
+			continue;
+		}
 
-			/* Setup for reading index file */
-			if (state->indexFile != NULL)
-			{
-				it->lastIdxIterPage = state->firstIdxPage;
-				it->lastIdxIterRec = 10000;	/* Force to read next index page */	
-				it->wrappedIdxMemory = 0;				
-			}			
+		uint8_t *entry = getValueEntry(state, it, it->valueEntry++);
+		if (entry == NULL)
+			return 0;
+		int8_t buffered = valueBlockBuffered(state, it);
+		if (it->maxData != NULL && state->compareData(entry, it->maxData) > 0)
+		{
+			if (!buffered)
+				it->valueEntry = it->valueEnd;		/* Rest of run is larger */
+			continue;
 		}
+		if (buffered && it->minData != NULL && state->compareData(entry, it->minData) < 0)
+			continue;
+
+		count_t rec;
+		memcpy(&rec, entry + state->valueSize, sizeof(count_t));
+		if (readPage(state, it->valueBlock * state->eraseSizeInPages + rec / state->maxRecordsPerPage) != 0)
+			return 0;
+		*key = buf + state->headerSize + (rec % state->maxRecordsPerPage) * state->recordSize;
+		*data = (uint8_t*) *key + state->keySize;
+
+		if (it->minKey != NULL && state->compareKey(*key, it->minKey) < 0)
+			continue;
+		if (it->maxKey != NULL && state->compareKey(*key, it->maxKey) > 0)
+			continue;
+		return 1;
 	}
+}
 
-	/* Read first page into memory */
-	it->lastIterPage = state->firstDataPage-1;
-	it->lastIterRec = 10000;	/* Force to read next page */	
-	it->wrappedMemory = 0;
+/**
+@brief     	Positions iterator at the last page with smallest key less than or equal to key, found by
+			binary search on data pages. The iterator then scans data pages from that page (index and
+			query cache are not used). Call after sbitsInitIterator().
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+@param     	key
+            	Key to seek to
+*/
+void sbitsSeekIterator(sbitsState *state, sbitsIterator *it, void *key)
+{
+	void *buf = state->buffer + state->pageSize;
+	id_t numSlots = state->endDataPage - state->startDataPage;
+	id_t first = state->firstDataPageId, last = state->nextPageId;
+
+	it->lastIdxIterRec = 20000;
+	it->cacheEntry = NULL;
+
+	if (first >= last)
+		return;
+
+	/* Find last logical page in [first, last) with smallest key <= key */
+	last--;
+	while (first < last)
+	{
+		id_t mid = first + (last - first + 1) / 2;
+		if (readPage(state, mid % numSlots) != 0)
+			return;
+		if (state->compareKey(sbitsGetMinKey(state, buf), key) <= 0)
+			first = mid;
+		else
+			last = mid - 1;
+	}
+
+	id_t physPageId = first % numSlots;
+	it->lastIterPage = physPageId-1;
+	it->lastIterRec = 10000;	/* Force to read next page */
+	it->wrappedMemory = (state->wrappedMemory != 0 && physPageId < state->firstDataPage) ? 1 : 0;
 }
 
 /**
@@ -601,23 +2543,21 @@ int8_t sbitsFlush(sbitsState *state)
 
 	if (state->indexFile != NULL)
 	{
-		void *buf = state->buffer + state->pageSize*(SBITS_INDEX_WRITE_BUFFER);	
-		count_t idxcount = SBITS_GET_COUNT(buf);
-		SBITS_INC_COUNT(buf);
-			
-		/* Copy record onto index page */
-		void *bm = SBITS_GET_BITMAP(state->buffer);
-		memcpy( (void*) (buf + SBITS_IDX_HEADER_SIZE + state->bitmapSize * idxcount), bm, state->bitmapSize);			
-
-		/* TODO: Handle case that index buffer is full */				
-		writeIndexPage(state, buf);
+		addIndexRecord(state);
 
-		/* Reinitialize buffer */
-		initBufferPage(state, SBITS_INDEX_WRITE_BUFFER);
+		/* Save partially filled index page */
+		void *buf = state->buffer + state->pageSize*(SBITS_INDEX_WRITE_BUFFER);	
+		if (SBITS_GET_COUNT(buf) > 0)
+		{
+			writeIndexPage(state, buf);
+			initIndexBufferPage(state, state->nextPageId);
+		}
 	}
 
 	/* Reinitialize buffer */
 	initBufferPage(state, 0);
+	if (SBITS_USING_PMEM(state->parameters))
+		pmemCommit(state);
 	return 0;
 }
 
@@ -635,6 +2575,9 @@ int8_t sbitsFlush(sbitsState *state)
 int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data)
 {	
 	void *buf = state->buffer+state->pageSize;
+	if (it->valueBlock >= 0)
+		return sbitsNextByValue(state, it, key, data);
+
 	/* Iterate until find a record that matches search criteria */
 	while (1)
 	{	
@@ -645,9 +2588,19 @@ int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data)
 			while (1)
 			{
 				id_t readPageId = 0;
+				int8_t scanPage = 0;
+
+				if (it->cacheEntry != NULL && it->cacheRec < it->cacheEnd)
+				{	/* Return pages memoized by query cache before checking newer pages */
+					readPageId = it->cacheEntry->pages[it->cacheRec++] % (state->endDataPage - state->startDataPage);
+					goto readPage;
+				}
 
 				if (it->lastIdxIterRec == 20000)
 				{	/* No index. Scan next data page by iterator. */
+					if (it->cacheEntry != NULL && it->cacheEntry->nextPageId >= state->nextPageId)
+						return 0;		/* All pages have been checked */
+
 					it->lastIterPage++;
 					if (it->lastIterPage >= state->endDataPage)
 					{	it->lastIterPage = 0;  /* Wrap around to start of memory */
@@ -659,7 +2612,8 @@ int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data)
 						if (it->lastIterPage >= state->nextPageWriteId)
 							return 0;		/* No more pages to read */	
 					}
-					readPageId = it->lastIterPage;														
+					readPageId = it->lastIterPage;
+					scanPage = 1;
 				}
 				else
 				{	/* Using index file. */
@@ -668,7 +2622,9 @@ int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data)
 					if (it->lastIdxIterRec == 10000 || it->lastIdxIterRec >= cnt)
 					{	/* Read next index block. Special case for first block as will not be read into buffer (so count not accurate). */						
 						if (it->lastIdxIterPage >= (state->endIdxPage - state->startIdxPage +1))
-						{								
+						{	/* First index page may be just past the end if index wrapped exactly at the end */
+							if (it->wrappedIdxMemory == 1)
+								return 0;
 							it->wrappedIdxMemory = 1;
 							it->lastIdxIterPage = 0;	/* Wrapped around */							
 						}
@@ -683,29 +2639,67 @@ int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data)
 
 						it->lastIdxIterPage++;	
 						it->lastIdxIterRec = 0;
+						it->idxIterOffset = state->idxHeaderSize;
+						it->idxIterOffsetRec = 0;
 						cnt = SBITS_GET_COUNT(idxbuf);						
 						id_t* id = ((id_t*) (idxbuf + 8));	/* Get min page # for this index page */
 
 						// printf("After read page: %lu  Cnt: %d\n", it->lastIdxIterPage, cnt);
 						/* Index page may have entries that are earlier than first active data page. Advance iterator beyond them. */
 						it->lastIterPage = *id;	
-						if (state->firstDataPageId > *id)				
-							it->lastIdxIterRec += (state->firstDataPageId - *id);						
-						if (it->lastIdxIterRec >= cnt)
-						{	/* Jump ahead pages in the index */ /* TODO: Could improve this so do not read first page if know it will not be useful */
+						id_t startPageId = state->firstDataPageId;
+						if (it->cacheEntry != NULL && it->cacheEntry->nextPageId > startPageId)
+							startPageId = it->cacheEntry->nextPageId;	/* Earlier pages are memoized by query cache */
+						if (startPageId > *id)				
+							it->lastIdxIterRec += (startPageId - *id);						
+						/* Compressed index pages have a variable number of records so are not skipped */
+						if (it->lastIdxIterRec >= cnt && it->lastIdxIterRec >= state->maxIdxRecordsPerPage && !SBITS_USING_COMPRESSED_INDEX(state->parameters))
+						{	/* Jump ahead pages in the index. Partially filled index pages (from flush) mean this may fall short, but never beyond. */ /* TODO: Could improve this so do not read first page if know it will not be useful */
 							it->lastIdxIterPage += it->lastIdxIterRec / state->maxIdxRecordsPerPage -1;  // -1 as already performed increment
 							// printf("Jumping ahead pages to: %d\n", it->lastIdxIterPage);
 						}
 					}
 				
+					if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+						setQueryBounds(state, it, idxbuf + SBITS_IDX_HEADER_SIZE);
+
 					/* Check bitmaps in current index page until find a match */																			
 					while (it->lastIdxIterRec < cnt)
 					{			
-						char *bm = idxbuf+SBITS_IDX_HEADER_SIZE+it->lastIdxIterRec*state->bitmapSize;	
-						// printf("Page: %lu Rec: %d ", it->lastIdxIterPage, it->lastIdxIterRec);
-						// printBitmap(bm);	
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+						if (SBITS_USING_FINE_BMAP(state->parameters))
+						{	/* Check fine bitmap of segment first. Skip segment if no overlap. */
+							count_t segment = it->lastIdxIterRec / state->eraseSizeInPages;
+							void *fbm = idxbuf + SBITS_IDX_HEADER_SIZE + segment*state->fineBitmapSize;
+							if (bitmapOverlap(it->fineQueryBitmap, fbm, state->fineBitmapSize) == 0)
+							{
+								it->lastIdxIterRec = (segment+1)*state->eraseSizeInPages;
+								continue;
+							}
+						}
+#endif
+
+						int8_t overlap;
+						if (SBITS_USING_COMPRESSED_INDEX(state->parameters))
+						{	/* Records are variable size. Advance to current record and test without decoding. */
+							while (it->idxIterOffsetRec < it->lastIdxIterRec)
+							{
+								it->idxIterOffset += sbitsIndexRecordSize(state, (uint8_t*) idxbuf + it->idxIterOffset);
+								it->idxIterOffsetRec++;
+							}
+							overlap = sbitsMatchIndexRecord(state, (uint8_t*) it->queryBitmap, (uint8_t*) idxbuf + it->idxIterOffset);
+						}
+						else
+						{
+							char *bm = idxbuf+state->idxHeaderSize+it->lastIdxIterRec*state->bitmapSize;	
+							// printf("Page: %lu Rec: %d ", it->lastIdxIterPage, it->lastIdxIterRec);
+							// printBitmap(bm);	
+							overlap = iteratorMatch(state, it, (uint8_t*) bm);
+						}
+						if (it->cacheEntry != NULL)
+							sbitsAddQueryCachePage(it, it->lastIterPage+it->lastIdxIterRec, overlap);
 
-						if ( bitmapOverlap(it->queryBitmap, (void*) bm, state->bitmapSize) >= 1)
+						if (overlap >= 1)
 						{	readPageId = (it->lastIterPage+it->lastIdxIterRec) % (state->endDataPage - state->startDataPage);							
 							it->lastIdxIterRec++;
 							goto readPage;
@@ -719,14 +2713,20 @@ readPage:
 				if (readPage(state, readPageId) != 0)
 					return 0;		
 
-				/* Check bitmap overlap if present */
-				if (it->queryBitmap == NULL || !SBITS_USING_BMAP(state->parameters))
+				/* Check bitmap overlap if present. Pages found using index records were already checked. */
+				if (it->queryBitmap == NULL || !SBITS_USING_BMAP(state->parameters) || state->bitmapOffset == 0)
 					break;
 
 				/* Check bitmap */
+				if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+					setQueryBounds(state, it, buf + state->boundsOffset);
 				void *bm = SBITS_GET_BITMAP(buf);
 				// printBitmap(bm);							
-				if ( bitmapOverlap(it->queryBitmap, bm, state->bitmapSize) >= 1)
+				int8_t overlap = iteratorMatch(state, it, (uint8_t*) bm);
+				if (scanPage && it->cacheEntry != NULL)
+					sbitsAddQueryCachePage(it, *((id_t*) buf), overlap);
+
+				if (overlap >= 1)
 				{	/* Overlap in bitmap - will process this page */
 					// printf("Processing page: %lu\n", readPageId);					
 					break;
@@ -734,6 +2734,16 @@ readPage:
 			}
 		}
 		
+		if (it->queryBitmap != NULL && SBITS_USING_RECORD_DIR(state->parameters) && it->lastIterRec % state->recordDirChunkSize == 0)
+		{	/* Start of chunk of records. Skip chunks whose bitmap does not overlap query. */
+			count_t count = SBITS_GET_COUNT(buf);
+			while (it->lastIterRec < count 
+					&& iteratorMatch(state, it, (uint8_t*) buf + state->recordDirOffset + (it->lastIterRec / state->recordDirChunkSize) * state->bitmapSize) == 0)
+				it->lastIterRec += state->recordDirChunkSize;
+			if (it->lastIterRec >= count)
+				continue;	/* Read next page */
+		}
+
 		/* Get record */	
 		*key = buf+state->headerSize+it->lastIterRec*state->recordSize;
 		*data = buf+state->headerSize+it->lastIterRec*state->recordSize+state->keySize;
@@ -744,15 +2754,65 @@ readPage:
 			continue;
 		if (it->maxKey != NULL && state->compareKey(*key, it->maxKey) > 0)
 			return 0;
-		if (it->minData != NULL && state->compareData(*data, it->minData) < 0)
+		void *val = *data;
+		if (SBITS_USING_DERIVED_BMAP(state->parameters))
+		{	/* Data bounds are on derived value */
+			sbitsDeriveData(state, buf, it->lastIterRec-1, it->derivedData);
+			val = it->derivedData;
+		}
+		if (SBITS_USING_MULTI_DIM(state->parameters))
+		{	/* Bounds on several columns (e.g. rectangle) */
+			if ((it->minData != NULL || it->maxData != NULL) && !state->inDataRange(val, it->minData, it->maxData))
+				continue;
+			return 1;
+		}
+		if (it->minData != NULL && state->compareData(val, it->minData) < 0)
 			continue;
-		if (it->maxData != NULL && state->compareData(*data, it->maxData) > 0)
+		if (it->maxData != NULL && state->compareData(val, it->maxData) > 0)
 			continue;
 		return 1;
 	}
 }
 
 
+#if defined(SBITS_TELEMETRY)
+/**
+@brief     	Writes telemetry frame for event.
+@param     	event
+                Event id
+@param		fields
+				Event fields
+@param		numFields
+				Number of fields (at most SBITS_TELEMETRY_MAX_FIELDS)
+*/
+void sbitsTelemetry(uint8_t event, const int32_t *fields, uint8_t numFields)
+{
+	uint8_t frame[3 + SBITS_TELEMETRY_MAX_FIELDS * 5];
+	uint8_t len = 0;
+
+	if (numFields > SBITS_TELEMETRY_MAX_FIELDS)
+		numFields = SBITS_TELEMETRY_MAX_FIELDS;
+	frame[len++] = SBITS_TELEMETRY_SYNC;
+	frame[len++] = event;
+	frame[len++] = numFields;
+	for (uint8_t i = 0; i < numFields; i++)
+	{	/* Zigzag encoding keeps small negative values short */
+		uint32_t v = ((uint32_t) fields[i] << 1) ^ (uint32_t) (fields[i] >> 31);
+		while (v >= 0x80)
+		{
+			frame[len++] = (uint8_t) (v | 0x80);
+			v >>= 7;
+		}
+		frame[len++] = (uint8_t) v;
+	}
+#if defined(ARDUINO)
+	serial_write(frame, len);
+#else
+	fwrite(frame, 1, len, stderr);
+#endif
+}
+#endif
+
 /**
 @brief     	Prints statistics.
 @param     	state
@@ -762,9 +2822,117 @@ void printStats(sbitsState *state)
 {
 	printf("Num reads: %lu\n", state->numReads);
 	printf("Buffer hits: %lu\n", state->bufferHits);
+	if (state->queryCache != NULL)
+		printf("Query cache hits: %lu\n", state->queryCacheHits);
 	printf("Num writes: %lu\n", state->numWrites);
 	printf("Num index reads: %lu\n", state->numIdxReads);	
 	printf("Num index writes: %lu\n", state->numIdxWrites);
+	printf("Num erases: %lu\n", state->numErases);
+	if (SBITS_USING_WEAR_LEVEL(state->parameters))
+	{
+		uint32_t minErases = state->wearBlocks[0].erases, maxErases = minErases;
+		for (uint16_t i = 1; i < state->wearNumBlocks; i++)
+		{
+			if (state->wearBlocks[i].erases < minErases)
+				minErases = state->wearBlocks[i].erases;
+			if (state->wearBlocks[i].erases > maxErases)
+				maxErases = state->wearBlocks[i].erases;
+		}
+		printf("Block erases: min: %lu max: %lu  Data block erases: %lu  Index block erases: %lu\n", minErases, maxErases, state->wearErases[0], state->wearErases[1]);
+	}
+	if (SBITS_USING_GAP_INDEX(state->parameters))
+		printf("Gaps in list: %d  All gaps after key: %ld\n", state->numGaps, state->gapsFromKey);
+	if (SBITS_USING_PROBE(state->parameters))
+		printf("Probe reads: %lu  Probe hits: %lu  Prediction error: %ld/16 pages  Spread: %ld/16 pages\n", state->numProbes, state->probeHits, state->probeBias, state->probeSpread);
+	if (SBITS_USING_PMEM(state->parameters))
+		printf("Persistent memory bytes written: %lu\n", state->pmemBytes);
+}
+
+/**
+@brief     	Returns location in file of data or index page. With wear leveling, index pages follow data pages
+			and each erase block is at its physical block in the block map.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Physical data or index page id
+@param		index
+				1 if index page, 0 if data page
+@return		Return page number in file.
+*/
+id_t sbitsStoragePage(sbitsState *state, id_t pageNum, int8_t index)
+{
+	if (!SBITS_USING_WEAR_LEVEL(state->parameters))
+		return pageNum;
+	if (index)
+		pageNum += state->endDataPage;
+	return (id_t) state->wearBlocks[pageNum / state->eraseSizeInPages].block * state->eraseSizeInPages + pageNum % state->eraseSizeInPages;
+}
+
+/**
+@brief     	Erases erase block before its first page is written. The erase block is moved to the spare block
+			if that balances erase counts. The region (data or index) with fewer erases per block takes the more
+			worn block so that its less worn block is used by the other region. If erase counts still differ by
+			more than SBITS_WEAR_MAX_DIFF, the least worn block is copied to the spare block and becomes the spare.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Physical data or index page id of first page of erase block
+@param		index
+				1 if index page, 0 if data page
+*/
+void wearEraseBlock(sbitsState *state, id_t pageNum, int8_t index)
+{
+	sbitsWearBlock *wear = state->wearBlocks;
+	uint16_t spare = state->wearNumBlocks - 1;
+	uint32_t dataBlocks = state->endDataPage / state->eraseSizeInPages, idxBlocks = spare - dataBlocks;
+	uint16_t block = (index ? pageNum + state->endDataPage : pageNum) / state->eraseSizeInPages;
+	uint16_t current = wear[block].block, spareBlock = wear[spare].block;
+
+	uint64_t dataRate = (uint64_t) state->wearErases[0] * idxBlocks, idxRate = (uint64_t) state->wearErases[1] * dataBlocks;
+	int8_t cold = index ? idxRate < dataRate : dataRate < idxRate;
+	if (cold ? wear[spareBlock].erases > wear[current].erases : wear[spareBlock].erases < wear[current].erases)
+	{	/* Current block has no valid data after erase so it becomes the spare */
+		wear[block].block = spareBlock;
+		wear[spare].block = current;
+		current = spareBlock;
+	}
+	wear[current].erases++;
+	state->wearErases[index]++;
+
+	/* Blocks that are rarely erased keep a low count unless their data is moved */
+	uint16_t least = 0;
+	for (uint16_t i = 1; i < state->wearNumBlocks; i++)
+		if (wear[i].erases < wear[least].erases)
+			least = i;
+	if (wear[current].erases - wear[least].erases <= SBITS_WEAR_MAX_DIFF)
+		return;
+
+	for (block = 0; block < spare && wear[block].block != least; block++)
+		;
+	if (block == spare)
+		return;		/* Least worn block is the spare */
+
+	uint8_t *buf = (uint8_t*) state->buffer + state->pageSize;
+	spareBlock = wear[spare].block;
+	state->bufferedPageId = -1;
+	for (id_t i = 0; i < state->eraseSizeInPages; i++)
+	{	/* Pages not written yet are not copied */
+		if (fseek(state->file, ((id_t) least * state->eraseSizeInPages + i) * state->pageSize, SEEK_SET) != 0)
+			break;
+		if (fread(buf, state->pageSize, 1, state->file) == 0)
+			break;
+		state->numReads++;
+		if (fseek(state->file, ((id_t) spareBlock * state->eraseSizeInPages + i) * state->pageSize, SEEK_SET) != 0
+				|| fwrite(buf, state->pageSize, 1, state->file) == 0)
+		{	/* Data stays in least worn block. Spare block remains the spare. */
+			SBITS_ERROR(SBITS_EVENT_WEAR_MOVE, (unsigned long) least);
+			return;
+		}
+		state->numWrites++;
+	}
+	wear[spareBlock].erases++;
+	wear[block].block = spareBlock;
+	wear[spare].block = least;
 }
 
 /**
@@ -782,6 +2950,7 @@ id_t writePage(sbitsState *state, void *buffer)
 
 	/* Always writes to next page number. Returned to user. */	
 	id_t pageNum = state->nextPageId++;
+	id_t firstDataPageId = state->firstDataPageId;
 
 	/* Setup page number in header */	
 	memcpy(buffer, &(pageNum), sizeof(id_t));			
@@ -792,6 +2961,7 @@ id_t writePage(sbitsState *state, void *buffer)
 			state->erasedEndPage += state->eraseSizeInPages;
 		else	
 			state->erasedEndPage += state->eraseSizeInPages-1;	/* Special case for start of file and page 0 */
+		state->numErases++;
 
 		if (state->wrappedMemory != 0) // pageNum > state->nextPageWriteId)
 		{	/* Have went through memory at least once. Whatever is erased is actual data that is no longer available. */
@@ -815,6 +2985,7 @@ id_t writePage(sbitsState *state, void *buffer)
 		state->erasedEndPage = state->startDataPage+state->eraseSizeInPages-1;
 		state->firstDataPage = state->erasedEndPage+1;	/* First active physical data page is just after what was erased */
 		state->wrappedMemory = 1;
+		state->numErases++;
 
 		/* Wrap to start of memory space */
 		state->nextPageWriteId = state->startDataPage;
@@ -825,14 +2996,24 @@ id_t writePage(sbitsState *state, void *buffer)
 		// printf("Erasing pages. Start: %d  End: %d First data page: %d\n", state->erasedEndPage-state->eraseSizeInPages+1, state->erasedEndPage, state->firstDataPage);
 	}
 
+	/* Pages that were reclaimed are no longer valid query results */
+	if (state->queryCache != NULL && firstDataPageId != state->firstDataPageId)
+		sbitsEvictQueryCache(state);
+
+	if (SBITS_USING_WEAR_LEVEL(state->parameters) && state->nextPageWriteId % state->eraseSizeInPages == 0)
+		wearEraseBlock(state, state->nextPageWriteId, 0);
+
 	/* Seek to page location in file */
-    fseek(state->file, state->nextPageWriteId*state->pageSize, SEEK_SET);	
+    fseek(state->file, sbitsStoragePage(state, state->nextPageWriteId, 0)*state->pageSize, SEEK_SET);	
 	int32_t val = fwrite(buffer, state->pageSize, 1, state->file);		
 	if (val == 0)
 	{
-		printf("Failed to write data page: %lu\n", pageNum);
+		SBITS_ERROR(SBITS_EVENT_WRITE, pageNum);
 		return -1;
 	}
+
+	if (state->valueIndexFile != NULL)
+		addValueIndexPage(state, buffer, state->nextPageWriteId);
 			
 	state->nextPageWriteId++;
 	state->numWrites++;
@@ -866,6 +3047,7 @@ id_t writeIndexPage(sbitsState *state, void *buffer)
 			state->erasedEndIdxPage += state->eraseSizeInPages;
 		else	
 			state->erasedEndIdxPage += state->eraseSizeInPages-1;	/* Special case for start of file and page 0 */
+		state->numErases++;
 
 		if (state->wrappedIdxMemory != 0) // pageNum > state->nextPageWriteId)
 		{	/* Have went through memory at least once. Whatever is erased is actual data that is no longer available. */
@@ -875,7 +3057,7 @@ id_t writeIndexPage(sbitsState *state, void *buffer)
 	}
 
 	if (state->nextIdxPageWriteId >= state->endIdxPage-state->startIdxPage+1)
-	{	printf("Exhausted index pages: %d.\n", state->nextIdxPageWriteId);
+	{	SBITS_WARN(SBITS_EVENT_INDEX_EXHAUSTED, state->nextIdxPageWriteId);
 
 		/* Index storage is full. Reclaim space. */
 		
@@ -885,6 +3067,7 @@ id_t writeIndexPage(sbitsState *state, void *buffer)
 		state->erasedEndIdxPage = 0+state->eraseSizeInPages-1;
 		state->firstIdxPage = state->erasedEndIdxPage+1;	/* First active physical data page is just after what was erased */
 		state->wrappedIdxMemory = 1;
+		state->numErases++;
 
 		/* Wrap to start of memory space */
 		state->nextIdxPageWriteId = 0; // state->startIdxPage;
@@ -893,12 +3076,15 @@ id_t writeIndexPage(sbitsState *state, void *buffer)
 	}
 
 
+	if (SBITS_USING_WEAR_LEVEL(state->parameters) && state->nextIdxPageWriteId % state->eraseSizeInPages == 0)
+		wearEraseBlock(state, state->nextIdxPageWriteId, 1);
+
 	/* Seek to page location in file */
-    fseek(state->indexFile, state->nextIdxPageWriteId*state->pageSize, SEEK_SET);	
+    fseek(state->indexFile, sbitsStoragePage(state, state->nextIdxPageWriteId, 1)*state->pageSize, SEEK_SET);	
 	int32_t val = fwrite(buffer, state->pageSize, 1, state->indexFile);
 	if (val == 0)
 	{
-		printf("Failed to write index page: %lu\n", pageNum);
+		SBITS_ERROR(SBITS_EVENT_INDEX_WRITE, pageNum);
 		return -1;
 	}
     
@@ -930,19 +3116,26 @@ int8_t readPage(sbitsState *state, id_t pageNum)
     SD_FILE* fp = state->file;
     void *buf = state->buffer + state->pageSize;
 
-    /* Seek to page location in file */
-    fseek(fp, pageNum*state->pageSize, SEEK_SET);
-	int32_t count = 10;
-    /* Read page into start of buffer 1 */   
-	count = fread(buf, state->pageSize, 1, fp);
-	if (count == 0)
+	if (state->dataMap != NULL)
+		memcpy(buf, (uint8_t*) state->dataMap + sbitsStoragePage(state, pageNum, 0)*state->pageSize, state->pageSize);
+	else
 	{
-		printf("Read error :%lu\n", count);
-		return 1;
-	}    
+	    /* Seek to page location in file */
+	    fseek(fp, sbitsStoragePage(state, pageNum, 0)*state->pageSize, SEEK_SET);
+		int32_t count = 10;
+	    /* Read page into start of buffer 1 */   
+		count = fread(buf, state->pageSize, 1, fp);
+		if (count == 0)
+		{
+			SBITS_ERROR(SBITS_EVENT_READ, count);
+			return 1;
+		}    
+	}
 
     state->numReads++;
 	state->bufferedPageId = pageNum;    
+	if (SBITS_USING_WARM_START(state->parameters))
+		addHotPage(state, pageNum);
 	return 0;
 }
 
@@ -967,15 +3160,48 @@ int8_t readIndexPage(sbitsState *state, id_t pageNum)
     SD_FILE* fp = state->indexFile;
     void *buf = state->buffer + state->pageSize*SBITS_INDEX_READ_BUFFER;
 
-    /* Seek to page location in file */
-    fseek(fp, pageNum*state->pageSize, SEEK_SET);
-	
-    /* Read page into start of buffer */   
-    if (0 ==  fread(buf, state->pageSize, 1, fp))
-    	return 1;           
+	if (state->indexMap != NULL)
+		memcpy(buf, (uint8_t*) state->indexMap + sbitsStoragePage(state, pageNum, 1)*state->pageSize, state->pageSize);
+	else
+	{
+	    /* Seek to page location in file */
+	    fseek(fp, sbitsStoragePage(state, pageNum, 1)*state->pageSize, SEEK_SET);
+		
+	    /* Read page into start of buffer */   
+	    if (0 ==  fread(buf, state->pageSize, 1, fp))
+	    	return 1;           
+	}
 
     state->numIdxReads++;
 	state->bufferedIndexPageId = pageNum;    
+	if (SBITS_USING_WARM_START(state->parameters))
+		addHotPage(state, pageNum | SBITS_HOT_INDEX_PAGE);
+	return 0;
+}
+
+/**
+@brief     	Reads given value index page from storage.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Page number to read
+@return		Return 0 if success, -1 if error.
+*/
+int8_t readValuePage(sbitsState *state, id_t pageNum)
+{   
+	if (pageNum == state->bufferedValuePageId)
+	{
+		state->bufferHits++;
+		return 0;
+	}
+
+    void *buf = state->buffer + state->pageSize*SBITS_VALUE_READ_BUFFER;
+    fseek(state->valueIndexFile, pageNum*state->pageSize, SEEK_SET);
+    if (0 == fread(buf, state->pageSize, 1, state->valueIndexFile))
+    	return 1;
+
+    state->numIdxReads++;
+	state->bufferedValuePageId = pageNum;
 	return 0;
 }
 
@@ -991,6 +3217,59 @@ void resetStats(sbitsState *state)
 	state->bufferHits = 0;  
 	state->numIdxReads = 0;
 	state->numIdxWrites = 0;
+	state->queryCacheHits = 0;
+	state->numBoundsChanges = 0;
+	state->numErases = 0;
+	state->numProbes = 0;
+	state->probeHits = 0;
+	state->pmemBytes = 0;
+}
+
+/**
+@brief     	Estimates energy and time of the page reads, writes and erases since resetStats() plus CPU cycles on a device.
+@param     	state
+                SBITS state structure
+@param		model
+				Device costs (e.g. SBITS_DEVICE_SD)
+@param		cycles
+				CPU cycles of the workload
+@param		energy
+				Estimated energy and time
+*/
+void sbitsEstimateEnergy(sbitsState *state, const sbitsDeviceModel *model, uint64_t cycles, sbitsEnergy *energy)
+{
+	/* Index and value index pages cost the same as data pages. Buffer hits cost no I/O. */
+	uint64_t reads = (uint64_t) state->numReads + state->numIdxReads;
+	uint64_t writes = (uint64_t) state->numWrites + state->numIdxWrites;
+
+	energy->ioEnergy = (uint32_t) ((reads * model->readEnergy + writes * model->writeEnergy + (uint64_t) state->numErases * model->eraseEnergy) / 1000);
+	energy->ioTime = (uint32_t) ((reads * model->readTime + writes * model->writeTime + (uint64_t) state->numErases * model->eraseTime) / 1000);
+	energy->cpuEnergy = (uint32_t) (cycles * model->cycleEnergy / 1000000);
+	energy->cpuTime = model->cpuFrequency == 0 ? 0 : (uint32_t) (cycles * 1000 / model->cpuFrequency);
+}
+
+/**
+@brief     	Prints estimated energy and time in total and per operation.
+@param     	state
+                SBITS state structure
+@param		model
+				Device costs
+@param		cycles
+				CPU cycles of the workload
+@param		numOps
+				Number of operations (puts, gets or queries) in the workload
+*/
+void printEnergy(sbitsState *state, const sbitsDeviceModel *model, uint64_t cycles, uint32_t numOps)
+{
+	sbitsEnergy energy;
+	sbitsEstimateEnergy(state, model, cycles, &energy);
+
+	uint32_t total = energy.ioEnergy + energy.cpuEnergy;
+	printf("Device: %s\n", model->name);
+	printf("Energy: %lu uJ (storage: %lu uJ  CPU: %lu uJ)\n", total, energy.ioEnergy, energy.cpuEnergy);
+	printf("Storage time: %lu ms  CPU time: %lu ms\n", energy.ioTime, energy.cpuTime);
+	if (numOps > 0)
+		printf("Energy per operation: %lu nJ\n", (uint32_t) ((uint64_t) total * 1000 / numOps));
 }
 
 /**
@@ -1055,6 +3334,43 @@ void buildBitmapInt16FromRange(sbitsState *state, void *min, void *max, void *bm
 }	
 
 
+/**
+@brief     	Builds bitmap of any size from (min, max) range. Bitmap must be initialized to 0.
+			Assumes update function sets one bit per value, with buckets in increasing value order
+			and bucket i in bit (7 - i%8) of byte i/8.
+@param		updateBitmap
+				function that sets bit for a value
+@param		size
+				bitmap size in bytes
+@param		min
+				minimum value (may be NULL)
+@param		max
+				maximum value (may be NULL)
+@param		bm
+				bitmap created
+*/
+void buildBitmapFromRange(void (*updateBitmap)(void *data, void *bm), int8_t size, void *min, void *max, void *bm)
+{
+	uint8_t *bmval = (uint8_t*) bm;
+	int16_t first = 0, last = size*8-1, i;
+
+	if (min != NULL)
+	{	/* Find bit of min value */
+		updateBitmap(min, bm);
+		for (first = 0; first <= last && (bmval[first >> 3] & (128 >> (first & 7))) == 0; first++);
+		memset(bm, 0, size);
+	}
+	if (max != NULL)
+	{	/* Find bit of max value */
+		updateBitmap(max, bm);
+		for (i = last; i > 0 && (bmval[i >> 3] & (128 >> (i & 7))) == 0; i--);
+		last = i;
+	}
+
+	for (i = first; i <= last; i++)
+		bmval[i >> 3] |= 128 >> (i & 7);
+}
+
 /**
 @brief     	Builds 64-bit bitmap from (min, max) range.
 @param     	state
@@ -1068,53 +3384,6 @@ void buildBitmapInt16FromRange(sbitsState *state, void *min, void *max, void *bm
 */
 void buildBitmapInt64FromRange(sbitsState *state, void *min, void *max, void *bm)
 {
-    uint64_t* bmval = (uint64_t*) bm;
-
-    if (min == NULL && max == NULL)
-    {
-        *bmval = UINT64_MAX;  /* Everything */
-        return;
-    }
-        
-    int8_t i = 0;
-    uint64_t val = (uint64_t) (INT64_MAX)+1;
-    if (min != NULL)
-    {
-        /* Set bits based on min value */
-        state->updateBitmap(min, bm);
-		
-        /* Assume here that bits are set in increasing order based on smallest value */                        
-        /* Find first set bit */
-        while ( (val & *bmval) == 0 && i < 64)
-        {
-            i++;
-            val = val / 2;
-        }
-        val = val / 2;
-        i++;
-    }
-    if (max != NULL)
-    {
-        /* Set bits based on min value */
-		uint64_t prev = *bmval;
-        state->updateBitmap(max, bm);
-		if (*bmval == prev)
-			return;	/* Min and max bit vector are the same */
-
-        while ( (val & *bmval) == 0 && i < 64)
-        {
-            i++;
-            *bmval = *bmval + val;
-            val = val / 2;                 
-        }
-    }
-    else
-    {
-        while (i < 64)
-        {
-            i++;
-            *bmval = *bmval + val;
-            val = val / 2;
-        }
-    }            
-}	
+	/* Buckets are in byte order (bucket i in bit 7 - i%8 of byte i/8) as set by update functions */
+	buildBitmapFromRange(state->updateBitmap, 8, min, max, bm);
+}
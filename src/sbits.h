@@ -33,6 +33,9 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 /******************************************************************************/
+#if !defined(SBITS_H_)
+#define SBITS_H_
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -40,10 +43,14 @@ extern "C" {
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if defined(ARDUINO)
 #include "file/serial_c_iface.h"
 #include "file/sd_stdio_c_iface.h"
+#elif !defined(SD_FILE)
+/* Host builds use stdio files directly */
+#define SD_FILE FILE
 #endif
 
 /* Define type for page ids (physical and logical). */
@@ -56,32 +63,148 @@ typedef uint16_t count_t;
 #define SBITS_USE_MAX_MIN	2
 #define SBITS_USE_SUM 		4
 #define SBITS_USE_BMAP		8
+#define SBITS_USE_QUERY_CACHE	16
+#define SBITS_USE_FINE_BMAP		32
+#define SBITS_USE_RECORD_DIR	64
+#define SBITS_USE_WARM_START	128
+#define SBITS_USE_HASH_BMAP		256		/* Bitmap bits set by hashing data value (Bloom filter) instead of value ranges */
+#define SBITS_USE_MULTI_DIM		512		/* Data bounds on several columns. Uses buildBitmap and inDataRange functions. */
+#define SBITS_USE_DERIVED_BMAP	1024	/* Bitmaps and data bounds on value derived from record and previous record */
+#define SBITS_USE_COMPRESSED_INDEX	2048	/* Index records store sparse bitmaps as a list of set buckets */
+#define SBITS_USE_RANGE_BMAP	4096	/* Bitmap bit i is set if page has a value in bucket <= i (or >= i, see rangeBitmapDir) */
+#define SBITS_USE_VALUE_INDEX	8192	/* Sorted run of (value, record) for each data erase block for value lookups */
+#define SBITS_USE_ADAPTIVE_BMAP	16384	/* Bucket boundaries of each index page (or erase block) adapt to 32-bit data value distribution */
+#define SBITS_USE_WEAR_LEVEL	32768	/* Data and index erase blocks share one file and are moved to balance erase counts */
+#define SBITS_USE_GAP_INDEX		65536	/* List of gaps in keys (difference between consecutive keys above gapThreshold) */
+#define SBITS_USE_PROBE			131072	/* sbitsGet() reads predicted page and its likely neighbours in one read into probeBuffer */
+#define SBITS_USE_PMEM			262144	/* Output page, index write page and storage location state kept in persistent memory (pmemRead/pmemWrite) */
 
 #define SBITS_USING_INDEX(x)  	((x & SBITS_USE_INDEX) > 0 ? 1 : 0)
 #define SBITS_USING_MAX_MIN(x)  ((x & SBITS_USE_MAX_MIN) > 0 ? 1 : 0)
 #define SBITS_USING_SUM(x)  	((x & SBITS_USE_SUM) > 0 ? 1 : 0)
 #define SBITS_USING_BMAP(x)  	((x & SBITS_USE_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_QUERY_CACHE(x)	((x & SBITS_USE_QUERY_CACHE) > 0 ? 1 : 0)
+#define SBITS_USING_FINE_BMAP(x)	((x & SBITS_USE_FINE_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_RECORD_DIR(x)	((x & SBITS_USE_RECORD_DIR) > 0 ? 1 : 0)
+#define SBITS_USING_WARM_START(x)	((x & SBITS_USE_WARM_START) > 0 ? 1 : 0)
+#define SBITS_USING_HASH_BMAP(x)	((x & SBITS_USE_HASH_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_MULTI_DIM(x)	((x & SBITS_USE_MULTI_DIM) > 0 ? 1 : 0)
+#define SBITS_USING_DERIVED_BMAP(x)	((x & SBITS_USE_DERIVED_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_COMPRESSED_INDEX(x)	((x & SBITS_USE_COMPRESSED_INDEX) > 0 ? 1 : 0)
+#define SBITS_USING_RANGE_BMAP(x)	((x & SBITS_USE_RANGE_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_VALUE_INDEX(x)	((x & SBITS_USE_VALUE_INDEX) > 0 ? 1 : 0)
+#define SBITS_USING_ADAPTIVE_BMAP(x)	((x & SBITS_USE_ADAPTIVE_BMAP) > 0 ? 1 : 0)
+#define SBITS_USING_WEAR_LEVEL(x)	((x & SBITS_USE_WEAR_LEVEL) > 0 ? 1 : 0)
+#define SBITS_USING_GAP_INDEX(x)	((x & SBITS_USE_GAP_INDEX) > 0 ? 1 : 0)
+#define SBITS_USING_PROBE(x)		((x & SBITS_USE_PROBE) > 0 ? 1 : 0)
+#define SBITS_USING_PMEM(x)			((x & SBITS_USE_PMEM) > 0 ? 1 : 0)
+
+/* Least worn erase block is copied to spare block when a block has this many more erases (if SBITS_USE_WEAR_LEVEL) */
+#if !defined(SBITS_WEAR_MAX_DIFF)
+#define SBITS_WEAR_MAX_DIFF			4
+#endif
+
+/* Key difference is a gap if it is more than this times the average key difference (if SBITS_USE_GAP_INDEX and gapThreshold is 0) */
+#if !defined(SBITS_GAP_FACTOR)
+#define SBITS_GAP_FACTOR			4
+#endif
+
+/* Number of entries of wearBlocks (erase blocks in storage) (if SBITS_USE_WEAR_LEVEL) */
+#define SBITS_WEAR_NUM_BLOCKS(s)	(((s)->endAddress - (s)->startAddress) / (s)->pageSize / (s)->eraseSizeInPages)
+
+/* With SBITS_USE_PMEM, the output page, index write page and storage location state are kept in byte-addressable
+	persistent memory (FRAM/MRAM) of sbitsPmemSize() bytes. sbitsInit() resumes from it. Records are durable once
+	sbitsPut() returns, and durability costs no page writes. */
 
 /* Offsets with header */
 #define SBITS_COUNT_OFFSET		4
-#define SBITS_BITMAP_OFFSET		6
-// #define SBITS_MIN_OFFSET		8
-#define SBITS_MIN_OFFSET		14
+#define SBITS_BITMAP_OFFSET		6			/* Data page bitmap (if bitmapOffset is not 0) */
 #define SBITS_IDX_HEADER_SIZE	16
+#define SBITS_IDX_USED_OFFSET	6			/* Bytes used on compressed index page (0 if no records) */
+
+#define SBITS_GET_IDX_USED(x)	*((count_t *) (x+SBITS_IDX_USED_OFFSET))
 
 #define SBITS_GET_COUNT(x)  	*((count_t *) (x+SBITS_COUNT_OFFSET))
 #define SBITS_INC_COUNT(x)  	*((count_t *) (x+SBITS_COUNT_OFFSET)) = *((count_t *) (x+SBITS_COUNT_OFFSET))+1
 
 #define SBITS_GET_BITMAP(x)  	((void*)  (x + SBITS_BITMAP_OFFSET))
 
-#define SBITS_GET_MIN_KEY(x,y)	((void*)  (x + SBITS_MIN_OFFSET))
-#define SBITS_GET_MAX_KEY(x,y)	((void*)  (x + SBITS_MIN_OFFSET + y->keySize))
+/* Min and max data value in header (if SBITS_USE_MAX_MIN). Min and max key are the first and last record keys. */
+#define SBITS_GET_MIN_DATA(x,y)	((void*)  (x + y->minMaxOffset))
+#define SBITS_GET_MAX_DATA(x,y)	((void*)  (x + y->minMaxOffset + SBITS_ALIGN(y->dataSize)))
+
+/* Build with -DSBITS_ALIGN_RECORDS=4 (or 2) to pad page header and records to that alignment.
+	Keys and 32-bit data columns are then read with aligned loads. Key size must be a multiple of the alignment. */
+#if defined(SBITS_ALIGN_RECORDS)
+#define SBITS_ALIGN(x)			(((x) + SBITS_ALIGN_RECORDS - 1) / SBITS_ALIGN_RECORDS * SBITS_ALIGN_RECORDS)
+#else
+#define SBITS_ALIGN(x)			(x)
+#endif
+
+/**
+@brief     	Reads 32-bit integer key or data column of a record on a page.
+*/
+static inline int32_t sbitsReadInt32(const void *ptr)
+{
+#if defined(SBITS_ALIGN_RECORDS) && SBITS_ALIGN_RECORDS >= 4
+	return *((const int32_t*) ptr);
+#else
+	int32_t val;
+	memcpy(&val, ptr, sizeof(int32_t));
+	return val;
+#endif
+}
+
+/* Maximum size of bitmap in bytes. Define as 32 to build in wide bitmaps (up to 256 buckets). Sizes state and iterator bitmaps. */
+#if !defined(SBITS_MAX_BITMAP_SIZE)
+#define SBITS_MAX_BITMAP_SIZE		8
+#endif
+
+/* Direction of range-encoded bitmaps (if SBITS_USE_RANGE_BMAP) */
+#define SBITS_RANGE_LE				0		/* Bit i set if some value is in bucket <= i. Prunes queries with maximum data value. */
+#define SBITS_RANGE_GE				1		/* Bit i set if some value is in bucket >= i. Prunes queries with minimum data value. */
+
+/* Size of bucket boundaries (minimum and maximum 32-bit value) in data and index page headers (if SBITS_USE_ADAPTIVE_BMAP) */
+#define SBITS_BOUNDS_SIZE			8
+/* Boundaries are recomputed for next segment if more than this percent of values are outside boundaries or in edge buckets */
+#define SBITS_ADAPT_EDGE_PERCENT	25
 
-#define SBITS_GET_MIN_DATA(x,y)	((void*)  (x + SBITS_MIN_OFFSET + y->keySize*2))
-#define SBITS_GET_MAX_DATA(x,y)	((void*)  (x + SBITS_MIN_OFFSET + y->keySize*2 + y->dataSize))
+/* First byte of compressed index record with uncompressed bitmap. Otherwise, first byte is number of set buckets that follow. */
+#define SBITS_IDX_RAW				0xFF
+
+/* Maximum size of fine bitmap in bytes (at most 32). Fine bitmaps (SBITS_USE_FINE_BMAP) are only built in if this is defined larger than 0. */
+#if !defined(SBITS_MAX_FINE_BITMAP_SIZE)
+#define SBITS_MAX_FINE_BITMAP_SIZE	0
+#endif
+
+/* Number of fine bitmap segments (of eraseSizeInPages index records) for x index records */
+#define SBITS_FINE_SEGMENTS(y,x)	((x + y->eraseSizeInPages - 1) / y->eraseSizeInPages)
+
+/* Number of record directory chunks (of recordDirChunkSize records) for x records */
+#define SBITS_RECORD_DIR_CHUNKS(y,x)	((x + y->recordDirChunkSize - 1) / y->recordDirChunkSize)
+
+/* Maximum size of derived value in bytes (if SBITS_USE_DERIVED_BMAP) */
+#define SBITS_MAX_DERIVED_SIZE		16
+
+/* Number of recently read pages remembered for warm start */
+#define SBITS_HOT_PAGES				8
+/* Flag on hot page id for index pages */
+#define SBITS_HOT_INDEX_PAGE		0x80000000
 
 #define SBITS_INDEX_WRITE_BUFFER	2
 #define SBITS_INDEX_READ_BUFFER		3
+#define SBITS_VALUE_READ_BUFFER		4		/* Value index run page read (if SBITS_USE_VALUE_INDEX) */
+#define SBITS_VALUE_BUILD_BUFFER	5		/* First of valueRunPages pages of entries of current erase block (if SBITS_USE_VALUE_INDEX) */
+
+/* Value index run page header: logical id of first data page of erase block, number of entries in run */
+#define SBITS_VALUE_HEADER_SIZE		SBITS_ALIGN(8)
+#define SBITS_VALUE_COUNT_OFFSET	4
+
+/* Size of value index entry (value, record number in erase block). Padded so values passed to compareData are aligned. */
+#define SBITS_VALUE_ENTRY_SIZE(s)	SBITS_ALIGN((s)->valueSize + sizeof(count_t))
+
+/* Maximum number of candidate pages memoized by one query cache entry */
+#define SBITS_QUERY_CACHE_MAX_PAGES	32
 
 #define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c"
 #define BYTE_TO_BINARY(byte)  \
@@ -113,9 +236,75 @@ typedef uint16_t count_t;
   (bm & 0x02 ? '1' : '0'), \
   (bm & 0x01 ? '1' : '0') 
 
+/* Maximum number of query cache entries chosen by sbitsConfigureForBudget() */
+#define SBITS_BUDGET_MAX_QUERY_CACHE	8
+
+typedef struct {
+	uint8_t rangePercent;						/* Percent of operations that are data value range queries (iterator with data filter) */
+	uint8_t selectivity;						/* Expected percent of pages with a bucket that matches a data range query */
+	uint8_t repeatQueries;						/* 1 if the same data range queries are repeated (e.g. dashboard refresh), 0 otherwise */
+} sbitsWorkloadHints;
+
+typedef struct {
+	uint32_t putIO;								/* Predicted page I/Os per put (scaled by 1000) */
+	uint32_t getIO;								/* Predicted page I/Os per get (scaled by 1000) */
+	uint32_t rangeIO;							/* Predicted page I/Os per data range query (scaled by 1000) */
+	uint32_t ramBytes;							/* RAM used by page buffers and query cache */
+} sbitsCostEstimate;
+
+/* Device models for sbitsEstimateEnergy() with costs of 512 byte pages. Initializers so unused models take no RAM. */
+/* SD card in SPI mode with 16 MHz ATmega2560 (erase is done by card during write) */
+#define SBITS_DEVICE_SD			{ "SD card", 60000, 250000, 0, 6250, 900, 2500, 0, 16000000 }
+/* Serial NOR flash (4 KB erase blocks) with 16 MHz ATmega2560 */
+#define SBITS_DEVICE_NOR		{ "NOR flash", 15000, 90000, 2000000, 6250, 600, 2000, 45000, 16000000 }
+
+typedef struct {
+	const char *name;
+	uint32_t readEnergy;						/* Energy per page read (nJ) */
+	uint32_t writeEnergy;						/* Energy per page write (nJ) */
+	uint32_t eraseEnergy;						/* Energy per erase block (nJ) */
+	uint32_t cycleEnergy;						/* Energy per 1000 CPU cycles (nJ) */
+	uint32_t readTime;							/* Time per page read (us) */
+	uint32_t writeTime;							/* Time per page write (us) */
+	uint32_t eraseTime;							/* Time per erase block (us) */
+	uint32_t cpuFrequency;						/* CPU cycles per second */
+} sbitsDeviceModel;
+
+typedef struct {
+	uint32_t ioEnergy;							/* Storage energy of page reads, writes and erases (uJ) */
+	uint32_t cpuEnergy;							/* CPU energy (uJ) */
+	uint32_t ioTime;							/* Storage time (ms) */
+	uint32_t cpuTime;							/* CPU time (ms) */
+} sbitsEnergy;
+
+typedef struct {
+	uint32_t erases;							/* Erase count of physical erase block with this number */
+	uint16_t block;								/* Physical erase block of logical erase block with this number (data blocks, then index blocks, then spare block) */
+} sbitsWearBlock;
+
+typedef struct {
+	int32_t startKey;							/* Last key before gap */
+	int32_t endKey;								/* First key after gap */
+} sbitsGap;
+
+typedef struct {
+	uint64_t queryBitmap;						/* Query bitmap that entry was built for (key of cache entry) */
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+	uint8_t fineQueryBitmap[SBITS_MAX_FINE_BITMAP_SIZE];	/* Fine query bitmap that entry was built for (also key of entry if SBITS_USE_FINE_BMAP) */
+#endif
+	id_t 	nextPageId;							/* All pages with logical id less than this have been checked */
+	id_t 	pages[SBITS_QUERY_CACHE_MAX_PAGES];	/* Logical ids of pages that overlap query bitmap (ascending) */
+	count_t numPages;							/* Number of pages in candidate list */
+	uint16_t lastUsed;							/* Query cache clock value when entry was last used (for LRU) */
+	int8_t 	valid;								/* 1 if entry is in use, 0 otherwise */
+} sbitsQueryCacheEntry;
+
 typedef struct {
 	SD_FILE *file;								/* File for storing data records. */
-	SD_FILE *indexFile;							/* File for storing index records. */
+	SD_FILE *indexFile;							/* File for storing index records. Same as file if SBITS_USE_WEAR_LEVEL. */
+	SD_FILE *valueIndexFile;					/* File for storing value index runs (if SBITS_USE_VALUE_INDEX) */
+	void 	*dataMap;						/* Read-only memory mapping of data file used for reads instead of file (NULL if none) */
+	void 	*indexMap;						/* Read-only memory mapping of index file used for reads instead of file (NULL if none) */
 	id_t 	startAddress;						/* Start address in memory space */
 	id_t 	endAddress;							/* End address in memory space */
 	count_t eraseSizeInPages;					/* Erase size in pages */
@@ -133,12 +322,25 @@ typedef struct {
 	void 	*buffer;							/* Pre-allocated memory buffer for use by algorithm */
 	int8_t 	bufferSizeInBlocks;					/* Size of buffer in blocks */
 	count_t pageSize;							/* Size of physical page on device */
-	int8_t 	parameters;    						/* Parameter flags for indexing and bitmaps */
+	uint32_t parameters;   						/* Parameter flags for indexing and bitmaps */
 	int8_t 	keySize;							/* Size of key in bytes (fixed-size records) */
 	int8_t 	dataSize;							/* Size of data in bytes (fixed-size records) */
 	int8_t 	recordSize;							/* Size of record in bytes (fixed-size records) */
-	int8_t 	headerSize;							/* Size of header in bytes (calculated during init()) */	
+	count_t headerSize;							/* Size of header in bytes (calculated during init()) */	
 	int8_t 	bitmapSize;							/* Size of bitmap in bytes */
+	int8_t 	rangeBitmapDir;						/* SBITS_RANGE_LE or SBITS_RANGE_GE (if SBITS_USE_RANGE_BMAP) */
+	int8_t 	fineBitmapSize;						/* Size of fine bitmap in bytes (if SBITS_USE_FINE_BMAP) */
+	int8_t 	recordDirChunkSize;					/* Records per chunk of record directory (if SBITS_USE_RECORD_DIR). Default 16. */
+	count_t bitmapOffset;						/* Offset of bitmap in page header. 0 if index records hold page bitmaps. (calculated during init()) */
+	count_t minMaxOffset;						/* Offset of min and max data value in page header (if SBITS_USE_MAX_MIN) (calculated during init()) */
+	count_t recordDirOffset;					/* Offset of record directory in page header (calculated during init()) */
+	count_t boundsOffset;						/* Offset of bucket boundaries in page header (if SBITS_USE_ADAPTIVE_BMAP) (calculated during init()) */
+	count_t derivedOffset;						/* Offset of previous page last record in page header (if SBITS_USE_DERIVED_BMAP) (calculated during init()) */
+	count_t idxHeaderSize;						/* Size of index page header including fine bitmaps (calculated during init()) */
+	int8_t 	valueSize;							/* Bytes at start of data stored in value index (if SBITS_USE_VALUE_INDEX). Default dataSize. */
+	count_t valueEntriesPerPage;				/* Value index entries per run page (calculated during init()) */
+	count_t valueRunPages;						/* Pages in run of one erase block (calculated during init()) */
+	count_t numValueEntries;					/* Entries of current erase block in build buffer */
 	id_t 	avgKeyDiff;							/* Estimate for difference between key values. Used for get() to predict location of record. */
 	id_t 	nextPageId;							/* Next logical page id. Page id is an incrementing value and may not always be same as physical page id. */
 	id_t 	nextPageWriteId;					/* Physical page id of next page to write. */	
@@ -150,16 +352,58 @@ typedef struct {
 	int8_t 	(*compareData)(void *a, void *b);	/* Function that compares two arbitrary data values passed as parameters */
 	void 	(*extractData)(void *data);			/* Given a record, function that extracts the data (key) value from that record */
 	void 	(*updateBitmap)(void *data, void *bm);	/* Given a record, updates bitmap based on its data (key) value */
+	void 	(*updateFineBitmap)(void *data, void *bm);	/* Given a record, updates fine bitmap based on its data value (if SBITS_USE_FINE_BMAP) */
 	int8_t 	(*inBitmap)(void *data, void *bm);	/* Returns 1 if data (key) value is a valid value given the bitmap */
+	uint8_t pageBitmap[SBITS_MAX_BITMAP_SIZE];	/* Bitmap of page being filled if not stored in page header (bitmapOffset is 0) */
+	int32_t bitmapMin;							/* Bucket boundaries of current segment (if SBITS_USE_ADAPTIVE_BMAP). Set initial values before init(). */
+	int32_t bitmapMax;
+	int32_t segmentMin;							/* Smallest and largest value of current segment (if SBITS_USE_ADAPTIVE_BMAP) */
+	int32_t segmentMax;
+	uint32_t segmentCount;						/* Values in current segment */
+	uint32_t segmentEdgeCount;					/* Values of current segment in first or last bucket */
+	id_t 	numBoundsChanges;					/* Number of segments with recomputed boundaries */
+	void 	(*buildBitmap)(void *min, void *max, void *bm);	/* Builds query bitmap for data bounds (if SBITS_USE_MULTI_DIM). min or max may be NULL. */
+	int8_t 	(*inDataRange)(void *data, void *min, void *max);	/* Returns 1 if data is within data bounds on all columns (if SBITS_USE_MULTI_DIM) */
+	void 	(*deriveData)(void *prevKey, void *prevData, void *key, void *data, void *derived);	/* Computes derived value of record from previous record (prevKey and prevData NULL for first record) (if SBITS_USE_DERIVED_BMAP) */
+	sbitsQueryCacheEntry *queryCache;			/* Pre-allocated query cache entries (if SBITS_USE_QUERY_CACHE) */
+	sbitsWearBlock *wearBlocks;					/* Pre-allocated SBITS_WEAR_NUM_BLOCKS(state) entries (if SBITS_USE_WEAR_LEVEL) */
+	uint16_t wearNumBlocks;						/* Entries in wearBlocks (calculated during init()) */
+	id_t 	wearErases[2];						/* Erases of data blocks and of index blocks (if SBITS_USE_WEAR_LEVEL) */
+	sbitsGap *gaps;								/* Pre-allocated circular list of the maxGaps most recent gaps (if SBITS_USE_GAP_INDEX) */
+	int16_t maxGaps;							/* Number of gap list entries */
+	int16_t numGaps;							/* Number of gaps in list */
+	int16_t nextGap;							/* Next gap list entry to replace when list is full */
+	int32_t gapThreshold;						/* Key difference larger than this is a gap. 0 uses SBITS_GAP_FACTOR times avgKeyDiff. */
+	int32_t gapsFromKey;						/* Gap list has all gaps with keys after this key (older gaps were replaced) */
+	void 	*probeBuffer;						/* Pre-allocated memory of probePages pages for pages read at once by sbitsGet() (if SBITS_USE_PROBE) */
+	int8_t 	probePages;							/* Most pages read at once by sbitsGet() (at least 2) */
+	int32_t probeBias;							/* Average error of predicted page of sbitsGet() in pages (scaled by 16) */
+	int32_t probeSpread;						/* Average absolute error of predicted page of sbitsGet() in pages (scaled by 16) */
+	int8_t 	queryCacheSize;						/* Number of query cache entries */
+	uint16_t queryCacheClock;					/* Incremented on every cache lookup. Used for LRU replacement. */
 	int32_t minKey;								/* Minimum key */
-	int32_t maxKey;								/* Maximum key */
+	int32_t maxKey;								/* Maximum key (last key inserted) */
 	id_t 	numWrites;							/* Number of page writes */
 	id_t 	numReads;							/* Number of page reads */
 	id_t 	numIdxWrites;						/* Number of index page writes */
 	id_t 	numIdxReads;						/* Number of index page reads */
+	id_t 	numErases;							/* Number of data and index erase blocks erased */
 	id_t 	bufferHits;							/* Number of pages returned from buffer rather than storage */
+	id_t 	queryCacheHits;						/* Number of iterators that reused a query cache entry */
+	id_t 	numProbes;							/* Number of reads of several pages by sbitsGet() */
+	id_t 	probeHits;							/* Number of sbitsGet() calls that found key page in pages read at once */
+	id_t 	hotPages[SBITS_HOT_PAGES];			/* Physical ids of recently read pages (index pages flagged with SBITS_HOT_INDEX_PAGE) (if SBITS_USE_WARM_START) */
+	int8_t 	numHotPages;						/* Number of pages in hot page list */
+	int8_t 	nextHotPage;						/* Next hot page to replace, or next hot page to prefetch after warm start */
+	int8_t 	prefetching;						/* 1 if hot pages from warm start remain to be prefetched, 0 otherwise */
 	id_t 	bufferedPageId;						/* Page id currently in read buffer */
 	id_t 	bufferedIndexPageId;				/* Index page id currently in index read buffer */
+	id_t 	bufferedValuePageId;				/* Value index page id currently in value read buffer */
+	void 	*pmem;								/* Persistent memory passed to pmemRead and pmemWrite, e.g. mapped address or device handle (if SBITS_USE_PMEM) */
+	void 	(*pmemRead)(void *pmem, uint32_t offset, void *data, uint32_t length);			/* Reads bytes of persistent memory */
+	void 	(*pmemWrite)(void *pmem, uint32_t offset, const void *data, uint32_t length);	/* Writes bytes of persistent memory */
+	uint32_t pmemSlot;							/* Offset of slot with current state (calculated during init()) */
+	uint32_t pmemBytes;							/* Number of bytes written to persistent memory */
 } sbitsState;
 
 
@@ -168,15 +412,60 @@ typedef struct {
 	count_t lastIterRec;						/* Last record read by iterator */
 	id_t 	lastIdxIterPage;					/* Last index page read by iterator */
 	count_t lastIdxIterRec;						/* Last index record read by iterator */
+	count_t idxIterOffset;						/* Offset on index page of record idxIterOffsetRec (if SBITS_USE_COMPRESSED_INDEX) */
+	count_t idxIterOffsetRec;
 	int8_t 	wrappedMemory;						/* 1 if have wrapped around in memory during iterator search, 0 otherwise */
 	int8_t 	wrappedIdxMemory;					/* 1 if have wrapped around in memory during index iterator search, 0 otherwise */
 	void*	minKey;
 	void*	maxKey;
     void*	minData;
 	void* 	maxData;
-	void*	queryBitmap;
+	void*	queryBitmap;							/* Query bitmap of data range (NULL if none). Points to queryBitmapData. */
+	uint64_t queryBitmapData[(SBITS_MAX_BITMAP_SIZE + 7) / 8];
+	int16_t queryBucket;						/* Bucket tested in page bitmaps (if SBITS_USE_RANGE_BMAP) */
+	int32_t queryBitmapMin;						/* Bucket boundaries query bitmap was built for (if SBITS_USE_ADAPTIVE_BMAP) */
+	int32_t queryBitmapMax;
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+	uint8_t fineQueryBitmap[SBITS_MAX_FINE_BITMAP_SIZE];	/* Query bitmap for fine bitmaps (if SBITS_USE_FINE_BMAP) */
+#endif
+	sbitsQueryCacheEntry *cacheEntry;			/* Query cache entry used by iterator (NULL if none) */
+	count_t cacheRec;							/* Next cached page to return from query cache entry */
+	count_t cacheEnd;							/* Number of cached pages to return before scanning new pages */
+	uint8_t derivedData[SBITS_MAX_DERIVED_SIZE];	/* Derived value of last record returned (if SBITS_USE_DERIVED_BMAP) */
+	int32_t valueBlock;							/* Physical erase block searched using value index (-1 if value index not used) */
+	int32_t lastValueBlock;						/* Last erase block with data */
+	count_t valueEntry;							/* Next value index entry of block */
+	count_t valueEnd;							/* Number of value index entries of block */
 } sbitsIterator;
 
+/**
+@brief     	Chooses buffer count, query cache size, record directory density and whether to use bitmap and index
+			for a RAM and storage budget and workload. Caller must set pageSize, keySize, dataSize, eraseSizeInPages,
+			startAddress, and bitmapSize and functions before call. Caller then allocates buffer (bufferSizeInBlocks pages)
+			and query cache (queryCacheSize entries) before calling sbitsInit().
+@param     	state
+                SBITS algorithm state structure
+@param		ramBytes
+				RAM available for page buffers and query cache
+@param		storageBytes
+				Storage available for data and index
+@param		hints
+				Expected workload
+@param		estimate
+				Predicted I/O per operation (may be NULL)
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsConfigureForBudget(sbitsState *state, uint32_t ramBytes, uint32_t storageBytes, sbitsWorkloadHints *hints, sbitsCostEstimate *estimate);
+
+/**
+@brief     	Calculates record size, header sizes and number of records per data and index page
+			from the key, data, bitmap and page sizes and parameters. Removes parameters that cannot be used.
+			Called by sbitsInit(). Only called directly to setup a state that reads storage written by another state.
+@param     	state
+                SBITS algorithm state structure
+*/
+void sbitsInitLayout(sbitsState *state);
+
 /**
 @brief     	Initialize SBITS structure.
 @param     	state
@@ -211,6 +500,23 @@ int8_t sbitsPut(sbitsState *state, void* key, void *data);
 */
 int8_t sbitsGet(sbitsState *state, void* key, void *data);
 
+/**
+@brief     	Copies gaps in keys that overlap a key range from the gap list (no pages are read). Gaps are in key order.
+			The list only has all gaps with keys after state->gapsFromKey.
+@param     	state
+                SBITS algorithm state structure (with SBITS_USE_GAP_INDEX)
+@param     	minKey
+                Smallest key of range (NULL if none)
+@param     	maxKey
+                Largest key of range (NULL if none)
+@param     	gaps
+                Pre-allocated memory for gaps
+@param     	maxGaps
+                Number of gaps that fit in gaps
+@return		Return number of gaps copied.
+*/
+int16_t sbitsFindGaps(sbitsState *state, void *minKey, void *maxKey, sbitsGap *gaps, int16_t maxGaps);
+
 
 /**
 @brief     	Initialize iterator on sbits structure.
@@ -236,6 +542,56 @@ void sbitsInitIterator(sbitsState *state, sbitsIterator *it);
 int8_t sbitsNext(sbitsState *state, sbitsIterator *it, void **key, void **data);
 
 
+/**
+@brief     	Initialize iterator for records with data value equal to data. Key bounds (minKey, maxKey)
+			must be set in iterator before call. With hash bitmaps (SBITS_USE_HASH_BMAP), only pages
+			whose bitmap has all hashed bits of the value are read.
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+@param     	data
+            	Data value to find
+*/
+void sbitsInitEqualityIterator(sbitsState *state, sbitsIterator *it, void *data);
+
+
+/**
+@brief     	Initialize iterator for records with data value in [minData, maxData] using value index
+			(SBITS_USE_VALUE_INDEX). Set minKey, maxKey, minData and maxData in iterator before call.
+			Each erase block is found by binary search of its sorted run, so records are returned in
+			order of erase block and then data value (not key order).
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+*/
+void sbitsInitValueIterator(sbitsState *state, sbitsIterator *it);
+
+
+/**
+@brief     	Returns bucket of data value in bitmap, or -1 if updateBitmap sets no bit for value.
+@param     	state
+                SBITS algorithm state structure
+@param     	data
+            	Data value
+*/
+int16_t sbitsBitmapBucket(sbitsState *state, void *data);
+
+
+/**
+@brief     	Positions iterator at the last page with smallest key less than or equal to key, found by
+			binary search on data pages. The iterator then scans data pages from that page (index and
+			query cache are not used). Call after sbitsInitIterator().
+@param     	state
+                SBITS algorithm state structure
+@param     	it
+            	SBITS iterator state structure
+@param     	key
+            	Key to seek to
+*/
+void sbitsSeekIterator(sbitsState *state, sbitsIterator *it, void *key);
+
 /**
 @brief     	Flushes output buffer.
 @param     	state
@@ -255,6 +611,20 @@ int8_t sbitsFlush(sbitsState *state);
 int8_t readPage(sbitsState *state, id_t pageNum);
 
 
+/**
+@brief     	Returns location in file of data or index page. With wear leveling, index pages follow data pages
+			and each erase block is at its physical block in the block map.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Physical data or index page id
+@param		index
+				1 if index page, 0 if data page
+@return		Return page number in file.
+*/
+id_t sbitsStoragePage(sbitsState *state, id_t pageNum, int8_t index);
+
+
 /**
 @brief     	Reads given index page from storage.
 @param     	state
@@ -266,6 +636,17 @@ int8_t readPage(sbitsState *state, id_t pageNum);
 int8_t readIndexPage(sbitsState *state, id_t pageNum);
 
 
+/**
+@brief     	Reads given value index page from storage.
+@param     	state
+                SBITS algorithm state structure
+@param		pageNum
+				Page number to read
+@return		Return 0 if success, -1 if error.
+*/
+int8_t readValuePage(sbitsState *state, id_t pageNum);
+
+
 /**
 @brief     	Writes page in buffer to storage. Returns page number.
 @param     	state
@@ -288,6 +669,42 @@ id_t writePage(sbitsState *state, void *buffer);
 id_t writeIndexPage(sbitsState *state, void *buffer);
 
 
+/**
+@brief     	Saves storage location state, recently read page ids and query cache so that the next sbitsInit()
+			with SBITS_USE_WARM_START reopens the stored data and warms up. Call after sbitsFlush() at shutdown.
+@param     	state
+                SBITS state structure
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsCheckpoint(sbitsState *state);
+
+/**
+@brief     	Returns bytes of persistent memory used. Call before sbitsInit() after setting page size, storage
+			addresses, erase size and parameters.
+@param     	state
+                SBITS state structure
+*/
+uint32_t sbitsPmemSize(sbitsState *state);
+
+
+/**
+@brief     	Reads the next page saved as recently read by the last checkpoint (in physical order).
+			Call when idle after a warm start until it returns 0.
+@param     	state
+                SBITS state structure
+@return		Return 1 if a page was read and more remain, 0 if no more pages to prefetch.
+*/
+int8_t sbitsPrefetch(sbitsState *state);
+
+
+/**
+@brief     	Invalidates all query cache entries.
+@param     	state
+                SBITS state structure
+*/
+void sbitsClearQueryCache(sbitsState *state);
+
+
 /**
 @brief     	Prints statistics.
 @param     	state
@@ -304,6 +721,34 @@ void printStats(sbitsState *state);
 void resetStats(sbitsState *state);
 
 
+/**
+@brief     	Estimates energy and time of the page reads, writes and erases since resetStats() plus CPU cycles on a device.
+@param     	state
+                SBITS state structure
+@param		model
+				Device costs (e.g. SBITS_DEVICE_SD)
+@param		cycles
+				CPU cycles of the workload
+@param		energy
+				Estimated energy and time
+*/
+void sbitsEstimateEnergy(sbitsState *state, const sbitsDeviceModel *model, uint64_t cycles, sbitsEnergy *energy);
+
+
+/**
+@brief     	Prints estimated energy and time in total and per operation.
+@param     	state
+                SBITS state structure
+@param		model
+				Device costs
+@param		cycles
+				CPU cycles of the workload
+@param		numOps
+				Number of operations (puts, gets or queries) in the workload
+*/
+void printEnergy(sbitsState *state, const sbitsDeviceModel *model, uint64_t cycles, uint32_t numOps);
+
+
 /*
 Bitmap related functions
 */
@@ -321,6 +766,24 @@ Bitmap related functions
 void buildBitmapInt16FromRange(sbitsState *state, void *min, void *max, void *bm);
 
 
+/**
+@brief     	Builds bitmap of any size from (min, max) range. Bitmap must be initialized to 0.
+			Assumes update function sets one bit per value, with buckets in increasing value order
+			and bucket i in bit (7 - i%8) of byte i/8.
+@param		updateBitmap
+				function that sets bit for a value
+@param		size
+				bitmap size in bytes
+@param		min
+				minimum value (may be NULL)
+@param		max
+				maximum value (may be NULL)
+@param		bm
+				bitmap created
+*/
+void buildBitmapFromRange(void (*updateBitmap)(void *data, void *bm), int8_t size, void *min, void *max, void *bm);
+
+
 /**
 @brief     	Builds 64-bit bitmap from (min, max) range.
 @param     	state
@@ -336,4 +799,6 @@ void buildBitmapInt64FromRange(sbitsState *state, void *min, void *max, void *bm
 
 #if defined(__cplusplus)
 }
-#endif
\ No newline at end of file
+#endif
+
+#endif
@@ -0,0 +1,222 @@
+/******************************************************************************/
+/**
+@file		sbits_log.h
+@author		Ramon Lawrence
+@brief		Library log messages with compile-time log levels and optional
+			binary telemetry.
+@details	Each message is an event with an id, a printf format and integer
+			fields. SBITS_LOG_LEVEL (default SBITS_LOG_INFO) selects messages
+			compiled in. SBITS_LOG_NONE removes all library messages.
+
+			With -DSBITS_TELEMETRY, messages are not formatted on the device.
+			Each message is a frame of bytes:
+				SBITS_TELEMETRY_SYNC, event id, number of fields, fields
+			Fields are 32-bit integers zigzag encoded as varints (1 to 5
+			bytes). Frames go to Serial on Arduino and stderr on a host.
+			tools/sbitslog decodes frames with the formats below and passes
+			other (text) bytes through unchanged.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+
+#if !defined(SBITS_LOG_H_)
+#define SBITS_LOG_H_
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* Log levels */
+#define SBITS_LOG_NONE			0
+#define SBITS_LOG_ERROR			1		/* Configuration and I/O errors */
+#define SBITS_LOG_WARN			2		/* Events that lose data or ignore files */
+#define SBITS_LOG_INFO			3		/* Configuration chosen by init */
+
+#if !defined(SBITS_LOG_LEVEL)
+#define SBITS_LOG_LEVEL			SBITS_LOG_INFO
+#endif
+
+#define SBITS_TELEMETRY_SYNC		0xA5	/* Not a text character so frames can share a serial port with printf output */
+#define SBITS_TELEMETRY_MAX_FIELDS	6
+
+/* Events. Ids are less than 0x80. Fields are the format arguments in order. */
+#define SBITS_EVENT_BITMAP_SIZE				1
+#define SBITS_EVENT_BITMAP_SIZE_FMT			"ERROR: Bitmap size must be from 1 to %d bytes. Defaulting to without bitmap and index.\n"
+#define SBITS_EVENT_INDEX_BUFFERS			2
+#define SBITS_EVENT_INDEX_BUFFERS_FMT		"ERROR: SBITS using index requires at least 4 page buffers. Defaulting to without index.\n"
+#define SBITS_EVENT_DERIVED_BMAP			3
+#define SBITS_EVENT_DERIVED_BMAP_FMT		"ERROR: Derived bitmap requires bitmap and deriveData function. Defaulting to without derived bitmap.\n"
+#define SBITS_EVENT_ADAPTIVE_BMAP			4
+#define SBITS_EVENT_ADAPTIVE_BMAP_FMT		"ERROR: Adaptive bitmap requires single column range bitmap on 32-bit value. Defaulting to without adaptive bitmap.\n"
+#define SBITS_EVENT_MULTI_DIM				5
+#define SBITS_EVENT_MULTI_DIM_FMT			"ERROR: Multiple column bounds require range bitmap and buildBitmap and inDataRange functions. Defaulting to single column.\n"
+#define SBITS_EVENT_RANGE_BMAP				6
+#define SBITS_EVENT_RANGE_BMAP_FMT			"ERROR: Range-encoded bitmap requires single column range bitmap. Defaulting to without range encoding.\n"
+#define SBITS_EVENT_RECORD_DIR				7
+#define SBITS_EVENT_RECORD_DIR_FMT			"ERROR: Record directory requires bitmap. Defaulting to without record directory.\n"
+#define SBITS_EVENT_VALUE_BUFFERS			8
+#define SBITS_EVENT_VALUE_BUFFERS_FMT		"ERROR: Value index requires %d page buffers. Defaulting to without value index.\n"
+#define SBITS_EVENT_FINE_COMPRESSED			9
+#define SBITS_EVENT_FINE_COMPRESSED_FMT		"ERROR: Fine bitmap is not supported with compressed index. Defaulting to without fine bitmap.\n"
+#define SBITS_EVENT_FINE_BMAP				10
+#define SBITS_EVENT_FINE_BMAP_FMT			"ERROR: Fine bitmap requires range bitmap and size from 1 to %d bytes (SBITS_MAX_FINE_BITMAP_SIZE). Defaulting to without fine bitmap.\n"
+#define SBITS_EVENT_BUDGET_RAM				11
+#define SBITS_EVENT_BUDGET_RAM_FMT			"ERROR: SBITS requires RAM for at least 2 page buffers.\n"
+#define SBITS_EVENT_BUDGET					12
+#define SBITS_EVENT_BUDGET_FMT				"Budget: Buffers: %d  Index: %d  Bmap: %d  Record dir chunk: %d  Query cache: %d\n"
+#define SBITS_EVENT_BUDGET_IO				13
+#define SBITS_EVENT_BUDGET_IO_FMT			"Predicted I/O (x1000): Put: %lu  Get: %lu  Range: %lu  RAM: %lu bytes\n"
+#define SBITS_EVENT_VALUE_WRITE				14
+#define SBITS_EVENT_VALUE_WRITE_FMT			"Failed to write value index page: %lu\n"
+#define SBITS_EVENT_WARM_OPEN				15
+#define SBITS_EVENT_WARM_OPEN_FMT			"Error: Can't open warm start file!\n"
+#define SBITS_EVENT_WARM_MISMATCH			16
+#define SBITS_EVENT_WARM_MISMATCH_FMT		"Warm start file does not match configuration. Starting empty.\n"
+#define SBITS_EVENT_WARM_START				17
+#define SBITS_EVENT_WARM_START_FMT			"Warm start. Next page id: %lu  Pages to prefetch: %d\n"
+#define SBITS_EVENT_INIT					18
+#define SBITS_EVENT_INIT_FMT				"Initializing SBITS.\n"
+#define SBITS_EVENT_INIT_BUFFERS			19
+#define SBITS_EVENT_INIT_BUFFERS_FMT		"Buffer size: %d  Page size: %d\n"
+#define SBITS_EVENT_INIT_OPTIONS			20
+#define SBITS_EVENT_INIT_OPTIONS_FMT		"Use index: %d  Max/min: %d Sum: %d Bmap: %d\n"
+#define SBITS_EVENT_INIT_RECORD				21
+#define SBITS_EVENT_INIT_RECORD_FMT			"Record size: %d\n"
+#define SBITS_EVENT_INIT_PAGE				22
+#define SBITS_EVENT_INIT_PAGE_FMT			"Header size: %d  Records per page: %d\n"
+#define SBITS_EVENT_ALIGN_KEY				23
+#define SBITS_EVENT_ALIGN_KEY_FMT			"ERROR: Aligned records require key size that is a multiple of %d.\n"
+#define SBITS_EVENT_ALIGN					24
+#define SBITS_EVENT_ALIGN_FMT				"Record alignment: %d  Padding per record: %d  Records per page without record padding: %d\n"
+#define SBITS_EVENT_STORAGE_SIZE			25
+#define SBITS_EVENT_STORAGE_SIZE_FMT		"ERROR: Number of pages allocated must be at least twice erase block size for SBITS and four times when using indexing. Memory pages: %d\n"
+#define SBITS_EVENT_FILE_OPEN				26
+#define SBITS_EVENT_FILE_OPEN_FMT			"Error: Can't open file!\n"
+#define SBITS_EVENT_INDEX_OPEN				27
+#define SBITS_EVENT_INDEX_OPEN_FMT			"Error: Can't open index file!\n"
+#define SBITS_EVENT_INDEX_PAGE				28
+#define SBITS_EVENT_INDEX_PAGE_FMT			"Index records per page: %d\n"
+#define SBITS_EVENT_VALUE_OPEN				29
+#define SBITS_EVENT_VALUE_OPEN_FMT			"Error: Can't open value index file!\n"
+#define SBITS_EVENT_VALUE_PAGE				30
+#define SBITS_EVENT_VALUE_PAGE_FMT			"Value index entries per page: %d  Pages per erase block: %d\n"
+#define SBITS_EVENT_WRITE					31
+#define SBITS_EVENT_WRITE_FMT				"Failed to write data page: %lu\n"
+#define SBITS_EVENT_INDEX_EXHAUSTED			32
+#define SBITS_EVENT_INDEX_EXHAUSTED_FMT		"Exhausted index pages: %d.\n"
+#define SBITS_EVENT_INDEX_WRITE				33
+#define SBITS_EVENT_INDEX_WRITE_FMT			"Failed to write index page: %lu\n"
+#define SBITS_EVENT_READ					34
+#define SBITS_EVENT_READ_FMT				"Read error :%lu\n"
+#define SBITS_EVENT_QUERY					35
+#define SBITS_EVENT_QUERY_FMT				"Query error at offset: %d\n"
+#define SBITS_EVENT_SORT_WRITE				36
+#define SBITS_EVENT_SORT_WRITE_FMT			"Failed to write sort page: %lu\n"
+#define SBITS_EVENT_SORT_READ				37
+#define SBITS_EVENT_SORT_READ_FMT			"Failed to read sort page: %lu\n"
+#define SBITS_EVENT_SORT_OPEN				38
+#define SBITS_EVENT_SORT_OPEN_FMT			"Error: Can't open sort files.\n"
+#define SBITS_EVENT_SORT_BUFFER				39
+#define SBITS_EVENT_SORT_BUFFER_FMT			"Error: ORDER BY requires a sort buffer of at least 3 pages.\n"
+#define SBITS_EVENT_WEAR_BLOCKS				40
+#define SBITS_EVENT_WEAR_BLOCKS_FMT			"ERROR: Wear leveling requires wearBlocks and at most 65535 erase blocks. Defaulting to without wear leveling.\n"
+#define SBITS_EVENT_PMEM					41
+#define SBITS_EVENT_PMEM_FMT				"ERROR: Persistent memory requires pmemRead and pmemWrite. Defaulting to without persistent memory.\n"
+#define SBITS_EVENT_PMEM_START				42
+#define SBITS_EVENT_PMEM_START_FMT			"Persistent memory restored. Records in output page: %d\n"
+#define SBITS_EVENT_GAP_LIST				43
+#define SBITS_EVENT_GAP_LIST_FMT			"ERROR: Gap index requires gaps and maxGaps. Defaulting to without gap index.\n"
+#define SBITS_EVENT_PROBE					44
+#define SBITS_EVENT_PROBE_FMT				"ERROR: Probe reads require probeBuffer and at least 2 probePages. Defaulting to one page at a time.\n"
+#define SBITS_EVENT_BUDGET_RECORD			45
+#define SBITS_EVENT_BUDGET_RECORD_FMT		"ERROR: Record of %d bytes does not fit in a page of %d bytes.\n"
+#define SBITS_EVENT_WEAR_MOVE				46
+#define SBITS_EVENT_WEAR_MOVE_FMT			"Failed to move erase block %lu to spare block. Block map is unchanged.\n"
+
+/* All events for decoders. X(event) is called for each event. */
+#define SBITS_EVENT_LIST(X) \
+	X(SBITS_EVENT_BITMAP_SIZE) X(SBITS_EVENT_INDEX_BUFFERS) X(SBITS_EVENT_DERIVED_BMAP) X(SBITS_EVENT_ADAPTIVE_BMAP) \
+	X(SBITS_EVENT_MULTI_DIM) X(SBITS_EVENT_RANGE_BMAP) X(SBITS_EVENT_RECORD_DIR) X(SBITS_EVENT_VALUE_BUFFERS) \
+	X(SBITS_EVENT_FINE_COMPRESSED) X(SBITS_EVENT_FINE_BMAP) X(SBITS_EVENT_BUDGET_RAM) X(SBITS_EVENT_BUDGET) \
+	X(SBITS_EVENT_BUDGET_IO) X(SBITS_EVENT_VALUE_WRITE) X(SBITS_EVENT_WARM_OPEN) X(SBITS_EVENT_WARM_MISMATCH) \
+	X(SBITS_EVENT_WARM_START) X(SBITS_EVENT_INIT) X(SBITS_EVENT_INIT_BUFFERS) X(SBITS_EVENT_INIT_OPTIONS) \
+	X(SBITS_EVENT_INIT_RECORD) X(SBITS_EVENT_INIT_PAGE) X(SBITS_EVENT_ALIGN_KEY) X(SBITS_EVENT_ALIGN) \
+	X(SBITS_EVENT_STORAGE_SIZE) X(SBITS_EVENT_FILE_OPEN) X(SBITS_EVENT_INDEX_OPEN) X(SBITS_EVENT_INDEX_PAGE) \
+	X(SBITS_EVENT_VALUE_OPEN) X(SBITS_EVENT_VALUE_PAGE) X(SBITS_EVENT_WRITE) X(SBITS_EVENT_INDEX_EXHAUSTED) \
+	X(SBITS_EVENT_INDEX_WRITE) X(SBITS_EVENT_READ) X(SBITS_EVENT_QUERY) X(SBITS_EVENT_SORT_WRITE) \
+	X(SBITS_EVENT_SORT_READ) X(SBITS_EVENT_SORT_OPEN) X(SBITS_EVENT_SORT_BUFFER) X(SBITS_EVENT_WEAR_BLOCKS) \
+	X(SBITS_EVENT_PMEM) X(SBITS_EVENT_PMEM_START) X(SBITS_EVENT_GAP_LIST) X(SBITS_EVENT_PROBE) X(SBITS_EVENT_BUDGET_RECORD) \
+	X(SBITS_EVENT_WEAR_MOVE)
+
+#if defined(SBITS_TELEMETRY)
+/**
+@brief     	Writes telemetry frame for event.
+@param     	event
+                Event id
+@param		fields
+				Event fields
+@param		numFields
+				Number of fields (at most SBITS_TELEMETRY_MAX_FIELDS)
+*/
+void sbitsTelemetry(uint8_t event, const int32_t *fields, uint8_t numFields);
+
+/* First array entry lets events have no fields */
+#define SBITS_EMIT(event, format, ...)	do { int32_t sbitsFields_[] = { 0, ##__VA_ARGS__ }; \
+											sbitsTelemetry(event, sbitsFields_ + 1, sizeof(sbitsFields_) / sizeof(int32_t) - 1); } while (0)
+#else
+#define SBITS_EMIT(event, format, ...)	printf(format, ##__VA_ARGS__)
+#endif
+
+/* Format is pasted here so that event is not expanded to its id first */
+#if SBITS_LOG_LEVEL >= SBITS_LOG_ERROR
+#define SBITS_ERROR(event, ...)		SBITS_EMIT(event, event##_FMT, ##__VA_ARGS__)
+#else
+#define SBITS_ERROR(event, ...)		((void) 0)
+#endif
+
+#if SBITS_LOG_LEVEL >= SBITS_LOG_WARN
+#define SBITS_WARN(event, ...)		SBITS_EMIT(event, event##_FMT, ##__VA_ARGS__)
+#else
+#define SBITS_WARN(event, ...)		((void) 0)
+#endif
+
+#if SBITS_LOG_LEVEL >= SBITS_LOG_INFO
+#define SBITS_INFO(event, ...)		SBITS_EMIT(event, event##_FMT, ##__VA_ARGS__)
+#else
+#define SBITS_INFO(event, ...)		((void) 0)
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
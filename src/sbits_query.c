@@ -0,0 +1,1027 @@
+/******************************************************************************/
+/**
+@file		sbits_query.c
+@author		Ramon Lawrence
+@brief		Compact query language for SBITS compiled to an iterator plan.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sbits_query.h"
+#include "sbits_log.h"
+
+#define SBITS_BOUND_MIN_KEY		1
+#define SBITS_BOUND_MAX_KEY		2
+#define SBITS_BOUND_MIN_DATA	4
+#define SBITS_BOUND_MAX_DATA	8
+
+/* Parser position in query text */
+typedef struct {
+	const char 	*start;
+	const char 	*pos;
+	int8_t 		numColumns;					/* Number of 32-bit data columns */
+	uint8_t 	dataColumn;					/* Column with bounds checked by iterator and bitmaps */
+} sbitsQueryParser;
+
+static const char * const aggNames[] = { "", "count", "sum", "min", "max", "avg" };
+static const char * const opNames[] = { "<", "<=", ">", ">=", "=" };
+static const char * const methodNames[] = { "SCAN", "KEY SEEK", "BITMAP" };
+
+/**
+@brief     	Skips white space.
+*/
+void skipSpace(sbitsQueryParser *p)
+{
+	while (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r')
+		p->pos++;
+}
+
+/**
+@brief     	Consumes keyword (case insensitive) if it is next in query.
+@return		Return 1 if keyword was consumed, 0 otherwise.
+*/
+int8_t matchKeyword(sbitsQueryParser *p, const char *word)
+{
+	skipSpace(p);
+	const char *s = p->pos;
+	for ( ; *word != 0; word++, s++)
+	{
+		char c = *s;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != *word)
+			return 0;
+	}
+	/* Must not be prefix of a longer identifier */
+	if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9') || *s == '_')
+		return 0;
+	p->pos = s;
+	return 1;
+}
+
+/**
+@brief     	Consumes symbol if it is next in query.
+@return		Return 1 if symbol was consumed, 0 otherwise.
+*/
+int8_t matchSymbol(sbitsQueryParser *p, const char *symbol)
+{
+	skipSpace(p);
+	size_t len = strlen(symbol);
+	if (strncmp(p->pos, symbol, len) != 0)
+		return 0;
+	p->pos += len;
+	return 1;
+}
+
+/**
+@brief     	Parses integer with optional sign.
+@return		Return 0 if success, -1 if no integer or integer does not fit in 32 bits.
+*/
+int8_t parseInteger(sbitsQueryParser *p, int32_t *value)
+{
+	skipSpace(p);
+	const char *s = p->pos;
+	int8_t negative = 0;
+	uint32_t val = 0;
+
+	if (*s == '-')
+	{
+		negative = 1;
+		s++;
+	}
+	if (*s < '0' || *s > '9')
+		return -1;
+	uint32_t limit = negative ? (uint32_t) INT32_MAX + 1 : (uint32_t) INT32_MAX;
+	while (*s >= '0' && *s <= '9')
+	{
+		uint32_t digit = (uint32_t) (*s++ - '0');
+		if (val > (limit - digit) / 10)
+			return -1;		/* Overflow. Error is at start of integer. */
+		val = val*10 + digit;
+	}
+	*value = negative ? (int32_t) (0 - val) : (int32_t) val;
+	p->pos = s;
+	return 0;
+}
+
+/**
+@brief     	Parses column name (time or c0, c1, ...).
+@return		Return 0 if success, -1 if no valid column.
+*/
+int8_t parseColumn(sbitsQueryParser *p, uint8_t *column)
+{
+	if (matchKeyword(p, "time"))
+	{
+		*column = SBITS_QUERY_KEY_COLUMN;
+		return 0;
+	}
+
+	skipSpace(p);
+	if (*p->pos != 'c' && *p->pos != 'C')
+		return -1;
+	const char *save = p->pos++;
+	int32_t num;
+	if (*p->pos < '0' || *p->pos > '9' || parseInteger(p, &num) != 0 || num >= p->numColumns)
+	{
+		p->pos = save;
+		return -1;
+	}
+	*column = (uint8_t) num;
+	return 0;
+}
+
+/**
+@brief     	Parses output (*, column, count(*) or aggregate of column).
+@return		Return 0 if success, -1 if error.
+*/
+int8_t parseOutput(sbitsQueryParser *p, sbitsQueryPlan *plan)
+{
+	if (matchSymbol(p, "*"))
+	{	/* Key and all data columns */
+		if (plan->numOutputs != 0)
+			return -1;
+		plan->outputs[plan->numOutputs++].column = SBITS_QUERY_KEY_COLUMN;
+		for (uint8_t i = 0; i < p->numColumns && plan->numOutputs < SBITS_QUERY_MAX_OUTPUTS; i++)
+			plan->outputs[plan->numOutputs++].column = i;
+		return 0;
+	}
+
+	if (plan->numOutputs >= SBITS_QUERY_MAX_OUTPUTS)
+		return -1;
+	sbitsQueryOutput *out = &plan->outputs[plan->numOutputs];
+
+	for (uint8_t agg = SBITS_AGG_COUNT; agg <= SBITS_AGG_AVG; agg++)
+	{
+		if (matchKeyword(p, aggNames[agg]))
+		{
+			if (!matchSymbol(p, "("))
+				return -1;
+			out->agg = agg;
+			if (agg == SBITS_AGG_COUNT && matchSymbol(p, "*"))
+				out->column = SBITS_QUERY_KEY_COLUMN;
+			else if (parseColumn(p, &out->column) != 0)
+				return -1;
+			if (!matchSymbol(p, ")"))
+				return -1;
+			plan->numOutputs++;
+			return 0;
+		}
+	}
+
+	if (parseColumn(p, &out->column) != 0)
+		return -1;
+	plan->numOutputs++;
+	return 0;
+}
+
+/**
+@brief     	Adds a condition to plan. Key and data column (c0 or derived) conditions become iterator bounds. Others are filters.
+@return		Return 0 if success, -1 if too many filters.
+*/
+int8_t addCondition(sbitsQueryParser *p, sbitsQueryPlan *plan, uint8_t column, uint8_t op, int32_t value)
+{
+	if (column == SBITS_QUERY_KEY_COLUMN || column == p->dataColumn)
+	{	/* Convert to inclusive range and intersect with current range */
+		int8_t data = column != SBITS_QUERY_KEY_COLUMN;
+		uint8_t minFlag = data ? SBITS_BOUND_MIN_DATA : SBITS_BOUND_MIN_KEY;
+		uint8_t maxFlag = data ? SBITS_BOUND_MAX_DATA : SBITS_BOUND_MAX_KEY;
+		int32_t *min = data ? &plan->minData : &plan->minKey;
+		int32_t *max = data ? &plan->maxData : &plan->maxKey;
+
+		if ((op == SBITS_OP_GT && value == INT32_MAX) || (op == SBITS_OP_LT && value == INT32_MIN))
+		{	/* No 32-bit value is beyond the limit. Inclusive bound would overflow. */
+			plan->empty = 1;
+			return 0;
+		}
+		if (op == SBITS_OP_GT || op == SBITS_OP_GE || op == SBITS_OP_EQ)
+		{
+			int32_t v = op == SBITS_OP_GT ? value+1 : value;
+			if (!(plan->bounds & minFlag) || v > *min)
+				*min = v;
+			plan->bounds |= minFlag;
+		}
+		if (op == SBITS_OP_LT || op == SBITS_OP_LE || op == SBITS_OP_EQ)
+		{
+			int32_t v = op == SBITS_OP_LT ? value-1 : value;
+			if (!(plan->bounds & maxFlag) || v < *max)
+				*max = v;
+			plan->bounds |= maxFlag;
+		}
+		return 0;
+	}
+
+	if (plan->numFilters >= SBITS_QUERY_MAX_FILTERS || column == SBITS_QUERY_DERIVED_COLUMN)
+		return -1;
+	sbitsQueryFilter *f = &plan->filters[plan->numFilters++];
+	f->column = column;
+	f->op = op;
+	f->value = value;
+	return 0;
+}
+
+/**
+@brief     	Parses condition (column op value or column BETWEEN value AND value).
+@return		Return 0 if success, -1 if error.
+*/
+int8_t parseCondition(sbitsQueryParser *p, sbitsQueryPlan *plan)
+{
+	uint8_t column, op;
+	int32_t value, value2;
+
+	if (matchKeyword(p, "derived"))
+	{	/* Derived value of record (SBITS_USE_DERIVED_BMAP) */
+		if (p->dataColumn != SBITS_QUERY_DERIVED_COLUMN)
+			return -1;
+		column = SBITS_QUERY_DERIVED_COLUMN;
+	}
+	else if (parseColumn(p, &column) != 0)
+		return -1;
+
+	if (matchKeyword(p, "between"))
+	{
+		if (parseInteger(p, &value) != 0 || !matchKeyword(p, "and") || parseInteger(p, &value2) != 0)
+			return -1;
+		if (addCondition(p, plan, column, SBITS_OP_GE, value) != 0)
+			return -1;
+		return addCondition(p, plan, column, SBITS_OP_LE, value2);
+	}
+
+	/* Two character operators are checked first */
+	if (matchSymbol(p, "<="))
+		op = SBITS_OP_LE;
+	else if (matchSymbol(p, ">="))
+		op = SBITS_OP_GE;
+	else if (matchSymbol(p, "<"))
+		op = SBITS_OP_LT;
+	else if (matchSymbol(p, ">"))
+		op = SBITS_OP_GT;
+	else if (matchSymbol(p, "="))
+		op = SBITS_OP_EQ;
+	else
+		return -1;
+
+	if (parseInteger(p, &value) != 0)
+		return -1;
+	return addCondition(p, plan, column, op, value);
+}
+
+/**
+@brief     	Parses query text into plan outputs, bounds and filters.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t parseQuery(sbitsQueryParser *p, sbitsQueryPlan *plan)
+{
+	if (!matchKeyword(p, "select"))
+		return -1;
+	do
+	{
+		if (parseOutput(p, plan) != 0)
+			return -1;
+	} while (matchSymbol(p, ","));
+
+	if (matchKeyword(p, "where"))
+	{
+		do
+		{
+			if (parseCondition(p, plan) != 0)
+				return -1;
+		} while (matchKeyword(p, "and"));
+	}
+
+	if (matchKeyword(p, "group"))
+	{
+		if (!matchKeyword(p, "by"))
+			return -1;
+		skipSpace(p);
+		const char *interval = p->pos;
+		if (parseInteger(p, &plan->groupInterval) != 0 || plan->groupInterval <= 0)
+			return -1;
+		if (matchKeyword(p, "m"))
+		{
+			if (plan->groupInterval > INT32_MAX / 60)
+			{	/* Interval in seconds does not fit in 32 bits. Error is at start of integer. */
+				p->pos = interval;
+				return -1;
+			}
+			plan->groupInterval *= 60;
+		}
+		else if (matchKeyword(p, "h"))
+		{
+			if (plan->groupInterval > INT32_MAX / 3600)
+			{
+				p->pos = interval;
+				return -1;
+			}
+			plan->groupInterval *= 3600;
+		}
+		else
+			matchKeyword(p, "s");
+	}
+
+	if (matchKeyword(p, "order"))
+	{
+		if (!matchKeyword(p, "by") || parseColumn(p, &plan->orderColumn) != 0)
+			return -1;
+		plan->order = 1;
+		if (matchKeyword(p, "desc"))
+			plan->order = -1;
+		else
+			matchKeyword(p, "asc");
+	}
+
+	skipSpace(p);
+	if (*p->pos != 0)
+		return -1;
+
+	/* Outputs must be all aggregates or all columns */
+	for (int8_t i = 0; i < plan->numOutputs; i++)
+	{
+		if ((plan->outputs[i].agg != SBITS_AGG_NONE) != (plan->outputs[0].agg != SBITS_AGG_NONE))
+			return -1;
+	}
+	plan->aggregate = plan->outputs[0].agg != SBITS_AGG_NONE;
+	if (plan->groupInterval != 0 && !plan->aggregate)
+		return -1;
+	if (plan->order != 0 && plan->aggregate)
+		return -1;
+	return 0;
+}
+
+/**
+@brief     	Estimates data pages read by each execution method and chooses the method with the least.
+*/
+void choosePlan(sbitsState *state, sbitsQueryPlan *plan)
+{
+	id_t numPages = state->nextPageId - state->firstDataPageId;
+	id_t keyPages = numPages;
+	id_t keyDiff = state->avgKeyDiff > 0 ? state->avgKeyDiff : 1;
+	int32_t keysPerPage = (int32_t) (keyDiff * state->maxRecordsPerPage);
+
+	plan->method = SBITS_PLAN_SCAN;
+	plan->estimatedPages = numPages;
+	if (plan->empty)
+	{	/* Nothing is read */
+		plan->estimatedPages = 0;
+		return;
+	}
+
+	if ((plan->bounds & SBITS_BOUND_MIN_DATA) || (plan->bounds & SBITS_BOUND_MAX_DATA))
+	{
+		/* Hash bitmaps only filter pages for equality on c0. Range-encoded bitmaps only filter on the bound on their side. */
+		int8_t equality = (plan->bounds & SBITS_BOUND_MIN_DATA) && (plan->bounds & SBITS_BOUND_MAX_DATA) && plan->minData == plan->maxData;
+		int8_t rangeGE = state->rangeBitmapDir == SBITS_RANGE_GE;
+		int16_t bucket = -1;
+		if (SBITS_USING_RANGE_BMAP(state->parameters) && (plan->bounds & (rangeGE ? SBITS_BOUND_MIN_DATA : SBITS_BOUND_MAX_DATA)))
+			bucket = sbitsBitmapBucket(state, rangeGE ? &plan->minData : &plan->maxData);
+		if (SBITS_USING_BMAP(state->parameters) && (!SBITS_USING_HASH_BMAP(state->parameters) || equality)
+				&& (!SBITS_USING_RANGE_BMAP(state->parameters) || bucket >= 0))
+		{	/* Estimate fraction of pages that overlap query bitmap from fraction of buckets set */
+			plan->method = SBITS_PLAN_BITMAP;
+			if (SBITS_USING_INDEX(state->parameters))
+			{
+				uint64_t bm[(SBITS_MAX_BITMAP_SIZE + 7) / 8];
+				uint16_t bits = 0;
+				memset(bm, 0, sizeof(bm));
+				if (SBITS_USING_RANGE_BMAP(state->parameters))
+				{	/* Page bit is set if page has a value in a bucket on the query side of bucket */
+					bits = rangeGE ? state->bitmapSize * 8 - bucket : bucket + 1;
+				}
+				else if (SBITS_USING_ADAPTIVE_BMAP(state->parameters))
+				{	/* Buckets between bounds for current boundaries */
+					int16_t last = (plan->bounds & SBITS_BOUND_MAX_DATA) ? sbitsBitmapBucket(state, &plan->maxData) : state->bitmapSize * 8 - 1;
+					bits = last + 1 - ((plan->bounds & SBITS_BOUND_MIN_DATA) ? sbitsBitmapBucket(state, &plan->minData) : 0);
+				}
+				else
+				{
+					if (SBITS_USING_HASH_BMAP(state->parameters))
+						state->updateBitmap(&plan->minData, bm);
+					else
+						buildBitmapFromRange(state->updateBitmap, state->bitmapSize, (plan->bounds & SBITS_BOUND_MIN_DATA) ? &plan->minData : NULL,
+												(plan->bounds & SBITS_BOUND_MAX_DATA) ? &plan->maxData : NULL, bm);
+					for (uint16_t i = 0; i < state->bitmapSize * 8; i++)
+						bits += (((uint8_t*) bm)[i >> 3] >> (i & 7)) & 1;
+				}
+				plan->estimatedPages = numPages * bits / (state->bitmapSize * 8) + numPages / state->maxIdxRecordsPerPage + 1;
+			}
+		}
+	}
+
+	if (plan->bounds & SBITS_BOUND_MIN_KEY)
+	{	/* Key pages from estimated key location of pages */
+		int32_t startPage = (plan->minKey - state->minKey) / keysPerPage;
+		int32_t endPage = (plan->bounds & SBITS_BOUND_MAX_KEY) ? (plan->maxKey - state->minKey) / keysPerPage : (int32_t) numPages;
+		if (startPage < 0)
+			startPage = 0;
+		if (endPage > (int32_t) numPages)
+			endPage = numPages;
+		keyPages = endPage >= startPage ? endPage - startPage + 1 : 1;
+
+		/* Binary search reads about log2(pages) pages */
+		for (id_t n = numPages; n > 1; n >>= 1)
+			keyPages++;
+
+		if (keyPages < plan->estimatedPages)
+		{
+			plan->method = SBITS_PLAN_KEY_SEEK;
+			plan->estimatedPages = keyPages;
+		}
+	}
+}
+
+/**
+@brief     	Parses query text and chooses execution method for the state configuration and data stored.
+@param     	state
+                SBITS state structure (after sbitsInit())
+@param		query
+				Query text
+@param		plan
+				Plan created
+@return		Return 0 if success. Non-zero value if error (plan->errorOffset is location of error).
+*/
+int8_t sbitsQueryCompile(sbitsState *state, const char *query, sbitsQueryPlan *plan)
+{
+	sbitsQueryParser p;
+
+	memset(plan, 0, sizeof(sbitsQueryPlan));
+	p.start = query;
+	p.pos = query;
+	p.numColumns = state->dataSize / 4;
+
+	/* Iterator data bounds are on c0 unless they are on several columns or a derived value */
+	p.dataColumn = 0;
+	if (SBITS_USING_DERIVED_BMAP(state->parameters))
+		p.dataColumn = SBITS_QUERY_DERIVED_COLUMN;
+	else if (SBITS_USING_MULTI_DIM(state->parameters))
+		p.dataColumn = SBITS_QUERY_NO_COLUMN;
+	plan->dataColumn = p.dataColumn;
+
+	if (parseQuery(&p, plan) != 0)
+	{
+		plan->errorOffset = (uint16_t) (p.pos - p.start);
+		SBITS_ERROR(SBITS_EVENT_QUERY, plan->errorOffset);
+		return -1;
+	}
+
+	choosePlan(state, plan);
+	return 0;
+}
+
+/**
+@brief     	Returns value of column for record.
+*/
+int32_t getColumn(int32_t key, void *data, uint8_t column)
+{
+	if (column == SBITS_QUERY_KEY_COLUMN)
+		return key;
+	return sbitsReadInt32((int8_t*) data + column*4);
+}
+
+/**
+@brief     	Calls callback with aggregate values and resets aggregates.
+*/
+void emitAggregates(sbitsQueryPlan *plan, int32_t key, sbitsQueryCallback callback, void *context)
+{
+	int32_t values[SBITS_QUERY_MAX_OUTPUTS];
+
+	for (int8_t i = 0; i < plan->numOutputs; i++)
+	{
+		sbitsQueryOutput *out = &plan->outputs[i];
+		switch (out->agg)
+		{
+			case SBITS_AGG_COUNT:	values[i] = (int32_t) out->count;	break;
+			case SBITS_AGG_SUM:		values[i] = (int32_t) out->sum;	break;
+			case SBITS_AGG_MIN:		values[i] = out->min;	break;
+			case SBITS_AGG_MAX:		values[i] = out->max;	break;
+			default:				values[i] = out->count > 0 ? (int32_t) (out->sum / (int64_t) out->count) : 0;
+		}
+		out->count = 0;
+		out->sum = 0;
+		out->min = 0;
+		out->max = 0;
+	}
+	if (callback != NULL)
+		callback(context, key, values, plan->numOutputs);
+}
+
+/* External sort of query records for ORDER BY */
+typedef struct {
+	sbitsQueryPlan *plan;
+	SD_FILE 	*file[2];					/* Run files. Runs of current pass are in file[current]. */
+	int8_t 		current;
+	int8_t 		keySize;
+	uint16_t 	recordSize;					/* Key and data (padded as on data pages) */
+	count_t 	pageSize;
+	count_t 	recordsPerPage;
+	uint32_t 	capacity;					/* Records that fit in sort buffer */
+	uint32_t 	count;						/* Records in sort buffer */
+	uint32_t 	total;						/* Records written to runs */
+} sbitsSort;
+
+/**
+@brief     	Returns record at position in sort buffer. Records do not span pages so pages can be written directly.
+*/
+int8_t* sortRecord(sbitsSort *s, uint32_t i)
+{
+	return (int8_t*) s->plan->sortBuffer + (i / s->recordsPerPage) * s->pageSize + (i % s->recordsPerPage) * s->recordSize;
+}
+
+/**
+@brief     	Compares records on ORDER BY column. Ties are ordered by key.
+@return		Return negative, zero or positive value if record a is before, same or after record b.
+*/
+int8_t compareRecords(sbitsSort *s, int8_t *a, int8_t *b)
+{
+	int32_t ka = sbitsReadInt32(a);
+	int32_t kb = sbitsReadInt32(b);
+	int32_t va = getColumn(ka, a + s->keySize, s->plan->orderColumn);
+	int32_t vb = getColumn(kb, b + s->keySize, s->plan->orderColumn);
+
+	if (va != vb)
+		return va < vb ? -s->plan->order : s->plan->order;
+	if (ka != kb)
+		return ka < kb ? -1 : 1;
+	return 0;
+}
+
+/**
+@brief     	Swaps two records in sort buffer.
+*/
+void swapRecords(sbitsSort *s, int8_t *a, int8_t *b)
+{
+	for (uint16_t i = 0; i < s->recordSize; i++)
+	{
+		int8_t t = a[i];
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+/**
+@brief     	Moves record at position i down the heap of n records.
+*/
+void siftDown(sbitsSort *s, uint32_t i, uint32_t n)
+{
+	uint32_t child;
+	while ((child = 2*i+1) < n)
+	{
+		if (child+1 < n && compareRecords(s, sortRecord(s, child+1), sortRecord(s, child)) > 0)
+			child++;
+		if (compareRecords(s, sortRecord(s, i), sortRecord(s, child)) >= 0)
+			return;
+		swapRecords(s, sortRecord(s, i), sortRecord(s, child));
+		i = child;
+	}
+}
+
+/**
+@brief     	Sorts records in sort buffer in place using heap sort (no recursion or extra memory).
+*/
+void sortMemory(sbitsSort *s)
+{
+	uint32_t n = s->count;
+	if (n < 2)
+		return;
+	for (uint32_t i = n/2; i > 0; i--)
+		siftDown(s, i-1, n);
+	for (uint32_t i = n-1; i > 0; i--)
+	{
+		swapRecords(s, sortRecord(s, 0), sortRecord(s, i));
+		siftDown(s, 0, i);
+	}
+}
+
+/**
+@brief     	Writes page of sort buffer to run file.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t writeSortPage(sbitsSort *s, SD_FILE *fp, uint32_t pageNum, void *buf)
+{
+	fseek(fp, pageNum * s->pageSize, SEEK_SET);
+	if (fwrite(buf, s->pageSize, 1, fp) == 0)
+	{
+		SBITS_ERROR(SBITS_EVENT_SORT_WRITE, (unsigned long) pageNum);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Reads page of run file into sort buffer.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t readSortPage(sbitsSort *s, SD_FILE *fp, uint32_t pageNum, void *buf)
+{
+	fseek(fp, pageNum * s->pageSize, SEEK_SET);
+	if (fread(buf, s->pageSize, 1, fp) == 0)
+	{
+		SBITS_ERROR(SBITS_EVENT_SORT_READ, (unsigned long) pageNum);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Sorts records in sort buffer and writes them as a run after the previous runs.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t writeRun(sbitsSort *s)
+{
+	if (s->file[0] == NULL)
+	{
+		s->file[0] = fopen("sortfile.bin", "w+b");
+		s->file[1] = fopen("sortfile2.bin", "w+b");
+		if (s->file[0] == NULL || s->file[1] == NULL)
+		{
+			SBITS_ERROR(SBITS_EVENT_SORT_OPEN);
+			return -1;
+		}
+	}
+
+	sortMemory(s);
+	uint32_t pages = (s->count + s->recordsPerPage - 1) / s->recordsPerPage;
+	for (uint32_t i = 0; i < pages; i++)
+	{
+		if (writeSortPage(s, s->file[0], s->total / s->recordsPerPage + i, (int8_t*) s->plan->sortBuffer + i * s->pageSize) != 0)
+			return -1;
+	}
+	s->total += s->count;
+	s->count = 0;
+	s->plan->sortRuns++;
+	return 0;
+}
+
+/**
+@brief     	Adds qualifying record to sort. Writes a run when sort buffer is full.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t sortAdd(sbitsSort *s, void *key, void *data)
+{
+	if (s->count == s->capacity && writeRun(s) != 0)
+		return -1;
+
+	int8_t *rec = sortRecord(s, s->count++);
+	memcpy(rec, key, s->keySize);
+	memcpy(rec + s->keySize, data, s->recordSize - s->keySize);
+	return 0;
+}
+
+/**
+@brief     	Calls callback with output columns of sorted record.
+*/
+void emitRecord(sbitsSort *s, int8_t *rec, sbitsQueryCallback callback, void *context)
+{
+	int32_t values[SBITS_QUERY_MAX_OUTPUTS];
+	int32_t k = sbitsReadInt32(rec);
+
+	for (int8_t i = 0; i < s->plan->numOutputs; i++)
+		values[i] = getColumn(k, rec + s->keySize, s->plan->outputs[i].column);
+	if (callback != NULL)
+		callback(context, k, values, s->plan->numOutputs);
+}
+
+/**
+@brief     	Merges consecutive runs using one buffer page per run. Merged run is written to the other run file
+			starting at the first input run location, or returned to the callback if this is the final merge.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t mergeRuns(sbitsSort *s, uint32_t firstRun, uint16_t numRuns, uint32_t runLength, int8_t final,
+					sbitsQueryCallback callback, void *context)
+{
+	uint32_t pos[SBITS_QUERY_MAX_SORT_RUNS], end[SBITS_QUERY_MAX_SORT_RUNS];
+	SD_FILE *in = s->file[s->current], *out = s->file[1 - s->current];
+	int8_t *outPage = (int8_t*) s->plan->sortBuffer + numRuns * s->pageSize;
+	uint32_t outPos = firstRun * runLength;
+	count_t outCount = 0;
+
+	/* Runs start on a page boundary as run length is a multiple of records per page */
+	for (uint16_t r = 0; r < numRuns; r++)
+	{
+		pos[r] = (firstRun + r) * runLength;
+		end[r] = pos[r] + runLength < s->total ? pos[r] + runLength : s->total;
+		if (readSortPage(s, in, pos[r] / s->recordsPerPage, (int8_t*) s->plan->sortBuffer + r * s->pageSize) != 0)
+			return -1;
+	}
+
+	while (1)
+	{
+		int8_t *best = NULL;
+		int16_t bestRun = -1;
+		for (uint16_t r = 0; r < numRuns; r++)
+		{
+			if (pos[r] >= end[r])
+				continue;
+			int8_t *rec = (int8_t*) s->plan->sortBuffer + r * s->pageSize + (pos[r] % s->recordsPerPage) * s->recordSize;
+			if (best == NULL || compareRecords(s, rec, best) < 0)
+			{
+				best = rec;
+				bestRun = r;
+			}
+		}
+		if (best == NULL)
+			break;
+
+		if (final)
+			emitRecord(s, best, callback, context);
+		else
+		{
+			memcpy(outPage + outCount * s->recordSize, best, s->recordSize);
+			if (++outCount == s->recordsPerPage)
+			{
+				if (writeSortPage(s, out, outPos / s->recordsPerPage, outPage) != 0)
+					return -1;
+				outPos += outCount;
+				outCount = 0;
+			}
+		}
+
+		if (++pos[bestRun] < end[bestRun] && pos[bestRun] % s->recordsPerPage == 0)
+		{
+			if (readSortPage(s, in, pos[bestRun] / s->recordsPerPage, (int8_t*) s->plan->sortBuffer + bestRun * s->pageSize) != 0)
+				return -1;
+		}
+	}
+
+	if (outCount > 0 && writeSortPage(s, out, outPos / s->recordsPerPage, outPage) != 0)
+		return -1;
+	return 0;
+}
+
+/**
+@brief     	Returns sorted records to callback. Records in sort buffer are returned directly if no run was written.
+			Otherwise, runs are merged with fan-in of buffer pages less one until they can be merged in one pass.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t sortFinish(sbitsSort *s, sbitsQueryCallback callback, void *context)
+{
+	if (s->total == 0)
+	{	/* Sorted in memory */
+		sortMemory(s);
+		for (uint32_t i = 0; i < s->count; i++)
+			emitRecord(s, sortRecord(s, i), callback, context);
+		return 0;
+	}
+
+	if (s->count > 0 && writeRun(s) != 0)
+		return -1;
+
+	uint16_t maxFanIn = s->plan->sortPages - 1;
+	if (maxFanIn > SBITS_QUERY_MAX_SORT_RUNS)
+		maxFanIn = SBITS_QUERY_MAX_SORT_RUNS;
+	uint32_t runLength = s->capacity;
+	uint32_t numRuns = s->plan->sortRuns;
+
+	while (1)
+	{	/* Final merge does not need an output page */
+		int8_t final = numRuns <= SBITS_QUERY_MAX_SORT_RUNS && numRuns <= s->plan->sortPages;
+		uint16_t fanIn = final ? numRuns : maxFanIn;
+
+		for (uint32_t first = 0; first < numRuns; first += fanIn)
+		{
+			uint16_t n = numRuns - first < fanIn ? numRuns - first : fanIn;
+			if (mergeRuns(s, first, n, runLength, final, callback, context) != 0)
+				return -1;
+		}
+		s->plan->sortPasses++;
+		if (final)
+			return 0;
+
+		runLength *= fanIn;
+		numRuns = (numRuns + fanIn - 1) / fanIn;
+		s->current = 1 - s->current;
+	}
+}
+
+/**
+@brief     	Executes plan and calls callback for each result row.
+@param     	state
+                SBITS state structure
+@param		plan
+				Compiled plan
+@param		callback
+				Function called for each result row
+@param		context
+				Value passed to callback
+@return		Return number of records that matched conditions. plan->error is set if ORDER BY failed.
+*/
+uint32_t sbitsQueryExecute(sbitsState *state, sbitsQueryPlan *plan, sbitsQueryCallback callback, void *context)
+{
+	sbitsIterator it;
+	void *key, *data;
+	int32_t values[SBITS_QUERY_MAX_OUTPUTS];
+	uint32_t matched = 0;
+	int32_t group = 0;
+	sbitsSort sort;
+
+	plan->sortRuns = 0;
+	plan->sortPasses = 0;
+	plan->error = 0;
+	if (plan->order != 0)
+	{
+		if (plan->sortBuffer == NULL || plan->sortPages < 3 || state->recordSize > state->pageSize)
+		{
+			SBITS_ERROR(SBITS_EVENT_SORT_BUFFER);
+			plan->error = 1;
+			return 0;
+		}
+		memset(&sort, 0, sizeof(sbitsSort));
+		sort.plan = plan;
+		sort.keySize = state->keySize;
+		sort.recordSize = state->recordSize;
+		sort.pageSize = state->pageSize;
+		sort.recordsPerPage = state->pageSize / sort.recordSize;
+		sort.capacity = (uint32_t) plan->sortPages * sort.recordsPerPage;
+	}
+
+	it.minKey = (plan->bounds & SBITS_BOUND_MIN_KEY) ? &plan->minKey : NULL;
+	it.maxKey = (plan->bounds & SBITS_BOUND_MAX_KEY) ? &plan->maxKey : NULL;
+	it.minData = (plan->bounds & SBITS_BOUND_MIN_DATA) ? &plan->minData : NULL;
+	it.maxData = (plan->bounds & SBITS_BOUND_MAX_DATA) ? &plan->maxData : NULL;
+	sbitsInitIterator(state, &it);
+	if (plan->method == SBITS_PLAN_KEY_SEEK)
+		sbitsSeekIterator(state, &it, &plan->minKey);
+
+	for (int8_t i = 0; i < plan->numOutputs; i++)
+	{
+		plan->outputs[i].count = 0;
+		plan->outputs[i].sum = 0;
+	}
+
+	while (!plan->empty && sbitsNext(state, &it, &key, &data))
+	{
+		int32_t k = sbitsReadInt32(key);
+
+		/* Check filters on other columns */
+		int8_t i;
+		for (i = 0; i < plan->numFilters; i++)
+		{
+			sbitsQueryFilter *f = &plan->filters[i];
+			int32_t val = getColumn(k, data, f->column);
+			if ((f->op == SBITS_OP_LT && !(val < f->value)) || (f->op == SBITS_OP_LE && !(val <= f->value))
+					|| (f->op == SBITS_OP_GT && !(val > f->value)) || (f->op == SBITS_OP_GE && !(val >= f->value))
+					|| (f->op == SBITS_OP_EQ && val != f->value))
+				break;
+		}
+		if (i < plan->numFilters)
+			continue;
+		matched++;
+
+		if (plan->order != 0)
+		{	/* Only records that passed the iterator bounds and filters are sorted */
+			if (sortAdd(&sort, key, data) != 0)
+			{	/* Run could not be written. No records are returned. */
+				plan->error = 1;
+				break;
+			}
+			continue;
+		}
+
+		if (!plan->aggregate)
+		{	/* Return record columns */
+			for (i = 0; i < plan->numOutputs; i++)
+				values[i] = getColumn(k, data, plan->outputs[i].column);
+			if (callback != NULL)
+				callback(context, k, values, plan->numOutputs);
+			continue;
+		}
+
+		if (plan->groupInterval != 0)
+		{	/* Keys are increasing so each group is complete when a key in a later group is found */
+			int32_t g = k / plan->groupInterval * plan->groupInterval;
+			if (k < 0 && g != k)
+				g -= plan->groupInterval;
+			if (plan->outputs[0].count > 0 && g != group)
+				emitAggregates(plan, group, callback, context);
+			group = g;
+		}
+
+		/* Aggregates are computed during iteration so records are never returned */
+		for (i = 0; i < plan->numOutputs; i++)
+		{
+			sbitsQueryOutput *out = &plan->outputs[i];
+			int32_t val = getColumn(k, data, out->column);
+			if (out->count == 0 || val < out->min)
+				out->min = val;
+			if (out->count == 0 || val > out->max)
+				out->max = val;
+			out->sum += val;
+			out->count++;
+		}
+	}
+
+	if (plan->aggregate && (plan->groupInterval == 0 || plan->outputs[0].count > 0))
+		emitAggregates(plan, plan->groupInterval == 0 ? 0 : group, callback, context);
+
+	if (plan->order != 0)
+	{
+		if (plan->error == 0 && sortFinish(&sort, callback, context) != 0)
+			plan->error = 1;		/* Records may have been returned before the error */
+		if (sort.file[0] != NULL)
+			fclose(sort.file[0]);
+		if (sort.file[1] != NULL)
+			fclose(sort.file[1]);
+	}
+	return matched;
+}
+
+/**
+@brief     	Prints plan.
+@param		plan
+				Compiled plan
+*/
+void sbitsQueryExplain(sbitsQueryPlan *plan)
+{
+	printf("Method: %s  Estimated pages: %lu\n", methodNames[plan->method], (unsigned long) plan->estimatedPages);
+	if (plan->empty)
+		printf("Conditions match no values. Result is empty.\n");
+	if (plan->bounds & (SBITS_BOUND_MIN_KEY | SBITS_BOUND_MAX_KEY))
+	{
+		printf("Key range: ");
+		if (plan->bounds & SBITS_BOUND_MIN_KEY)
+			printf("[%ld", (long) plan->minKey);
+		else
+			printf("(-inf");
+		if (plan->bounds & SBITS_BOUND_MAX_KEY)
+			printf(", %ld]\n", (long) plan->maxKey);
+		else
+			printf(", +inf)\n");
+	}
+	if (plan->bounds & (SBITS_BOUND_MIN_DATA | SBITS_BOUND_MAX_DATA))
+	{
+		printf(plan->dataColumn == SBITS_QUERY_DERIVED_COLUMN ? "derived range: " : "c0 range: ");
+		if (plan->bounds & SBITS_BOUND_MIN_DATA)
+			printf("[%ld", (long) plan->minData);
+		else
+			printf("(-inf");
+		if (plan->bounds & SBITS_BOUND_MAX_DATA)
+			printf(", %ld]", (long) plan->maxData);
+		else
+			printf(", +inf)");
+		printf(plan->method == SBITS_PLAN_BITMAP ? " using bitmaps\n" : " filtered during scan\n");
+	}
+	for (int8_t i = 0; i < plan->numFilters; i++)
+		printf("Filter: c%d %s %ld\n", plan->filters[i].column, opNames[plan->filters[i].op], (long) plan->filters[i].value);
+
+	printf("Output: ");
+	for (int8_t i = 0; i < plan->numOutputs; i++)
+	{
+		sbitsQueryOutput *out = &plan->outputs[i];
+		if (i > 0)
+			printf(", ");
+		if (out->agg != SBITS_AGG_NONE)
+			printf("%s(", aggNames[out->agg]);
+		if (out->column == SBITS_QUERY_KEY_COLUMN)
+			printf(out->agg == SBITS_AGG_COUNT ? "*" : "time");
+		else
+			printf("c%d", out->column);
+		if (out->agg != SBITS_AGG_NONE)
+			printf(")");
+	}
+	printf("\n");
+	if (plan->order != 0)
+	{
+		if (plan->orderColumn == SBITS_QUERY_KEY_COLUMN)
+			printf("Order by: time");
+		else
+			printf("Order by: c%d", plan->orderColumn);
+		printf(plan->order > 0 ? " ASC" : " DESC");
+		printf(" using external merge sort of qualifying records\n");
+	}
+	if (plan->aggregate)
+	{
+		if (plan->groupInterval != 0)
+			printf("Aggregates computed during iteration. Group by key interval: %ld\n", (long) plan->groupInterval);
+		else
+			printf("Aggregates computed during iteration.\n");
+	}
+}
@@ -0,0 +1,170 @@
+/******************************************************************************/
+/**
+@file		sbits_query.h
+@author		Ramon Lawrence
+@brief		Compact query language for SBITS compiled to an iterator plan.
+@details	Query syntax (keywords are case insensitive):
+			SELECT output {, output} [WHERE condition {AND condition}] [GROUP BY interval] [ORDER BY column]
+			output:		* | column | count(*) | agg(column)		agg: count, sum, min, max, avg
+			column:		time (record key) | c0, c1, ... (32-bit integers in record data)
+			condition:	column op integer | column BETWEEN integer AND integer		op: < <= > >= =
+			integer:	32-bit signed integer. Larger values are a parse error.
+			interval:	integer with optional unit s, m or h (key is time in seconds)
+			Plans are stored in a fixed size structure and executed without dynamic allocation.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(SBITS_QUERY_H_)
+#define SBITS_QUERY_H_
+
+#include "sbits.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define SBITS_QUERY_MAX_OUTPUTS		8
+#define SBITS_QUERY_MAX_FILTERS		4
+#define SBITS_QUERY_MAX_SORT_RUNS	16			/* Maximum runs merged at once by ORDER BY */
+
+/* Column number of record key */
+#define SBITS_QUERY_KEY_COLUMN		0xFF
+/* Column number of derived value (WHERE only, if SBITS_USE_DERIVED_BMAP) */
+#define SBITS_QUERY_DERIVED_COLUMN	0xFE
+/* No column has iterator data bounds (if SBITS_USE_MULTI_DIM) */
+#define SBITS_QUERY_NO_COLUMN		0xFD
+
+/* Output aggregate functions */
+#define SBITS_AGG_NONE			0
+#define SBITS_AGG_COUNT			1
+#define SBITS_AGG_SUM			2
+#define SBITS_AGG_MIN			3
+#define SBITS_AGG_MAX			4
+#define SBITS_AGG_AVG			5
+
+/* Comparison operators of filters */
+#define SBITS_OP_LT				0
+#define SBITS_OP_LE				1
+#define SBITS_OP_GT				2
+#define SBITS_OP_GE				3
+#define SBITS_OP_EQ				4
+
+/* Execution methods */
+#define SBITS_PLAN_SCAN			0	/* Scan all data pages */
+#define SBITS_PLAN_KEY_SEEK		1	/* Binary search to first key, then scan to last key */
+#define SBITS_PLAN_BITMAP		2	/* Skip data pages using page bitmaps (and index if used) */
+
+typedef struct {
+	uint8_t 	agg;						/* Aggregate function (SBITS_AGG_NONE for column value) */
+	uint8_t 	column;						/* Data column or SBITS_QUERY_KEY_COLUMN */
+	uint32_t 	count;						/* Aggregate state */
+	int64_t 	sum;
+	int32_t 	min;
+	int32_t 	max;
+} sbitsQueryOutput;
+
+typedef struct {
+	uint8_t 	column;						/* Data column (key and data column ranges are pushed into iterator) */
+	uint8_t 	op;
+	int32_t 	value;
+} sbitsQueryFilter;
+
+typedef struct {
+	sbitsQueryOutput outputs[SBITS_QUERY_MAX_OUTPUTS];
+	sbitsQueryFilter filters[SBITS_QUERY_MAX_FILTERS];
+	int8_t 		numOutputs;
+	int8_t 		numFilters;
+	int8_t 		aggregate;					/* 1 if outputs are aggregates computed during iteration */
+	int8_t 		method;						/* Execution method (SBITS_PLAN_SCAN, ...) */
+	uint8_t 	bounds;						/* Bounds used: 1 min key, 2 max key, 4 min c0, 8 max c0 */
+	int8_t 		empty;						/* 1 if a condition matches no 32-bit value (e.g. c0 > 2147483647) */
+	int32_t 	minKey;
+	int32_t 	maxKey;
+	uint8_t 	dataColumn;					/* Column of data range (0, SBITS_QUERY_DERIVED_COLUMN or SBITS_QUERY_NO_COLUMN) */
+	int32_t 	minData;					/* Range on data column checked by iterator and bitmaps */
+	int32_t 	maxData;
+	int32_t 	groupInterval;				/* Key interval of groups (0 if no GROUP BY) */
+	uint8_t 	orderColumn;				/* ORDER BY column */
+	int8_t 		order;						/* 0 if no ORDER BY, 1 ascending, -1 descending */
+	void 		*sortBuffer;				/* ORDER BY memory of sortPages pages of state page size. Set before execute. */
+	uint16_t 	sortPages;
+	uint32_t 	sortRuns;					/* Sorted runs written by last execute (0 if sorted in memory) */
+	uint8_t 	sortPasses;					/* Merge passes of last execute */
+	int8_t 		error;						/* 1 if last execute failed (ORDER BY sort memory, run file open, read or write error) */
+	id_t 		estimatedPages;				/* Estimated data pages read */
+	uint16_t 	errorOffset;				/* Offset in query text of parse error */
+} sbitsQueryPlan;
+
+/**
+@brief		Called with each result row. For GROUP BY queries, key is the start of the group interval.
+			For aggregates without GROUP BY, key is 0. Otherwise, key is the record key.
+*/
+typedef void (*sbitsQueryCallback)(void *context, int32_t key, int32_t *values, int8_t numValues);
+
+/**
+@brief     	Parses query text and chooses execution method for the state configuration and data stored.
+@param     	state
+                SBITS state structure (after sbitsInit())
+@param		query
+				Query text
+@param		plan
+				Plan created
+@return		Return 0 if success. Non-zero value if error (plan->errorOffset is location of error).
+*/
+int8_t sbitsQueryCompile(sbitsState *state, const char *query, sbitsQueryPlan *plan);
+
+/**
+@brief     	Executes plan and calls callback for each result row.
+			ORDER BY requires plan->sortBuffer of at least 3 pages. Qualifying records are sorted in the buffer
+			and merged using files sortfile.bin and sortfile2.bin if they do not fit.
+@param     	state
+                SBITS state structure
+@param		plan
+				Compiled plan
+@param		callback
+				Function called for each result row
+@param		context
+				Value passed to callback
+@return		Return number of records that matched conditions. plan->error is set if ORDER BY failed.
+*/
+uint32_t sbitsQueryExecute(sbitsState *state, sbitsQueryPlan *plan, sbitsQueryCallback callback, void *context);
+
+/**
+@brief     	Prints plan.
+@param		plan
+				Compiled plan
+*/
+void sbitsQueryExplain(sbitsQueryPlan *plan);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
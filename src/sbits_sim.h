@@ -0,0 +1,107 @@
+/******************************************************************************/
+/**
+@file		sbits_sim.h
+@author		Ramon Lawrence
+@brief		Benchmark build of SBITS tests for an ATmega2560 simulated by simavr.
+@details	Build firmware with -DSBITS_SIM (PlatformIO environment megaatmega2560_sim)
+			and run it with tools/sbitssim. Files are on an emulated storage device
+			on the SPI bus that is backed by host files. The simulator measures
+			cycles, stack depth and device I/O between SBITS_SIM_BEGIN() and
+			SBITS_SIM_END() markers.
+
+			Storage commands (master sends, device replies to 0xFF fill bytes):
+			open:	SBITS_SIM_CMD_OPEN name\0 mode\0				reply: handle (SBITS_SIM_NO_FILE if error)
+			read:	SBITS_SIM_CMD_READ handle pos(4) len(2)			reply: 0xFF while busy, SBITS_SIM_TOKEN, len bytes (0 past end), count read(2)
+			write:	SBITS_SIM_CMD_WRITE handle pos(4) len(2) data	reply: 0x00 while busy, SBITS_SIM_TOKEN
+			size:	SBITS_SIM_CMD_SIZE handle						reply: size(4)
+			close:	SBITS_SIM_CMD_CLOSE handle						reply: SBITS_SIM_TOKEN
+			remove:	SBITS_SIM_CMD_REMOVE name\0						reply: SBITS_SIM_TOKEN (0 if no file)
+			Integers are little endian.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(SBITS_SIM_H_)
+#define SBITS_SIM_H_
+
+/* Operations measured by simulator */
+#define SBITS_SIM_OP_NONE		0
+#define SBITS_SIM_OP_INIT		1
+#define SBITS_SIM_OP_PUT		2
+#define SBITS_SIM_OP_FLUSH		3
+#define SBITS_SIM_OP_GET		4
+#define SBITS_SIM_OP_QUERY		5		/* Iterator over data range */
+#define SBITS_SIM_NUM_OPS		6
+#define SBITS_SIM_OP_HEAP		0xFF	/* GPIOR2:GPIOR1 has address of heap end pointer (__brkval) */
+
+/* Data space addresses of ATmega2560 general purpose I/O registers used for markers */
+#define SBITS_SIM_MARKER_ADDR	0x3E	/* GPIOR0 */
+#define SBITS_SIM_ARG_ADDR		0x4A	/* GPIOR1 (low byte), GPIOR2 (high byte) */
+
+/* Storage device commands */
+#define SBITS_SIM_CMD_OPEN		'O'
+#define SBITS_SIM_CMD_READ		'R'
+#define SBITS_SIM_CMD_WRITE		'W'
+#define SBITS_SIM_CMD_SIZE		'S'
+#define SBITS_SIM_CMD_CLOSE		'C'
+#define SBITS_SIM_CMD_REMOVE	'D'
+
+#define SBITS_SIM_TOKEN			0xFE	/* Start of read data or end of command */
+#define SBITS_SIM_NO_FILE		0xFF
+#define SBITS_SIM_MAX_FILES		8
+#define SBITS_SIM_MAX_NAME		32
+
+#if defined(SBITS_SIM) && defined(ARDUINO)
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+extern char *__brkval;
+#if defined(__cplusplus)
+}
+#endif
+
+#define SBITS_SIM_BEGIN(op)		(GPIOR0 = (op))
+#define SBITS_SIM_END()			(GPIOR0 = SBITS_SIM_OP_NONE)
+/* Tells simulator where heap end is for RAM high-water mark */
+#define SBITS_SIM_INIT()		do { GPIOR1 = (uint8_t) (uint16_t) &__brkval; GPIOR2 = (uint16_t) &__brkval >> 8; \
+									GPIOR0 = SBITS_SIM_OP_HEAP; GPIOR0 = SBITS_SIM_OP_NONE; } while (0)
+/* Sleeping with interrupts disabled ends simulation */
+#define SBITS_SIM_EXIT()		do { cli(); sleep_enable(); sleep_cpu(); } while (0)
+#else
+#define SBITS_SIM_BEGIN(op)
+#define SBITS_SIM_END()
+#define SBITS_SIM_INIT()
+#define SBITS_SIM_EXIT()
+#endif
+
+#endif
@@ -38,6 +38,8 @@
 #include <string.h>
 
 #include "sbits.h"
+#include "sbits_log.h"
+#include "sbits_sim.h"
 
 
 /* A bitmap with 8 buckets (bits). Range 0 to 100. */
@@ -202,6 +204,157 @@ int8_t inBitmapInt64(void *data, void *bm)
     return tmpbm & *bmval;
 }
 
+/* A 128-bit fine bitmap on a 32-bit int value. Same range as 64-bit bitmap at twice the resolution. */
+void updateBitmapInt128(void *data, void *bm)
+{
+    int16_t val = (int16_t) *((int32_t*) data);    
+      
+    const int8_t stepSize = 5;    // Temperature data in F. Scaled by 10. */    
+    int16_t current = 320;
+    const int8_t bmsize = 127;
+    uint8_t count = 0;
+      
+    while (val > current && count < bmsize)
+    {
+        current += stepSize;
+        count++;
+    }
+    uint8_t b = 128;    
+    int8_t offset = count >> 3;  // / 8
+    b = b >> (count & 7);
+    
+    *( (char*) ((char*) bm + offset)) =  *( (char*) ((char*)bm + offset)) | b;                 
+}	
+
+#if SBITS_MAX_BITMAP_SIZE >= 32
+/* A 256-bit wide bitmap on a 32-bit int value. Buckets of 2 from 300 to 810. */
+void updateBitmapInt256(void *data, void *bm)
+{
+    int32_t val = *((int32_t*) data);
+    int32_t count = val < 300 ? 0 : (val - 300) / 2;
+    if (count > 255)
+        count = 255;
+    *((uint8_t*) bm + (count >> 3)) |= 128 >> (count & 7);
+}
+#endif
+
+/* A 64-bit Bloom filter bitmap on a 32-bit int categorical value (use with SBITS_USE_HASH_BMAP). Sets 3 hashed bits. */
+void updateBitmapHash64(void *data, void *bm)
+{
+    uint32_t h = (uint32_t) *((int32_t*) data) * 2654435761u;    /* Multiplicative hash. Each 6 high bit group is a bit number. */
+
+    for (int8_t i = 0; i < 3; i++)
+    {
+        uint8_t count = (h >> (26 - 6*i)) & 63;
+        *((uint8_t*) bm + (count >> 3)) |= 128 >> (count & 7);
+    }
+}
+
+int8_t inBitmapHash64(void *data, void *bm)
+{
+    uint64_t* bmval = (uint64_t*) bm;
+
+    uint64_t tmpbm = 0;
+    updateBitmapHash64(data, &tmpbm);
+
+    /* Value may be present only if all of its bits are set */
+    return (tmpbm & *bmval) == tmpbm;
+}
+
+/* A 64-bit Z-order bitmap on two 32-bit int columns (use with SBITS_USE_MULTI_DIM). Demo range of 0 to 1023 for each column.
+   Each column has 8 cells of 128. Bucket is the Z-order (bit interleaving) of the two cell numbers. */
+uint8_t zOrderCell(int32_t val)
+{
+    if (val < 0)
+        return 0;
+    if (val >= 1024)
+        return 7;
+    return val / 128;
+}
+
+uint8_t zOrder(uint8_t cx, uint8_t cy)
+{
+    uint8_t z = 0;
+    for (int8_t i = 2; i >= 0; i--)
+        z = (z << 2) | (((cx >> i) & 1) << 1) | ((cy >> i) & 1);
+    return z;
+}
+
+void updateBitmapZ64(void *data, void *bm)
+{
+    uint8_t z = zOrder(zOrderCell(*((int32_t*) data)), zOrderCell(*((int32_t*) data + 1)));
+    *((uint8_t*) bm + (z >> 3)) |= 128 >> (z & 7);
+}
+
+int8_t inBitmapZ64(void *data, void *bm)
+{
+    uint64_t* bmval = (uint64_t*) bm;
+
+    uint64_t tmpbm = 0;
+    updateBitmapZ64(data, &tmpbm);
+    return (tmpbm & *bmval) != 0;
+}
+
+/* Sets buckets of all cells overlapping rectangle. min and max have the bounds of both columns (either may be NULL). */
+void buildBitmapZ64(void *min, void *max, void *bm)
+{
+    int32_t lo[2] = {0, 0}, hi[2] = {1023, 1023};
+    if (min != NULL)
+        memcpy(lo, min, sizeof(lo));
+    if (max != NULL)
+        memcpy(hi, max, sizeof(hi));
+    if (lo[0] > hi[0] || lo[1] > hi[1])
+        return;
+
+    for (uint8_t cx = zOrderCell(lo[0]); cx <= zOrderCell(hi[0]); cx++)
+    {
+        for (uint8_t cy = zOrderCell(lo[1]); cy <= zOrderCell(hi[1]); cy++)
+        {
+            uint8_t z = zOrder(cx, cy);
+            *((uint8_t*) bm + (z >> 3)) |= 128 >> (z & 7);
+        }
+    }
+}
+
+int8_t inRangeZ64(void *data, void *min, void *max)
+{
+    for (int8_t i = 0; i < 2; i++)
+    {
+        int32_t val = *((int32_t*) data + i);
+        if ((min != NULL && val < *((int32_t*) min + i)) || (max != NULL && val > *((int32_t*) max + i)))
+            return 0;
+    }
+    return 1;
+}
+
+/* Derived value for SBITS_USE_DERIVED_BMAP: rate of change of a 32-bit int value per 60 key units (e.g. per minute). 0 for first record. */
+void deriveRateInt32(void *prevKey, void *prevData, void *key, void *data, void *derived)
+{
+    if (prevKey == NULL || *((int32_t*) key) == *((int32_t*) prevKey))
+        return;
+    int32_t keyDiff = *((int32_t*) key) - *((int32_t*) prevKey);
+    *((int32_t*) derived) = (int32_t) ((int64_t) (*((int32_t*) data) - *((int32_t*) prevData)) * 60 / keyDiff);
+}
+
+/* A 64-bit bitmap on a 32-bit int rate. Buckets of 10 from -310 to 310. */
+void updateBitmapRate64(void *data, void *bm)
+{
+    int32_t val = *((int32_t*) data);
+    int32_t count = val < -310 ? 0 : (val > 310 ? 63 : (val + 320) / 10);
+    if (count > 63)
+        count = 63;
+    *((uint8_t*) bm + (count >> 3)) |= 128 >> (count & 7);
+}
+
+int8_t inBitmapRate64(void *data, void *bm)
+{
+    uint64_t* bmval = (uint64_t*) bm;
+
+    uint64_t tmpbm = 0;
+    updateBitmapRate64(data, &tmpbm);
+    return (tmpbm & *bmval) != 0;
+}
+
 int8_t int32Comparator(
         void			*a,
         void			*b
@@ -213,6 +366,17 @@ int8_t int32Comparator(
 }
 
 
+/* Persistent memory emulated in RAM. Replace with FRAM or MRAM driver functions to keep records over resets. */
+void pmemReadRam(void *pmem, uint32_t offset, void *data, uint32_t length)
+{
+    memcpy(data, (uint8_t*) pmem + offset, length);
+}
+
+void pmemWriteRam(void *pmem, uint32_t offset, const void *data, uint32_t length)
+{
+    memcpy((uint8_t*) pmem + offset, data, length);
+}
+
 void testIterator(sbitsState *state)
 {
     /* Iterator with filter on keys */
@@ -278,6 +442,1046 @@ void testIterator(sbitsState *state)
     
 }
 
+/* Generates data of record i for correctness tests. c0 rises slowly from 300 to 652 with noise and repeats every 3400 records.
+   c1 is spread over 0 to 1023. c2 is a category from 0 to 49 that changes every 40 records. */
+void testData(int32_t i, int32_t *data)
+{
+    data[0] = 300 + (i / 10) % 340 + (i * 7919) % 13;
+    data[1] = (i * 37) % 1024;
+    data[2] = (i / 40) * 7 % 50;
+}
+
+/* Key of generated record i */
+int32_t testKey(int32_t i)
+{
+    return (i + 1) * 10;
+}
+
+/* Returns rate of c0 per 60 key units of generated record i (from record i-1) as computed by deriveRateInt32(). 0 for first record. */
+int32_t testRate(int32_t i)
+{
+    int32_t data[3], prev[3];
+
+    if (i == 0)
+        return 0;
+    testData(i, data);
+    testData(i - 1, prev);
+    return (data[0] - prev[0]) * 60 / (testKey(i) - testKey(i - 1));
+}
+
+/* Creates state for a correctness test with a 64-bit bitmap on c0. Caller sets other options before testInsert(). */
+sbitsState* testCreateState(uint32_t parameters)
+{
+    sbitsState* state = (sbitsState*) calloc(1, sizeof(sbitsState));
+    if (state == NULL)
+        return NULL;
+    state->keySize = 4;
+    state->dataSize = 12;
+    state->pageSize = 512;
+    state->bufferSizeInBlocks = 4;
+    state->buffer = malloc((size_t) state->bufferSizeInBlocks * state->pageSize);
+    if (state->buffer == NULL)
+    {
+        free(state);
+        return NULL;
+    }
+    state->startAddress = 0;
+    state->endAddress = state->pageSize * 2000;
+    state->eraseSizeInPages = 4;
+    state->parameters = parameters;
+    state->bitmapSize = 8;
+    state->inBitmap = inBitmapInt64;
+    state->updateBitmap = updateBitmapInt64;
+    state->compareKey = int32Comparator;
+    state->compareData = int32Comparator;
+    return state;
+}
+
+/* Puts generated records [first, last] and flushes. Data of each record has the columns of testData(). */
+int8_t testPut(sbitsState *state, int32_t first, int32_t last)
+{
+    int32_t key, data[3];
+
+    for (int32_t i = first; i <= last; i++)
+    {
+        key = testKey(i);
+        testData(i, data);
+        if (sbitsPut(state, &key, data) != 0)
+            return -1;
+    }
+    return sbitsFlush(state);
+}
+
+/* Initializes state and inserts numRecords generated records */
+int8_t testInsert(sbitsState *state, int32_t numRecords)
+{
+    if (sbitsInit(state) != 0)
+        return -1;
+    return testPut(state, 0, numRecords - 1);
+}
+
+/* Closes files and frees state created by testCreateState() */
+void testFreeState(sbitsState *state)
+{
+    if (state->file != NULL)
+        fclose(state->file);
+    if (state->indexFile != NULL && state->indexFile != state->file)
+        fclose(state->indexFile);
+    if (state->valueIndexFile != NULL)
+        fclose(state->valueIndexFile);
+    free(state->queryCache);
+    free(state->wearBlocks);
+    free(state->gaps);
+    free(state->probeBuffer);
+    free(state->buffer);
+    free(state);
+}
+
+/* Query bounds of a correctness test. Either may be NULL. */
+typedef struct {
+    void *min;
+    void *max;
+} testBounds;
+
+/* Returns 1 if generated record i matches a query. arg has the query (e.g. testBounds). */
+typedef int8_t (*testPredicate)(int32_t i, void *arg);
+
+/* Returns 1 if c0 of generated record i is in bounds */
+int8_t testMatchRange(int32_t i, void *arg)
+{
+    testBounds *b = (testBounds*) arg;
+    int32_t data[3];
+
+    testData(i, data);
+    return (b->min == NULL || data[0] >= *((int32_t*) b->min)) && (b->max == NULL || data[0] <= *((int32_t*) b->max));
+}
+
+/* Returns number of records returned by an initialized iterator. Records that are not the generated record with
+   the same key or do not match the query are errors (-1). */
+int32_t testCount(sbitsState *state, sbitsIterator *it, testPredicate match, void *arg)
+{
+    int32_t *itKey, *itData, data[3], count = 0;
+
+    while (sbitsNext(state, it, (void**) &itKey, (void**) &itData))
+    {
+        int32_t i = *itKey / 10 - 1;
+        testData(i, data);
+        if (memcmp(itData, data, sizeof(data)) != 0 || !match(i, arg))
+            return -1;
+        if (SBITS_USING_DERIVED_BMAP(state->parameters))
+        {   /* Derived value is the rate of testRate() */
+            int32_t rate;
+            memcpy(&rate, it->derivedData, sizeof(int32_t));
+            if (rate != testRate(i))
+                return -1;
+        }
+        count++;
+    }
+    return count;
+}
+
+/* Returns number of records returned by an iterator on data bounds (no key bounds). Checked as in testCount(). */
+int32_t testCountData(sbitsState *state, testBounds *b, testPredicate match)
+{
+    sbitsIterator it;
+
+    it.minKey = NULL;
+    it.maxKey = NULL;
+    it.minData = b->min;
+    it.maxData = b->max;
+    sbitsInitIterator(state, &it);
+    return testCount(state, &it, match, b);
+}
+
+/* Returns number of generated records i in [first, last] that match the query */
+int32_t testExpect(int32_t first, int32_t last, testPredicate match, void *arg)
+{
+    int32_t count = 0;
+
+    for (int32_t i = first; i <= last; i++)
+        count += match(i, arg);
+    return count;
+}
+
+/* Returns number of records with c0 in range [minData, maxData] returned by an iterator. Errors are -1. */
+int32_t testCountRange(sbitsState *state, int32_t minData, int32_t maxData)
+{
+    testBounds b = {&minData, &maxData};
+    return testCountData(state, &b, testMatchRange);
+}
+
+/* Returns number of generated records with c0 in range [minData, maxData] */
+int32_t testExpectRange(int32_t numRecords, int32_t minData, int32_t maxData)
+{
+    testBounds b = {&minData, &maxData};
+    return testExpect(0, numRecords - 1, testMatchRange, &b);
+}
+
+/* Prints result of a correctness test. Returns 1 if test failed. */
+int8_t testCheck(const char *name, int32_t result, int32_t expected)
+{
+    printf("%s: %ld expected: %ld %s\n", name, (long) result, (long) expected, result == expected ? "OK" : "FAILED");
+    return result != expected;
+}
+
+/* Returns index of first generated record still stored. Records of pages erased when storage wrapped are gone. */
+int32_t testFirstRecord(sbitsState *state)
+{
+    return state->firstDataPageId * state->maxRecordsPerPage;
+}
+
+/**
+ * Checks range queries on c0 with bounds on one or both sides against generated records [first, last].
+ * Returns number of failed checks.
+ */
+int8_t testRanges(const char *name, sbitsState *state, int32_t first, int32_t last)
+{
+    int32_t min[4] = {401, 300, 600, 0}, max[4] = {404, 350, 0, 320};
+    int8_t fails = 0;
+    char buf[80];
+
+    for (int8_t q = 0; q < 4; q++)
+    {   /* 0 is a missing bound */
+        testBounds b = {min[q] != 0 ? &min[q] : NULL, max[q] != 0 ? &max[q] : NULL};
+        if (b.min == NULL)
+            snprintf(buf, sizeof(buf), "%s query c0 <= %ld", name, (long) max[q]);
+        else if (b.max == NULL)
+            snprintf(buf, sizeof(buf), "%s query c0 >= %ld", name, (long) min[q]);
+        else
+            snprintf(buf, sizeof(buf), "%s query c0 in [%ld, %ld]", name, (long) min[q], (long) max[q]);
+        fails += testCheck(buf, testCountData(state, &b, testMatchRange), testExpect(first, last, testMatchRange, &b));
+    }
+    return fails;
+}
+
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+/**
+ * Checks data queries with fine bitmaps and the query cache against a count of the generated records.
+ * Back to back queries have the same 64-bit query bitmap but different fine query bitmaps.
+ */
+int8_t testFineBitmapCache()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_FINE_BMAP | SBITS_USE_QUERY_CACHE);
+    if (state == NULL)
+        return 1;
+    state->endAddress += state->pageSize * state->eraseSizeInPages * 2;
+    state->fineBitmapSize = 16;
+    state->updateFineBitmap = updateBitmapInt128;
+    state->queryCacheSize = 4;
+    state->queryCache = (sbitsQueryCacheEntry*) malloc(state->queryCacheSize * sizeof(sbitsQueryCacheEntry));
+    if (state->queryCache == NULL || testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+
+    fails += testCheck("Fine bitmap query [401, 404]", testCountRange(state, 401, 404), testExpectRange(numRecords, 401, 404));
+    fails += testCheck("Fine bitmap query [406, 409]", testCountRange(state, 406, 409), testExpectRange(numRecords, 406, 409));
+    fails += testCheck("Fine bitmap query [401, 404] again", testCountRange(state, 401, 404), testExpectRange(numRecords, 401, 404));
+    fails += testCheck("Fine bitmap query cache hits", state->queryCacheHits, 1);
+    testFreeState(state);
+    return fails;
+}
+#endif
+
+/* Returns 1 if c0 of generated record i is equal to value (arg) */
+int8_t testMatchEqual(int32_t i, void *arg)
+{
+    int32_t data[3];
+
+    testData(i, data);
+    return data[0] == *((int32_t*) arg);
+}
+
+/* Returns number of records with c0 equal to value returned by an equality iterator within key range [minKey, maxKey]
+   (either may be NULL). Errors are -1. */
+int32_t testCountEqual(sbitsState *state, int32_t value, void *minKey, void *maxKey)
+{
+    sbitsIterator it;
+
+    it.minKey = minKey;
+    it.maxKey = maxKey;
+    sbitsInitEqualityIterator(state, &it, &value);
+    return testCount(state, &it, testMatchEqual, &value);
+}
+
+/**
+ * Checks equality queries with a hash (Bloom filter) bitmap against a count of the generated records.
+ * Includes a value that is not present and a query with key bounds.
+ */
+int8_t testHashBitmap()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_HASH_BMAP);
+    if (state == NULL)
+        return 1;
+    state->inBitmap = inBitmapHash64;
+    state->updateBitmap = updateBitmapHash64;
+    if (testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+
+    int32_t values[3] = {405, 555, 700};
+    fails += testCheck("Hash bitmap query c0 = 405", testCountEqual(state, 405, NULL, NULL), testExpect(0, numRecords - 1, testMatchEqual, &values[0]));
+    fails += testCheck("Hash bitmap query c0 = 555", testCountEqual(state, 555, NULL, NULL), testExpect(0, numRecords - 1, testMatchEqual, &values[1]));
+    fails += testCheck("Hash bitmap query c0 = 700", testCountEqual(state, 700, NULL, NULL), testExpect(0, numRecords - 1, testMatchEqual, &values[2]));
+
+    int32_t minKey = testKey(2000), maxKey = testKey(5999);
+    fails += testCheck("Hash bitmap query c0 = 405 with key range", testCountEqual(state, 405, &minKey, &maxKey), testExpect(2000, 5999, testMatchEqual, &values[0]));
+    testFreeState(state);
+    return fails;
+}
+
+/* Returns 1 if (c0, c1) of generated record i is in rectangle bounds */
+int8_t testMatchRectangle(int32_t i, void *arg)
+{
+    int32_t data[3];
+
+    testData(i, data);
+    return inRangeZ64(data, ((testBounds*) arg)->min, ((testBounds*) arg)->max);
+}
+
+/**
+ * Checks rectangle queries on c0 and c1 with a Z-order bitmap against a count of the generated records.
+ * Rectangles cover parts of cells, several cells and an area with no records.
+ */
+int8_t testZOrderBitmap()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_MULTI_DIM);
+    if (state == NULL)
+        return 1;
+    state->updateBitmap = updateBitmapZ64;
+    state->inBitmap = inBitmapZ64;
+    state->buildBitmap = buildBitmapZ64;
+    state->inDataRange = inRangeZ64;
+    if (testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+
+    int32_t min1[2] = {400, 100}, max1[2] = {450, 600};
+    testBounds b1 = {min1, max1};
+    fails += testCheck("Z-order query [400, 450] x [100, 600]", testCountData(state, &b1, testMatchRectangle), testExpect(0, numRecords - 1, testMatchRectangle, &b1));
+    int32_t min2[2] = {300, 0}, max2[2] = {1023, 127};
+    testBounds b2 = {min2, max2};
+    fails += testCheck("Z-order query [300, 1023] x [0, 127]", testCountData(state, &b2, testMatchRectangle), testExpect(0, numRecords - 1, testMatchRectangle, &b2));
+    int32_t min3[2] = {500, 900}, max3[2] = {520, 1000};
+    testBounds b3 = {min3, max3};
+    fails += testCheck("Z-order query [500, 520] x [900, 1000]", testCountData(state, &b3, testMatchRectangle), testExpect(0, numRecords - 1, testMatchRectangle, &b3));
+    int32_t min4[2] = {100, 200}, max4[2] = {250, 300};
+    testBounds b4 = {min4, max4};
+    fails += testCheck("Z-order query [100, 250] x [200, 300]", testCountData(state, &b4, testMatchRectangle), testExpect(0, numRecords - 1, testMatchRectangle, &b4));
+    testFreeState(state);
+    return fails;
+}
+
+/* Returns 1 if rate of generated record i is in bounds */
+int8_t testMatchRate(int32_t i, void *arg)
+{
+    testBounds *b = (testBounds*) arg;
+    int32_t rate = testRate(i);
+
+    return (b->min == NULL || rate >= *((int32_t*) b->min)) && (b->max == NULL || rate <= *((int32_t*) b->max));
+}
+
+/**
+ * Checks queries on the rate of change of c0 with a derived value bitmap against rates computed from consecutive
+ * generated records. Rates of the first record of each page use the previous record carried in the page header.
+ */
+int8_t testDerivedBitmap()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_DERIVED_BMAP);
+    if (state == NULL)
+        return 1;
+    state->deriveData = deriveRateInt32;
+    state->updateBitmap = updateBitmapRate64;
+    state->inBitmap = inBitmapRate64;
+    if (testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+
+    /* Rates are 12 or 18 while c0 rises, -60 or -66 after noise drops and below -2000 where c0 wraps */
+    int32_t minRate = 15, minRate2 = -62, maxRate2 = -55, maxRate3 = -100;
+    testBounds b1 = {&minRate, NULL}, b2 = {&minRate2, &maxRate2}, b3 = {NULL, &maxRate3};
+    fails += testCheck("Derived rate query >= 15", testCountData(state, &b1, testMatchRate), testExpect(0, numRecords - 1, testMatchRate, &b1));
+    fails += testCheck("Derived rate query [-62, -55]", testCountData(state, &b2, testMatchRate), testExpect(0, numRecords - 1, testMatchRate, &b2));
+    fails += testCheck("Derived rate query <= -100", testCountData(state, &b3, testMatchRate), testExpect(0, numRecords - 1, testMatchRate, &b3));
+    testFreeState(state);
+    return fails;
+}
+
+/**
+ * Checks range queries with compressed index records against a count of the generated records, before and after
+ * the storage wraps. Slowly changing c0 sets few buckets per page, so most index records are compressed.
+ */
+int8_t testCompressedIndex()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    for (int8_t wrap = 0; wrap < 2; wrap++)
+    {
+        sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_COMPRESSED_INDEX);
+        if (state == NULL)
+            return fails + 1;
+#if SBITS_MAX_BITMAP_SIZE >= 32
+        state->bitmapSize = 32;
+        state->updateBitmap = updateBitmapInt256;
+#endif
+        if (wrap)
+            state->endAddress = state->pageSize * 200;
+        if (testInsert(state, numRecords) != 0)
+        {
+            testFreeState(state);
+            return fails + 1;
+        }
+        fails += testRanges(wrap ? "Compressed index (wrapped)" : "Compressed index", state, testFirstRecord(state), numRecords - 1);
+        testFreeState(state);
+    }
+    return fails;
+}
+
+/* Returns 64-bit bitmap with the buckets of all values in [min, max] */
+uint64_t testBitmap64(int32_t min, int32_t max)
+{
+    uint64_t bm = 0;
+
+    for (int32_t v = min; v <= max; v++)
+        updateBitmapInt64(&v, &bm);
+    return bm;
+}
+
+/**
+ * Checks that buildBitmapInt64FromRange() sets the buckets of every value in the range, including ranges that cross a byte
+ * of the bitmap and ranges open on one side.
+ */
+int8_t testBuildBitmap64()
+{
+    sbitsState state;
+    int32_t ranges[][2] = {{385, 395}, {401, 404}, {395, 475}, {300, 320}, {600, 1000}, {300, 1000}};
+    int32_t wrong = 0;
+    uint64_t bm;
+
+    memset(&state, 0, sizeof(state));
+    state.updateBitmap = updateBitmapInt64;
+    for (uint8_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+    {
+        bm = 0;
+        buildBitmapInt64FromRange(&state, &ranges[i][0], &ranges[i][1], &bm);
+        wrong += bm != testBitmap64(ranges[i][0], ranges[i][1]);
+        bm = 0;
+        buildBitmapInt64FromRange(&state, NULL, &ranges[i][1], &bm);
+        wrong += bm != testBitmap64(0, ranges[i][1]);
+        bm = 0;
+        buildBitmapInt64FromRange(&state, &ranges[i][0], NULL, &bm);
+        wrong += bm != testBitmap64(ranges[i][0], 1000);
+    }
+    return testCheck("64-bit range bitmaps with wrong buckets", wrong, 0);
+}
+
+/**
+ * Checks range queries with range-encoded bitmaps in both directions against a count of the generated records.
+ * Queries bounded only on the side not encoded are not pruned but must still be exact.
+ */
+int8_t testRangeBitmap()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+    const char *names[4] = {"Range bitmap LE", "Range bitmap GE", "Range bitmap LE (wrapped)", "Range bitmap GE (wrapped)"};
+
+    for (int8_t t = 0; t < 4; t++)
+    {
+        sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_RANGE_BMAP);
+        if (state == NULL)
+            return fails + 1;
+        state->rangeBitmapDir = (t & 1) ? SBITS_RANGE_GE : SBITS_RANGE_LE;
+        if (t >= 2)
+            state->endAddress = state->pageSize * 200;
+        if (testInsert(state, numRecords) != 0)
+        {
+            testFreeState(state);
+            return fails + 1;
+        }
+        fails += testRanges(names[t], state, testFirstRecord(state), numRecords - 1);
+        testFreeState(state);
+    }
+    return fails;
+}
+
+/* Returns number of records with c0 in bounds within key range [minKey, maxKey] (either may be NULL) returned by a value index iterator.
+   Errors are -1. */
+int32_t testCountValue(sbitsState *state, testBounds *b, void *minKey, void *maxKey)
+{
+    sbitsIterator it;
+
+    it.minKey = minKey;
+    it.maxKey = maxKey;
+    it.minData = b->min;
+    it.maxData = b->max;
+    sbitsInitValueIterator(state, &it);
+    return testCount(state, &it, testMatchRange, b);
+}
+
+/**
+ * Checks equality and range lookups with the value index against a count of the generated records, before and after
+ * the storage wraps. Includes a value that is not present and a lookup with key bounds.
+ */
+int8_t testValueIndex()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+
+    for (int8_t wrap = 0; wrap < 2; wrap++)
+    {
+        sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_VALUE_INDEX);
+        if (state == NULL)
+            return fails + 1;
+        /* 4 pages per erase block of 31 records needs 2 run pages */
+        free(state->buffer);
+        state->bufferSizeInBlocks = 8;
+        state->buffer = malloc((size_t) state->bufferSizeInBlocks * state->pageSize);
+        state->valueSize = 4;
+        if (wrap)
+            state->endAddress = state->pageSize * 200;
+        if (state->buffer == NULL || testInsert(state, numRecords) != 0 || state->valueIndexFile == NULL)
+        {
+            testFreeState(state);
+            return fails + 1;
+        }
+
+        int32_t first = testFirstRecord(state), last = numRecords - 1;
+        int32_t values[3] = {405, 555, 700}, min = 401, max = 404;
+        int32_t minKey = testKey(first + 1000), maxKey = testKey(first + 4999);
+        testBounds b0 = {&values[0], &values[0]}, b1 = {&values[1], &values[1]}, b2 = {&values[2], &values[2]}, b3 = {&min, &max};
+        const char *name = wrap ? "Value index (wrapped)" : "Value index";
+        char buf[80];
+
+        snprintf(buf, sizeof(buf), "%s lookup c0 = 405", name);
+        fails += testCheck(buf, testCountValue(state, &b0, NULL, NULL), testExpect(first, last, testMatchRange, &b0));
+        snprintf(buf, sizeof(buf), "%s lookup c0 = 555", name);
+        fails += testCheck(buf, testCountValue(state, &b1, NULL, NULL), testExpect(first, last, testMatchRange, &b1));
+        snprintf(buf, sizeof(buf), "%s lookup c0 = 700", name);
+        fails += testCheck(buf, testCountValue(state, &b2, NULL, NULL), testExpect(first, last, testMatchRange, &b2));
+        snprintf(buf, sizeof(buf), "%s lookup c0 in [401, 404]", name);
+        fails += testCheck(buf, testCountValue(state, &b3, NULL, NULL), testExpect(first, last, testMatchRange, &b3));
+        snprintf(buf, sizeof(buf), "%s lookup c0 = 405 with key range", name);
+        fails += testCheck(buf, testCountValue(state, &b0, &minKey, &maxKey), testExpect(first + 1000, first + 4999, testMatchRange, &b0));
+        testFreeState(state);
+    }
+    return fails;
+}
+
+/**
+ * Checks range queries with adaptive bucket boundaries against a count of the generated records. Initial boundaries
+ * do not fit c0, so boundaries are recomputed. Boundaries are in index pages, in data pages (no index) and with
+ * range-encoded bitmaps, and the last store wraps.
+ */
+int8_t testAdaptiveBitmap()
+{
+    int32_t numRecords = 10000;
+    int8_t fails = 0;
+    const char *names[4] = {"Adaptive bitmap", "Adaptive bitmap (no index)", "Adaptive range bitmap LE", "Adaptive bitmap (wrapped)"};
+    uint32_t parameters[4] = {SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_ADAPTIVE_BMAP, SBITS_USE_BMAP | SBITS_USE_ADAPTIVE_BMAP,
+                        SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_ADAPTIVE_BMAP | SBITS_USE_RANGE_BMAP, SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_ADAPTIVE_BMAP};
+
+    for (int8_t t = 0; t < 4; t++)
+    {
+        sbitsState *state = testCreateState(parameters[t]);
+        if (state == NULL)
+            return fails + 1;
+        state->bitmapMin = -100;
+        state->bitmapMax = 100;
+        state->rangeBitmapDir = SBITS_RANGE_LE;
+        if (t == 3)
+            state->endAddress = state->pageSize * 200;
+        if (testInsert(state, numRecords) != 0)
+        {
+            testFreeState(state);
+            return fails + 1;
+        }
+        fails += testRanges(names[t], state, testFirstRecord(state), numRecords - 1);
+        char buf[80];
+        snprintf(buf, sizeof(buf), "%s boundaries recomputed", names[t]);
+        fails += testCheck(buf, state->numBoundsChanges > 0, 1);
+        testFreeState(state);
+    }
+    return fails;
+}
+
+/* Key of record i in gap test. Keys jump by 1000 after every 100 records. */
+int32_t testGapKey(int32_t i)
+{
+    return testKey(i) + 1000 * (i / 100);
+}
+
+/* Returns number of gaps found that are not gap k of the gap test (between records 100k-1 and 100k) for k = firstGap, firstGap+1, ... */
+int16_t testGapErrors(sbitsGap *gaps, int16_t n, int32_t firstGap)
+{
+    int16_t errors = 0;
+
+    for (int16_t j = 0; j < n; j++)
+    {
+        int32_t k = firstGap + j;
+        if (gaps[j].startKey != testGapKey(100 * k - 1) || gaps[j].endKey != testGapKey(100 * k))
+            errors++;
+    }
+    return errors;
+}
+
+/**
+ * Checks the gap list when there are more gaps than list entries. The list must have the most recent gaps in key order,
+ * and gapsFromKey must be the end of the last gap replaced.
+ */
+int8_t testGapIndex()
+{
+    int32_t numRecords = 2000, key, data[3];
+    int8_t fails = 0;
+    sbitsGap gaps[16];
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_GAP_INDEX);
+    if (state == NULL)
+        return 1;
+    state->maxGaps = 8;
+    state->gaps = (sbitsGap*) malloc(state->maxGaps * sizeof(sbitsGap));
+    state->gapThreshold = 600;
+    if (state->gaps == NULL || sbitsInit(state) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    for (int32_t i = 0; i < numRecords; i++)
+    {
+        key = testGapKey(i);
+        testData(i, data);
+        sbitsPut(state, &key, data);
+    }
+    sbitsFlush(state);
+
+    /* 19 gaps. Gaps 1 to 11 were replaced by gaps 12 to 19. */
+    int16_t n = sbitsFindGaps(state, NULL, NULL, gaps, 16);
+    fails += testCheck("Gap index gaps in list", n, 8);
+    fails += testCheck("Gap index gaps from key", state->gapsFromKey, testGapKey(1100));
+    fails += testCheck("Gap index wrong gaps", testGapErrors(gaps, n, 12), 0);
+
+    int32_t minKey = testGapKey(1450), maxKey = testGapKey(1750);
+    n = sbitsFindGaps(state, &minKey, &maxKey, gaps, 16);
+    fails += testCheck("Gap index gaps in key range", n, 3);
+    fails += testCheck("Gap index wrong gaps in key range", testGapErrors(gaps, n, 15), 0);
+
+    n = sbitsFindGaps(state, NULL, NULL, gaps, 2);
+    fails += testCheck("Gap index gaps that fit", n, 2);
+    fails += testCheck("Gap index wrong gaps that fit", testGapErrors(gaps, n, 12), 0);
+    testFreeState(state);
+    return fails;
+}
+
+/* Returns number of generated records i in [first, last] found by sbitsGet() with their generated data */
+int32_t testCountGet(sbitsState *state, int32_t first, int32_t last)
+{
+    int32_t key, data[3], expected[3], found = 0;
+
+    for (int32_t i = first; i <= last; i++)
+    {
+        key = testKey(i);
+        testData(i, expected);
+        if (sbitsGet(state, &key, data) == 0 && memcmp(data, expected, sizeof(expected)) == 0)
+            found++;
+    }
+    return found;
+}
+
+/**
+ * Checks that sbitsGet() with probe reads finds every record and no key between records.
+ */
+int8_t testProbe()
+{
+    int32_t numRecords = 10000, key, data[3], found = 0;
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_PROBE);
+    if (state == NULL)
+        return 1;
+    state->probePages = 4;
+    state->probeBuffer = malloc((size_t) state->probePages * state->pageSize);
+    if (state->probeBuffer == NULL || testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+
+    fails += testCheck("Probe records found", testCountGet(state, 0, numRecords - 1), numRecords);
+    for (int32_t i = 0; i < numRecords; i += 7)
+    {
+        key = testKey(i) + 5;
+        if (sbitsGet(state, &key, data) == 0)
+            found++;
+    }
+    fails += testCheck("Probe missing keys found", found, 0);
+    fails += testCheck("Probe reads used", state->numProbes > 0, 1);
+    testFreeState(state);
+    return fails;
+}
+
+/**
+ * Inserts numRecords generated records into a state from create(parameters) and saves a checkpoint. A new state
+ * from create(parameters) warm starts from the checkpoint as after a restart and inserts numRecords more records.
+ * Checks that sbitsGet() finds every record, that an iterator with no bounds returns every record once and range queries.
+ * Returns number of failed checks.
+ */
+int8_t testRoundTrip(const char *name, sbitsState* (*create)(uint32_t parameters), uint32_t parameters, int32_t numRecords)
+{
+    int8_t fails = 0;
+    char buf[80];
+    testBounds all = {NULL, NULL};
+
+    /* Start empty even if an earlier test saved a checkpoint with the same configuration */
+    remove("warmfile.bin");
+    sbitsState *state = create(parameters | SBITS_USE_WARM_START);
+    if (state == NULL)
+        return 1;
+    if (testInsert(state, numRecords) != 0 || sbitsCheckpoint(state) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    testFreeState(state);
+
+    state = create(parameters | SBITS_USE_WARM_START);
+    if (state == NULL)
+        return 1;
+    if (sbitsInit(state) != 0 || testPut(state, numRecords, 2 * numRecords - 1) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    while (sbitsPrefetch(state))
+        ;
+
+    snprintf(buf, sizeof(buf), "%s records found after restart", name);
+    fails += testCheck(buf, testCountGet(state, 0, 2 * numRecords - 1), 2 * numRecords);
+    snprintf(buf, sizeof(buf), "%s records iterated after restart", name);
+    fails += testCheck(buf, testCountData(state, &all, testMatchRange), 2 * numRecords);
+    fails += testRanges(name, state, 0, 2 * numRecords - 1);
+    testFreeState(state);
+    return fails;
+}
+
+/**
+ * Checks records and range queries when the record directory is used to skip records in pages, with and without an index.
+ */
+int8_t testRecordDir()
+{
+    int8_t fails = 0;
+
+    fails += testRoundTrip("Record directory", testCreateState, SBITS_USE_BMAP | SBITS_USE_RECORD_DIR, 5000);
+    fails += testRoundTrip("Record directory with index", testCreateState, SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_RECORD_DIR, 5000);
+    return fails;
+}
+
+/* Creates state configured by sbitsConfigureForBudget() for 4 KB of RAM and 800 KB of storage (less than testCreateState())
+   with repeated range queries. Block map for SBITS_USE_WEAR_LEVEL is allocated for the storage budget before the call. */
+sbitsState* testCreateBudgetState(uint32_t parameters)
+{
+    sbitsWorkloadHints hints = {20, 10, 1};
+    uint32_t storageBytes = 800 * 1024;
+
+    sbitsState *state = testCreateState(parameters);
+    if (state == NULL)
+        return NULL;
+    free(state->buffer);
+    state->buffer = NULL;
+    if (SBITS_USING_WEAR_LEVEL(parameters))
+    {
+        state->endAddress = state->startAddress + storageBytes;
+        state->wearBlocks = (sbitsWearBlock*) malloc(SBITS_WEAR_NUM_BLOCKS(state) * sizeof(sbitsWearBlock));
+    }
+    if (sbitsConfigureForBudget(state, 4096, storageBytes, &hints, NULL) != 0)
+    {
+        testFreeState(state);
+        return NULL;
+    }
+    state->buffer = malloc((size_t) state->bufferSizeInBlocks * state->pageSize);
+    if (state->queryCacheSize > 0)
+        state->queryCache = (sbitsQueryCacheEntry*) malloc(state->queryCacheSize * sizeof(sbitsQueryCacheEntry));
+    if (state->buffer == NULL || (state->queryCacheSize > 0 && state->queryCache == NULL) || SBITS_USING_WEAR_LEVEL(parameters) != SBITS_USING_WEAR_LEVEL(state->parameters))
+    {
+        testFreeState(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Checks records and range queries in stores configured for a memory budget, with and without wear leveling.
+ */
+int8_t testBudget()
+{
+    int8_t fails = 0;
+
+    fails += testRoundTrip("Budget", testCreateBudgetState, 0, 5000);
+    fails += testRoundTrip("Budget with wear leveling", testCreateBudgetState, SBITS_USE_WEAR_LEVEL, 5000);
+    return fails;
+}
+
+/* Creates state with a 4 entry query cache */
+sbitsState* testCreateCacheState(uint32_t parameters)
+{
+    sbitsState *state = testCreateState(parameters | SBITS_USE_QUERY_CACHE);
+    if (state == NULL)
+        return NULL;
+    state->queryCacheSize = 4;
+    state->queryCache = (sbitsQueryCacheEntry*) malloc(state->queryCacheSize * sizeof(sbitsQueryCacheEntry));
+    if (state->queryCache == NULL)
+    {
+        testFreeState(state);
+        return NULL;
+    }
+    return state;
+}
+
+/**
+ * Checks that a warm start after sbitsFlush() and sbitsCheckpoint() restores the query cache and hot pages, and the restart round trip.
+ */
+int8_t testWarmStart()
+{
+    int32_t numRecords = 5000;
+    int8_t fails = 0;
+
+    remove("warmfile.bin");
+    sbitsState *state = testCreateCacheState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_WARM_START);
+    if (state == NULL)
+        return 1;
+    if (testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    /* Query fills a cache entry and reads hot pages. Records were flushed by testInsert(). */
+    testCountRange(state, 401, 404);
+    if (sbitsCheckpoint(state) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    testFreeState(state);
+
+    state = testCreateCacheState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_WARM_START);
+    if (state == NULL)
+        return 1;
+    if (sbitsInit(state) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    fails += testCheck("Warm start hot pages", state->numHotPages > 0, 1);
+    while (sbitsPrefetch(state))
+        ;
+    fails += testCheck("Warm start query [401, 404]", testCountRange(state, 401, 404), testExpectRange(numRecords, 401, 404));
+    fails += testCheck("Warm start query cache hits", state->queryCacheHits, 1);
+    testFreeState(state);
+
+    fails += testRoundTrip("Warm start", testCreateCacheState, SBITS_USE_BMAP | SBITS_USE_INDEX, 5000);
+    return fails;
+}
+
+/**
+ * Checks records and range queries when page bitmaps are only in index records and the data page header is reduced,
+ * alone and with min/max values and record directory in the header.
+ */
+int8_t testReducedHeader()
+{
+    int8_t fails = 0;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX);
+    if (state == NULL)
+        return 1;
+    sbitsInitLayout(state);
+    fails += testCheck("Reduced header bitmap offset", state->bitmapOffset, 0);
+    fails += testCheck("Reduced header size", state->headerSize, SBITS_ALIGN(6));
+    testFreeState(state);
+
+    fails += testRoundTrip("Reduced header", testCreateState, SBITS_USE_BMAP | SBITS_USE_INDEX, 5000);
+    fails += testRoundTrip("Reduced header with min/max and directory", testCreateState, SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_MAX_MIN | SBITS_USE_RECORD_DIR, 5000);
+    return fails;
+}
+
+#if defined(SBITS_ALIGN_RECORDS)
+/**
+ * Checks that header fields and records are aligned to SBITS_ALIGN_RECORDS bytes and that keys and data returned by
+ * an iterator are at aligned addresses, and runs the restart round trip with aligned records.
+ */
+int8_t testAlignedRecords()
+{
+    int32_t numRecords = 5000, misaligned = 0;
+    int8_t fails = 0;
+    int32_t *itKey, *itData;
+    sbitsIterator it;
+
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_MAX_MIN | SBITS_USE_RECORD_DIR);
+    if (state == NULL)
+        return 1;
+    if (testInsert(state, numRecords) != 0)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    fails += testCheck("Aligned header size", state->headerSize % SBITS_ALIGN_RECORDS, 0);
+    fails += testCheck("Aligned min/max offset", state->minMaxOffset % SBITS_ALIGN_RECORDS, 0);
+    fails += testCheck("Aligned record size", state->recordSize % SBITS_ALIGN_RECORDS, 0);
+
+    it.minKey = NULL;
+    it.maxKey = NULL;
+    it.minData = NULL;
+    it.maxData = NULL;
+    sbitsInitIterator(state, &it);
+    while (sbitsNext(state, &it, (void**) &itKey, (void**) &itData))
+    {
+        if ((uintptr_t) itKey % SBITS_ALIGN_RECORDS != 0 || (uintptr_t) itData % SBITS_ALIGN_RECORDS != 0)
+            misaligned++;
+    }
+    fails += testCheck("Aligned records misaligned", misaligned, 0);
+    testFreeState(state);
+
+    fails += testRoundTrip("Aligned records", testCreateState, SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_MAX_MIN | SBITS_USE_RECORD_DIR, numRecords);
+    return fails;
+}
+#endif
+
+/**
+ * Runs the restart round trip in the log configuration of the build. Build with -DSBITS_LOG_LEVEL=0 and with
+ * -DSBITS_TELEMETRY to check that compiled out or binary messages do not change results.
+ */
+int8_t testLogBuild()
+{
+    char name[40];
+
+#if defined(SBITS_TELEMETRY)
+    snprintf(name, sizeof(name), "Telemetry log level %d", SBITS_LOG_LEVEL);
+#else
+    snprintf(name, sizeof(name), "Log level %d", SBITS_LOG_LEVEL);
+#endif
+    return testRoundTrip(name, testCreateState, SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_RECORD_DIR | SBITS_USE_MAX_MIN, 5000);
+}
+
+/* Creates state for a persistent memory test. Persistent memory is kept by caller over resets. */
+sbitsState* testCreatePmemState(void *pmem)
+{
+    sbitsState *state = testCreateState(SBITS_USE_BMAP | SBITS_USE_INDEX | SBITS_USE_PMEM);
+    if (state == NULL)
+        return NULL;
+    state->pmem = pmem;
+    state->pmemRead = pmemReadRam;
+    state->pmemWrite = pmemWriteRam;
+    return state;
+}
+
+/**
+ * Checks that records put without a flush are restored from persistent memory by the next sbitsInit(),
+ * and that inserts continue after them. Records are found by key, by an iterator and by a data query after the flush.
+ */
+int8_t testPmemRestore()
+{
+    int32_t numRecords = 1000, key, data[3];
+    testBounds all = {NULL, NULL};
+    int8_t fails = 0;
+
+    sbitsState *state = testCreatePmemState(NULL);
+    if (state == NULL)
+        return 1;
+    uint32_t size = sbitsPmemSize(state);
+    void *pmem = malloc(size);
+    if (pmem == NULL)
+    {
+        testFreeState(state);
+        return 1;
+    }
+    /* New memory has no valid slot */
+    memset(pmem, 0xFF, size);
+    state->pmem = pmem;
+    if (sbitsInit(state) != 0)
+    {
+        testFreeState(state);
+        free(pmem);
+        return 1;
+    }
+    for (int32_t i = 0; i < numRecords; i++)
+    {
+        key = testKey(i);
+        testData(i, data);
+        sbitsPut(state, &key, data);
+    }
+
+    /* Reset without flush. Records of the output page are only in persistent memory. */
+    testFreeState(state);
+    state = testCreatePmemState(pmem);
+    if (state == NULL || sbitsInit(state) != 0)
+    {
+        if (state != NULL)
+            testFreeState(state);
+        free(pmem);
+        return 1;
+    }
+    if (testPut(state, numRecords, 2 * numRecords - 1) != 0)
+        fails++;
+    fails += testCheck("Persistent memory records found", testCountGet(state, 0, 2 * numRecords - 1), 2 * numRecords);
+    fails += testCheck("Persistent memory records iterated", testCountData(state, &all, testMatchRange), 2 * numRecords);
+    fails += testCheck("Persistent memory query [401, 404]", testCountRange(state, 401, 404), testExpectRange(2 * numRecords, 401, 404));
+    testFreeState(state);
+    free(pmem);
+    return fails;
+}
+
+/**
+ * Runs correctness tests of bitmap and persistent memory options. Query results are compared with a count of the generated records.
+ * Returns number of failed checks.
+ */
+int8_t runcorrectnesstests_sbits()
+{
+    int8_t fails = 0;
+
+    printf("\nCORRECTNESS TESTS:\n");
+#if SBITS_MAX_FINE_BITMAP_SIZE > 0
+    fails += testFineBitmapCache();
+#endif
+    fails += testHashBitmap();
+    fails += testZOrderBitmap();
+    fails += testDerivedBitmap();
+    fails += testCompressedIndex();
+    fails += testBuildBitmap64();
+    fails += testRangeBitmap();
+    fails += testValueIndex();
+    fails += testAdaptiveBitmap();
+    fails += testGapIndex();
+    fails += testProbe();
+    fails += testRecordDir();
+    fails += testBudget();
+    fails += testWarmStart();
+    fails += testReducedHeader();
+#if defined(SBITS_ALIGN_RECORDS)
+    fails += testAlignedRecords();
+#endif
+    fails += testLogBuild();
+    fails += testPmemRestore();
+    printf("Failed checks: %d\n", fails);
+    return fails;
+}
+
 /**
  * Runs all tests and collects benchmarks
  */ 
@@ -285,6 +1489,11 @@ void runalltests_sbits()
 {
     printf("\nSTARTING SBITS TESTS.\n");
 
+#if !defined(ARDUINO) || defined(SBITS_CORRECTNESS_TESTS)
+    /* Correctness tests allocate several states and files. Only run on the host unless requested for a device build. */
+    runcorrectnesstests_sbits();
+#endif
+
     int8_t      M = 4;    
     int32_t     numRecords = 10000;
     uint32_t    numSteps = 10, stepSize = numRecords / numSteps;
@@ -306,6 +1515,11 @@ void runalltests_sbits()
     uint32_t    hits2[numSteps][numRuns];        
     uint32_t    rreads2[numSteps][numRuns];
     uint32_t    rhits2[numSteps][numRuns];
+    sbitsDeviceModel devices[] = { SBITS_DEVICE_SD, SBITS_DEVICE_NOR };
+    int8_t      d, numDevices = sizeof(devices) / sizeof(sbitsDeviceModel);
+    uint32_t    ienergy[numDevices][numRuns];   /* Estimated nJ per insert */
+    uint32_t    renergy[numDevices][numRuns];   /* Estimated nJ per query */
+    sbitsEnergy energy;
 
     if (seqdata != 1)
     {   /* Open file to read input records */
@@ -372,11 +1586,32 @@ void runalltests_sbits()
         /* 64-bit bitmap */
         state->inBitmap = inBitmapInt64;
         state->updateBitmap = updateBitmapInt64;
+        /* Optional: data and index erase blocks in one file with wear leveling */
+        /*
+        state->parameters |= SBITS_USE_WEAR_LEVEL;
+        state->wearBlocks = (sbitsWearBlock*) malloc(SBITS_WEAR_NUM_BLOCKS(state) * sizeof(sbitsWearBlock));
+        */
+        /* Optional: list of the 16 most recent gaps in keys (threshold is estimated from average key difference) */
+        /*
+        state->parameters |= SBITS_USE_GAP_INDEX;
+        state->maxGaps = 16;
+        state->gaps = (sbitsGap*) malloc(state->maxGaps * sizeof(sbitsGap));
+        state->gapThreshold = 0;
+        */
+        /* Optional: sbitsGet() reads up to 4 pages around predicted page at once */
+        /*
+        state->parameters |= SBITS_USE_PROBE;
+        state->probePages = 4;
+        state->probeBuffer = malloc(state->probePages * state->pageSize);
+        */
         state->compareKey = int32Comparator;
         state->compareData = int32Comparator;
         
         /* Initialize SBITS structure with parameters */
-        if (sbitsInit(state) != 0)
+        SBITS_SIM_BEGIN(SBITS_SIM_OP_INIT);
+        int8_t err = sbitsInit(state);
+        SBITS_SIM_END();
+        if (err != 0)
         {   
             printf("Initialization error.\n");
             return;
@@ -399,7 +1634,9 @@ void runalltests_sbits()
             {        
                 *((int32_t*) recordBuffer) = i;        
                 *((int32_t*) (recordBuffer+4)) = (i%100);    
+                SBITS_SIM_BEGIN(SBITS_SIM_OP_PUT);
                 sbitsPut(state, recordBuffer, (void*) (recordBuffer + 4));  
+                SBITS_SIM_END();
 
                 if (i % stepSize == 0)
                 {           
@@ -436,7 +1673,9 @@ void runalltests_sbits()
                 {	
                     void *buf = (infileBuffer + headerSize + j*state->recordSize);				
                               
+                    SBITS_SIM_BEGIN(SBITS_SIM_OP_PUT);
                     sbitsPut(state, buf, (void*) ((char*) buf + 4));  
+                    SBITS_SIM_END();
                     // if ( i < 100)
                     //    printf("%lu %d %d %d\n", *((uint32_t*) buf), *((int32_t*) (buf+4)), *((int32_t*) (buf+8)), *((int32_t*) (buf+12)));   
 
@@ -468,8 +1707,10 @@ void runalltests_sbits()
         }
 
 doneread:
+        SBITS_SIM_BEGIN(SBITS_SIM_OP_FLUSH);
         sbitsFlush(state);
         fflush(state->file);
+        SBITS_SIM_END();
         uint32_t end = millis();
 
         l = numSteps-1;
@@ -486,6 +1727,14 @@ doneread:
         printf("Records inserted: %lu\n", numRecords);
 
         printStats(state);
+        /* CPU is active for all of elapsed time including waits on storage */
+        for (d=0; d < numDevices; d++)
+        {
+            uint64_t cycles = (uint64_t) (end - start) * (devices[d].cpuFrequency / 1000);
+            printEnergy(state, &devices[d], cycles, numRecords);
+            sbitsEstimateEnergy(state, &devices[d], cycles, &energy);
+            ienergy[d][r] = (uint32_t) ((uint64_t) (energy.ioEnergy + energy.cpuEnergy) * 1000 / numRecords);
+        }
         resetStats(state);
 
         /* Verify that all values can be found and test query performance */    
@@ -497,7 +1746,9 @@ doneread:
             for (i = 0; i < numRecords; i++)          
             { 
                 int32_t key = i;        
+                SBITS_SIM_BEGIN(SBITS_SIM_OP_GET);
                 int8_t result = sbitsGet(state, &key, recordBuffer);
+                SBITS_SIM_END();
                 
                 if (result != 0) 
                     printf("ERROR: Failed to find: %lu\n", key);    
@@ -544,7 +1795,9 @@ doneread:
                         void *buf = (infileBuffer + headerSize + j*state->recordSize);				
                         int32_t* key = (int32_t*)  buf;
                      
+                        SBITS_SIM_BEGIN(SBITS_SIM_OP_GET);
                         int8_t result = sbitsGet(state, key, recordBuffer);  
+                        SBITS_SIM_END();
                         if (result != 0) 
                             printf("ERROR: Failed to find: %lu\n", *key);    
                         if (*((int32_t*) recordBuffer) != *((int32_t*) ((char*) buf+4)))
@@ -589,7 +1842,9 @@ doneread:
                     int32_t key = (num+1)*scaled + minRange;  
                                    
                     // printf("Key :%d\n", key);           
+                    SBITS_SIM_BEGIN(SBITS_SIM_OP_GET);
                     sbitsGet(state, &key, recordBuffer);                          
+                    SBITS_SIM_END();
 
                     if (i % stepS == 0)
                     {                                                         
@@ -646,6 +1901,7 @@ doneread:
                     }          
                     
                     // resetStats(state);                                                             
+                    SBITS_SIM_BEGIN(SBITS_SIM_OP_QUERY);
                     sbitsInitIterator(state, &it);
                     rec = 0;        
                     reads = state->numReads;
@@ -662,6 +1918,7 @@ doneread:
                         }
                         rec++;        
                     }
+                    SBITS_SIM_END();
                    //  printf("Read records: %d\n", rec);                                           
                     
                     printf("Num: %lu KEY: %lu Perc: %lu Records: %lu Reads: %lu Idx reads: %lu\n", i, mv, ((state->numReads-reads)*1000/(state->nextPageWriteId-1)), rec, (state->numReads-reads), (state->numIdxReads-idxreads));     
@@ -695,13 +1952,20 @@ doneread:
         rhits2[l][r] = 0;       
 
         printStats(state); 
+        for (d=0; d < numDevices; d++)
+        {
+            uint64_t cycles = (uint64_t) (end - start) * (devices[d].cpuFrequency / 1000);
+            printEnergy(state, &devices[d], cycles, i);
+            sbitsEstimateEnergy(state, &devices[d], cycles, &energy);
+            renergy[d][r] = i == 0 ? 0 : (uint32_t) ((uint64_t) (energy.ioEnergy + energy.cpuEnergy) * 1000 / i);
+        }
             
         // Optional: Test iterator
         // testIterator(state);
         // printStats(state); 
  
         fclose(state->file);
-        if (state->indexFile != NULL)
+        if (state->indexFile != NULL && state->indexFile != state->file)
             fclose(state->indexFile);
         free(recordBuffer);        
         free(state->buffer);
@@ -712,6 +1976,29 @@ doneread:
 
     // Prints results
     uint32_t sum;
+    for (d=0; d < numDevices; d++)
+    {
+        printf("Energy for %s (nJ):\n", devices[d].name);
+
+        printf("Per insert: ");
+        sum = 0;
+        for (r=0 ; r < numRuns; r++)
+        {
+            sum += ienergy[d][r];
+            printf("\t%lu", ienergy[d][r]);
+        }
+        printf("\t%lu\n", sum/r);
+
+        printf("Per query: ");
+        sum = 0;
+        for (r=0 ; r < numRuns; r++)
+        {
+            sum += renergy[d][r];
+            printf("\t%lu", renergy[d][r]);
+        }
+        printf("\t%lu\n", sum/r);
+    }
+
     for (count_t i=1; i <= numSteps; i++)
     {
         printf("Stats for %lu:\n", i*stepSize);
@@ -0,0 +1,212 @@
+/******************************************************************************/
+/**
+@file		sbitsc.c
+@author		Ramon Lawrence
+@brief		Example client for the SBITS daemon. Inserts records in pipelined
+			batches, then runs a batched get, an aggregate and an iterate.
+			Exits with 1 if a result does not match the inserted records.
+@details	Build on a POSIX host from the repository root:
+			gcc -O2 -Itools/sbitsd -o sbitsc tools/sbitsd/sbitsc.c
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sbitsd.h"
+
+#define BATCH_SIZE		200
+
+/* Number of requests sent before reading responses */
+#define PIPELINE_DEPTH	16
+
+static int fd;
+
+int writeAll(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = write(fd, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int readAll(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	while (len > 0)
+	{
+		ssize_t n = read(fd, p, len);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int sendRequest(uint8_t op, uint16_t count, uint32_t tag, const void *payload, uint32_t length)
+{
+	sbitsdFrameHeader hdr = { length, op, 0, count, tag };
+	if (writeAll(&hdr, sizeof(hdr)) != 0)
+		return -1;
+	return length > 0 ? writeAll(payload, length) : 0;
+}
+
+/* Reads one response frame. Payload buffer must hold SBITSD_MAX_PAYLOAD bytes. */
+int readResponse(sbitsdFrameHeader *hdr, void *payload)
+{
+	if (readAll(hdr, sizeof(*hdr)) != 0 || hdr->length > SBITSD_MAX_PAYLOAD)
+		return -1;
+	return hdr->length > 0 ? readAll(payload, hdr->length) : 0;
+}
+
+int32_t dataValue(int32_t i)
+{
+	return 320 + (i / 50) % 600;
+}
+
+int main(int argc, char **argv)
+{
+	const char *socketPath = argc > 1 ? argv[1] : SBITSD_DEFAULT_SOCKET;
+	int32_t numRecords = argc > 2 ? atoi(argv[2]) : 100000;
+	int32_t startKey = argc > 3 ? atoi(argv[3]) : 1;
+	struct sockaddr_un addr;
+	sbitsdFrameHeader hdr;
+	sbitsdInfo info;
+	uint8_t *payload = malloc(SBITSD_MAX_PAYLOAD);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path)-1);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+	{
+		perror("connect");
+		return 1;
+	}
+
+	sendRequest(SBITSD_OP_INFO, 0, 0, NULL, 0);
+	if (readResponse(&hdr, payload) != 0 || hdr.status != SBITSD_OK)
+		return 1;
+	memcpy(&info, payload, sizeof(info));
+	uint32_t recordSize = info.keySize + info.dataSize;
+	printf("Key size: %d  Data size: %d  Page size: %d  Records: %u\n", info.keySize, info.dataSize, info.pageSize, info.numRecords);
+
+	/* Insert records in batches. Keep up to PIPELINE_DEPTH requests outstanding. */
+	uint8_t *batch = calloc(BATCH_SIZE, recordSize);
+	int32_t key = startKey;
+	uint32_t tag = 0, acked = 0, inserted = 0;
+	while (key < startKey + numRecords || acked < tag)
+	{
+		if (key < startKey + numRecords && tag - acked < PIPELINE_DEPTH)
+		{
+			uint16_t count = 0;
+			for ( ; count < BATCH_SIZE && key < startKey + numRecords; count++, key++)
+			{
+				int32_t val = dataValue(key);
+				memcpy(batch + count * recordSize, &key, 4);
+				memcpy(batch + count * recordSize + 4, &val, 4);
+			}
+			sendRequest(SBITSD_OP_PUT, count, tag++, batch, count * recordSize);
+			continue;
+		}
+		if (readResponse(&hdr, payload) != 0)
+			return 1;
+		if (hdr.status != SBITSD_OK)
+			printf("Put batch %u error: %d after %d records\n", hdr.tag, hdr.status, hdr.count);
+		inserted += hdr.count;
+		acked++;
+	}
+	printf("Inserted: %u\n", inserted);
+
+	sendRequest(SBITSD_OP_FLUSH, 0, tag++, NULL, 0);
+	readResponse(&hdr, payload);
+
+	/* Batched get of every 100th key */
+	uint16_t numKeys = 0;
+	int32_t *keys = (int32_t*) batch;
+	for (int32_t k = startKey; k < startKey + numRecords && numKeys < BATCH_SIZE; k += 100)
+		keys[numKeys++] = k;
+	sendRequest(SBITSD_OP_GET, numKeys, tag++, keys, numKeys * 4);
+	if (readResponse(&hdr, payload) != 0)
+		return 1;
+	int found = 0, correct = 0;
+	for (uint16_t i = 0; i < hdr.count; i++)
+	{
+		uint8_t *entry = payload + i * (1 + info.dataSize);
+		int32_t val;
+		memcpy(&val, entry+1, 4);
+		found += entry[0];
+		correct += entry[0] && val == dataValue(keys[i]);
+	}
+	printf("Get: %d keys  Found: %d  Correct: %d\n", hdr.count, found, correct);
+
+	/* Aggregate and iterate over a data range */
+	sbitsdQuery q = { SBITSD_MIN_DATA | SBITSD_MAX_DATA, 0, 0, 400, 410 };
+	sbitsdAggregate agg;
+	sendRequest(SBITSD_OP_AGGREGATE, 0, tag++, &q, sizeof(q));
+	sendRequest(SBITSD_OP_ITERATE, 0, tag++, &q, sizeof(q));
+	if (readResponse(&hdr, payload) != 0)
+		return 1;
+	memcpy(&agg, payload, sizeof(agg));
+	printf("Aggregate data [%d,%d]: count %u  min %d  max %d  sum %lld\n", q.minData, q.maxData, agg.count, agg.min, agg.max, (long long) agg.sum);
+
+	uint32_t iterCount = 0, bad = 0;
+	do
+	{
+		if (readResponse(&hdr, payload) != 0)
+			return 1;
+		for (uint16_t i = 0; i < hdr.count; i++)
+		{
+			int32_t val;
+			memcpy(&val, payload + i * recordSize + 4, 4);
+			bad += val < q.minData || val > q.maxData;
+		}
+		iterCount += hdr.count;
+	} while (hdr.status == SBITSD_MORE);
+	printf("Iterate data [%d,%d]: %u records  Out of range: %u\n", q.minData, q.maxData, iterCount, bad);
+
+	close(fd);
+	free(batch);
+	free(payload);
+	/* Records inserted by earlier runs may also be in the range, so only the iterate and aggregate counts are compared */
+	return inserted != (uint32_t) numRecords || found != numKeys || correct != numKeys || bad > 0 || iterCount != agg.count;
+}
@@ -0,0 +1,587 @@
+/******************************************************************************/
+/**
+@file		sbitsd.c
+@author		Ramon Lawrence
+@brief		SBITS daemon that serves put, get, iterate and aggregate requests
+			from local processes over a Unix domain socket.
+@details	One event loop owns the SBITS state, page buffers and files, so all
+			requests are applied in arrival order without locking. Requests
+			are batched (many records per frame) and pipelined (many frames
+			per read) so clients amortize system calls across records.
+			Records put are visible to queries after the page is written or
+			after a flush request. The daemon flushes on SIGINT or SIGTERM.
+
+			Build on a POSIX host from the repository root:
+			gcc -O2 -Isrc -o sbitsd tools/sbitsd/sbitsd.c src/sbits.c
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sbits.h"
+#include "sbitsd.h"
+
+#define SBITSD_MAX_CLIENTS		32
+
+/* Stop reading requests from a client while this many response bytes are unsent */
+#define SBITSD_OUT_HIGH_WATER	(4*1024*1024)
+
+/* Records are packed in requests and responses (records on pages may be padded if SBITS_ALIGN_RECORDS) */
+#define SBITSD_RECORD_SIZE		(state->keySize + state->dataSize)
+
+typedef struct {
+	int			fd;
+	uint8_t		*in;				/* Received bytes not yet processed */
+	size_t		inLen;
+	size_t		inCap;
+	uint8_t		*out;				/* Response bytes not yet sent */
+	size_t		outLen;
+	size_t		outPos;
+	size_t		outCap;
+} sbitsdClient;
+
+static sbitsState *state;
+static uint32_t numRecords = 0;
+static int32_t lastKey;
+static volatile sig_atomic_t running = 1;
+
+/* Data value range covered by the 64 bucket bitmap */
+static int32_t bitmapMin = 320;
+static int32_t bitmapMax = 960;
+
+/**
+@brief     	Sets bucket of data value in 64-bit bitmap. Buckets are equal width over [bitmapMin, bitmapMax].
+@param     	data
+                Data value (first 4 bytes)
+@param		bm
+				Bitmap to update
+*/
+void updateBitmapRange64(void *data, void *bm)
+{
+	int32_t val = *((int32_t*) data);
+	int32_t bucket = 0;
+
+	if (val > bitmapMax)
+		bucket = 63;
+	else if (val > bitmapMin)
+		bucket = (int32_t) (((int64_t) (val - bitmapMin) * 64) / (bitmapMax - bitmapMin + 1));
+
+	((uint8_t*) bm)[bucket >> 3] |= 128 >> (bucket & 7);
+}
+
+/**
+@brief     	Returns non-zero if bucket of data value is set in 64-bit bitmap.
+*/
+int8_t inBitmapRange64(void *data, void *bm)
+{
+	uint64_t tmpbm = 0;
+	updateBitmapRange64(data, &tmpbm);
+	return (tmpbm & *((uint64_t*) bm)) != 0;
+}
+
+int8_t int32Compare(void *a, void *b)
+{
+	int32_t x = *((int32_t*) a), y = *((int32_t*) b);
+	if (x < y) return -1;
+	if (x > y) return 1;
+	return 0;
+}
+
+/**
+@brief     	Appends bytes to client response buffer, growing it if needed.
+@return		Return 0 if success, -1 if out of memory.
+*/
+int8_t appendOut(sbitsdClient *c, const void *data, size_t len)
+{
+	if (c->outLen + len > c->outCap)
+	{
+		size_t cap = c->outCap == 0 ? 4096 : c->outCap;
+		while (cap < c->outLen + len)
+			cap *= 2;
+		uint8_t *buf = realloc(c->out, cap);
+		if (buf == NULL)
+			return -1;
+		c->out = buf;
+		c->outCap = cap;
+	}
+	memcpy(c->out + c->outLen, data, len);
+	c->outLen += len;
+	return 0;
+}
+
+/**
+@brief     	Appends response frame header. Payload must be appended after.
+*/
+int8_t appendHeader(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t status, uint16_t count, uint32_t length)
+{
+	sbitsdFrameHeader hdr;
+	hdr.length = length;
+	hdr.op = req->op;
+	hdr.status = status;
+	hdr.count = count;
+	hdr.tag = req->tag;
+	return appendOut(c, &hdr, sizeof(hdr));
+}
+
+/**
+@brief     	Inserts a batch of records. Keys must be increasing. On error, the response count is the number of records inserted.
+*/
+int8_t handlePut(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t *payload)
+{
+	uint16_t i;
+	for (i = 0; i < req->count; i++)
+	{
+		uint8_t *rec = payload + (size_t) i * SBITSD_RECORD_SIZE;
+		int32_t key = *((int32_t*) rec);
+		if (numRecords > 0 && key <= lastKey)
+			return appendHeader(c, req, SBITSD_ERR_ORDER, i, 0);
+
+		if (sbitsPut(state, rec, rec + state->keySize) != 0)
+			return appendHeader(c, req, SBITSD_ERR_PUT, i, 0);
+		lastKey = key;
+		numRecords++;
+	}
+	return appendHeader(c, req, SBITSD_OK, i, 0);
+}
+
+/**
+@brief     	Looks up a batch of keys. Each response entry is a found flag byte followed by data.
+*/
+int8_t handleGet(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t *payload)
+{
+	uint8_t entry[256];
+	uint32_t entrySize = 1 + state->dataSize;
+
+	if (appendHeader(c, req, SBITSD_OK, req->count, entrySize * req->count) != 0)
+		return -1;
+
+	for (uint16_t i = 0; i < req->count; i++)
+	{
+		memset(entry, 0, entrySize);
+		/* Only written pages are searched */
+		if (state->nextPageWriteId > 0 || state->wrappedMemory)
+			entry[0] = sbitsGet(state, payload + (size_t) i * state->keySize, entry+1) == 0;
+		if (appendOut(c, entry, entrySize) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+@brief     	Sets iterator bounds from query.
+*/
+void initQueryIterator(sbitsIterator *it, sbitsdQuery *q)
+{
+	it->minKey = (q->flags & SBITSD_MIN_KEY) ? &q->minKey : NULL;
+	it->maxKey = (q->flags & SBITSD_MAX_KEY) ? &q->maxKey : NULL;
+	it->minData = (q->flags & SBITSD_MIN_DATA) ? &q->minData : NULL;
+	it->maxData = (q->flags & SBITSD_MAX_DATA) ? &q->maxData : NULL;
+	sbitsInitIterator(state, it);
+}
+
+/**
+@brief     	Returns all matching records. The whole iteration is done before the next request so
+			that no other request replaces the iterator page in the read buffer.
+*/
+int8_t handleIterate(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t *payload)
+{
+	sbitsIterator it;
+	sbitsdQuery q;
+	void *key, *data;
+	uint8_t *batch = malloc((size_t) SBITSD_MAX_ITER_BATCH * SBITSD_RECORD_SIZE);
+	uint16_t count = 0;
+	int8_t err = 0;
+
+	if (batch == NULL)
+		return -1;
+
+	memcpy(&q, payload, sizeof(q));
+	initQueryIterator(&it, &q);
+	while (err == 0 && sbitsNext(state, &it, &key, &data))
+	{
+		memcpy(batch + (size_t) count * SBITSD_RECORD_SIZE, key, state->keySize);
+		memcpy(batch + (size_t) count * SBITSD_RECORD_SIZE + state->keySize, data, state->dataSize);
+		if (++count == SBITSD_MAX_ITER_BATCH)
+		{
+			err = appendHeader(c, req, SBITSD_MORE, count, (uint32_t) count * SBITSD_RECORD_SIZE);
+			err |= appendOut(c, batch, (size_t) count * SBITSD_RECORD_SIZE);
+			count = 0;
+		}
+	}
+	if (err == 0)
+	{
+		err = appendHeader(c, req, SBITSD_OK, count, (uint32_t) count * SBITSD_RECORD_SIZE);
+		err |= appendOut(c, batch, (size_t) count * SBITSD_RECORD_SIZE);
+	}
+	free(batch);
+	return err;
+}
+
+/**
+@brief     	Returns count, min, max and sum of first 4 bytes of data of matching records.
+*/
+int8_t handleAggregate(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t *payload)
+{
+	sbitsIterator it;
+	sbitsdQuery q;
+	sbitsdAggregate agg;
+	void *key, *data;
+
+	memcpy(&q, payload, sizeof(q));
+	memset(&agg, 0, sizeof(agg));
+	initQueryIterator(&it, &q);
+	while (sbitsNext(state, &it, &key, &data))
+	{
+		int32_t val = *((int32_t*) data);
+		if (agg.count == 0 || val < agg.min)
+			agg.min = val;
+		if (agg.count == 0 || val > agg.max)
+			agg.max = val;
+		agg.sum += val;
+		agg.count++;
+	}
+
+	if (appendHeader(c, req, SBITSD_OK, 1, sizeof(agg)) != 0)
+		return -1;
+	return appendOut(c, &agg, sizeof(agg));
+}
+
+/**
+@brief     	Checks payload size and performs one request.
+@return		Return 0 if success, -1 if client must be closed.
+*/
+int8_t handleRequest(sbitsdClient *c, sbitsdFrameHeader *req, uint8_t *payload)
+{
+	uint32_t expected;
+
+	switch (req->op)
+	{
+		case SBITSD_OP_INFO:		expected = 0;	break;
+		case SBITSD_OP_PUT:			expected = (uint32_t) req->count * SBITSD_RECORD_SIZE;	break;
+		case SBITSD_OP_GET:			expected = (uint32_t) req->count * state->keySize;	break;
+		case SBITSD_OP_ITERATE:
+		case SBITSD_OP_AGGREGATE:	expected = sizeof(sbitsdQuery);	break;
+		case SBITSD_OP_FLUSH:		expected = 0;	break;
+		default:
+			return appendHeader(c, req, SBITSD_ERR_OP, 0, 0);
+	}
+	if (req->length != expected)
+		return appendHeader(c, req, SBITSD_ERR_SIZE, 0, 0);
+
+	switch (req->op)
+	{
+		case SBITSD_OP_INFO:
+		{
+			sbitsdInfo info;
+			info.keySize = state->keySize;
+			info.dataSize = state->dataSize;
+			info.pageSize = state->pageSize;
+			info.numRecords = numRecords;
+			info.numReads = state->numReads;
+			info.numWrites = state->numWrites;
+			if (appendHeader(c, req, SBITSD_OK, 1, sizeof(info)) != 0)
+				return -1;
+			return appendOut(c, &info, sizeof(info));
+		}
+		case SBITSD_OP_PUT:			return handlePut(c, req, payload);
+		case SBITSD_OP_GET:			return handleGet(c, req, payload);
+		case SBITSD_OP_ITERATE:		return handleIterate(c, req, payload);
+		case SBITSD_OP_AGGREGATE:	return handleAggregate(c, req, payload);
+		default:
+			if (SBITS_GET_COUNT(state->buffer) > 0)
+				sbitsFlush(state);
+			return appendHeader(c, req, SBITSD_OK, 0, 0);
+	}
+}
+
+/**
+@brief     	Performs all complete requests received from client.
+@return		Return 0 if success, -1 if client must be closed.
+*/
+int8_t processInput(sbitsdClient *c)
+{
+	size_t pos = 0;
+	sbitsdFrameHeader req;
+
+	while (c->inLen - pos >= sizeof(req) && c->outLen - c->outPos < SBITSD_OUT_HIGH_WATER)
+	{
+		memcpy(&req, c->in + pos, sizeof(req));
+		if (req.length > SBITSD_MAX_PAYLOAD)
+			return -1;
+		if (c->inLen - pos - sizeof(req) < req.length)
+			break;		/* Payload not fully received */
+
+		if (handleRequest(c, &req, c->in + pos + sizeof(req)) != 0)
+			return -1;
+		pos += sizeof(req) + req.length;
+	}
+
+	memmove(c->in, c->in + pos, c->inLen - pos);
+	c->inLen -= pos;
+	return 0;
+}
+
+/**
+@brief     	Reads available bytes from client.
+@return		Return 0 if success, -1 if client closed or error.
+*/
+int8_t readClient(sbitsdClient *c)
+{
+	if (c->inCap - c->inLen < 4096)
+	{
+		size_t cap = c->inCap == 0 ? 65536 : c->inCap * 2;
+		if (cap > SBITSD_MAX_PAYLOAD + 2*sizeof(sbitsdFrameHeader) + 65536)
+			cap = SBITSD_MAX_PAYLOAD + 2*sizeof(sbitsdFrameHeader) + 65536;
+		if (cap > c->inCap)
+		{
+			uint8_t *buf = realloc(c->in, cap);
+			if (buf == NULL)
+				return -1;
+			c->in = buf;
+			c->inCap = cap;
+		}
+	}
+	if (c->inLen == c->inCap)
+		return 0;		/* Full until requests are processed */
+
+	ssize_t n = read(c->fd, c->in + c->inLen, c->inCap - c->inLen);
+	if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+		return -1;
+	if (n > 0)
+		c->inLen += n;
+	return 0;
+}
+
+/**
+@brief     	Sends pending response bytes to client.
+@return		Return 0 if success, -1 if error.
+*/
+int8_t writeClient(sbitsdClient *c)
+{
+	while (c->outPos < c->outLen)
+	{
+		ssize_t n = write(c->fd, c->out + c->outPos, c->outLen - c->outPos);
+		if (n < 0)
+			return (errno == EINTR || errno == EAGAIN) ? 0 : -1;
+		c->outPos += n;
+	}
+	c->outPos = 0;
+	c->outLen = 0;
+	return 0;
+}
+
+void closeClient(sbitsdClient *c)
+{
+	close(c->fd);
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof(*c));
+	c->fd = -1;
+}
+
+void stopRunning(int sig)
+{
+	(void) sig;
+	running = 0;
+}
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [-s socket] [-D directory] [-d dataSize] [-p pageSize] [-n numPages] [-b buffers] [-e eraseSize] [-i] [-l bitmapMin] [-h bitmapMax]\n", prog);
+	printf("  -i  Use index of data page bitmaps\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *socketPath = SBITSD_DEFAULT_SOCKET;
+	const char *dir = NULL;
+	int dataSize = 12, pageSize = 512, buffers = 4, eraseSize = 4, useIndex = 0;
+	long numPages = 10000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:D:d:p:n:b:e:il:h:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':	socketPath = optarg;	break;
+			case 'D':	dir = optarg;	break;
+			case 'd':	dataSize = atoi(optarg);	break;
+			case 'p':	pageSize = atoi(optarg);	break;
+			case 'n':	numPages = atol(optarg);	break;
+			case 'b':	buffers = atoi(optarg);	break;
+			case 'e':	eraseSize = atoi(optarg);	break;
+			case 'i':	useIndex = 1;	break;
+			case 'l':	bitmapMin = atoi(optarg);	break;
+			case 'h':	bitmapMax = atoi(optarg);	break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (dataSize < 4 || dataSize > 255 || bitmapMax <= bitmapMin || buffers < (useIndex ? 4 : 2))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (dir != NULL && chdir(dir) != 0)
+	{
+		perror("chdir");
+		return 1;
+	}
+
+	/* Configure SBITS state */
+	state = (sbitsState*) calloc(1, sizeof(sbitsState));
+	state->keySize = 4;
+	state->dataSize = dataSize;
+	state->pageSize = pageSize;
+	state->bufferSizeInBlocks = buffers;
+	state->buffer = calloc(buffers, pageSize);
+	state->startAddress = 0;
+	state->endAddress = (uint32_t) pageSize * numPages;
+	state->eraseSizeInPages = eraseSize;
+	state->parameters = SBITS_USE_BMAP | (useIndex ? SBITS_USE_INDEX : 0);
+	state->bitmapSize = 8;
+	state->inBitmap = inBitmapRange64;
+	state->updateBitmap = updateBitmapRange64;
+	state->compareKey = int32Compare;
+	state->compareData = int32Compare;
+	if (state->buffer == NULL || sbitsInit(state) != 0)
+	{
+		printf("Initialization error.\n");
+		return 1;
+	}
+
+	/* Setup socket */
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path)-1);
+	unlink(socketPath);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0)
+	{
+		perror("socket");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, stopRunning);
+	signal(SIGTERM, stopRunning);
+	printf("sbitsd listening on %s\n", socketPath);
+
+	sbitsdClient clients[SBITSD_MAX_CLIENTS];
+	struct pollfd fds[SBITSD_MAX_CLIENTS+1];
+	memset(clients, 0, sizeof(clients));
+	for (int i = 0; i < SBITSD_MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while (running)
+	{
+		fds[0].fd = listenFd;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < SBITSD_MAX_CLIENTS; i++)
+		{
+			sbitsdClient *c = &clients[i];
+			fds[i+1].fd = c->fd;
+			fds[i+1].events = c->outLen > c->outPos ? POLLOUT : 0;
+			/* Apply back pressure to clients that are not reading responses */
+			if (c->outLen - c->outPos < SBITSD_OUT_HIGH_WATER)
+				fds[i+1].events |= POLLIN;
+			fds[i+1].revents = 0;
+		}
+
+		if (poll(fds, SBITSD_MAX_CLIENTS+1, 1000) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (fds[0].revents & POLLIN)
+		{
+			int fd = accept(listenFd, NULL, NULL);
+			int i;
+			for (i = 0; fd >= 0 && i < SBITSD_MAX_CLIENTS && clients[i].fd >= 0; i++)
+				;
+			if (fd >= 0 && i == SBITSD_MAX_CLIENTS)
+				close(fd);
+			else if (fd >= 0)
+			{	/* Never block on one client */
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+				clients[i].fd = fd;
+			}
+		}
+
+		for (int i = 0; i < SBITSD_MAX_CLIENTS; i++)
+		{
+			sbitsdClient *c = &clients[i];
+			short ev = fds[i+1].revents;
+			if (c->fd < 0 || fds[i+1].fd != c->fd)
+				continue;
+
+			int8_t err = 0;
+			if (ev & (POLLIN | POLLHUP | POLLERR))
+				err = readClient(c);
+			if (err == 0)
+				err = processInput(c);
+			if (err == 0 && c->outLen > c->outPos)
+				err = writeClient(c);
+			if (err != 0)
+				closeClient(c);
+		}
+	}
+
+	printf("sbitsd stopping. Records: %u\n", numRecords);
+	for (int i = 0; i < SBITSD_MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			closeClient(&clients[i]);
+	close(listenFd);
+	unlink(socketPath);
+
+	if (SBITS_GET_COUNT(state->buffer) > 0)
+		sbitsFlush(state);
+	fclose(state->file);
+	if (state->indexFile != NULL && state->indexFile != state->file)
+		fclose(state->indexFile);
+	free(state->buffer);
+	free(state);
+	return 0;
+}
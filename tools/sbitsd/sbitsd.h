@@ -0,0 +1,108 @@
+/******************************************************************************/
+/**
+@file		sbitsd.h
+@author		Ramon Lawrence
+@brief		Binary protocol for the SBITS daemon (sbitsd) over a Unix domain socket.
+@details	Each request and response is a fixed size frame header followed by
+			length bytes of payload. All integers are in host byte order since
+			clients are on the same machine. Clients may send many requests
+			before reading responses. Responses are returned in request order
+			and carry the tag of their request.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(SBITSD_H_)
+#define SBITSD_H_
+
+#include <stdint.h>
+
+#define SBITSD_DEFAULT_SOCKET	"/tmp/sbitsd.sock"
+
+/* Largest payload of a request or response frame */
+#define SBITSD_MAX_PAYLOAD		(1024*1024)
+
+/* Maximum records in one iterate response frame. Larger results use several frames. */
+#define SBITSD_MAX_ITER_BATCH	256
+
+/* Request operations */
+#define SBITSD_OP_INFO			1	/* Payload: none. Response: sbitsdInfo. */
+#define SBITSD_OP_PUT			2	/* Payload: count records (key then data). Response: none. */
+#define SBITSD_OP_GET			3	/* Payload: count keys. Response: count entries of found flag byte then data. */
+#define SBITSD_OP_ITERATE		4	/* Payload: sbitsdQuery. Response: frames of records, all but last with SBITSD_MORE. */
+#define SBITSD_OP_AGGREGATE		5	/* Payload: sbitsdQuery. Response: sbitsdAggregate. */
+#define SBITSD_OP_FLUSH			6	/* Payload: none. Response: none. Makes buffered records visible to queries. */
+
+/* Response status */
+#define SBITSD_OK				0
+#define SBITSD_MORE				1	/* More response frames follow for this request */
+#define SBITSD_ERR_OP			2	/* Unknown operation */
+#define SBITSD_ERR_SIZE			3	/* Payload size does not match operation and count */
+#define SBITSD_ERR_ORDER		4	/* Put key not greater than previous key. Records before it were inserted. */
+#define SBITSD_ERR_PUT			5	/* sbitsPut() failed (storage error). Records before it were inserted. */
+
+/* Query bound flags */
+#define SBITSD_MIN_KEY			1
+#define SBITSD_MAX_KEY			2
+#define SBITSD_MIN_DATA			4
+#define SBITSD_MAX_DATA			8
+
+typedef struct {
+	uint32_t	length;			/* Payload bytes after header */
+	uint8_t		op;				/* Operation of request (copied to response) */
+	uint8_t		status;			/* Response status (0 in requests) */
+	uint16_t	count;			/* Number of records or keys in payload */
+	uint32_t	tag;			/* Client value copied to response */
+} sbitsdFrameHeader;
+
+typedef struct {
+	uint8_t		keySize;
+	uint8_t		dataSize;
+	uint16_t	pageSize;
+	uint32_t	numRecords;		/* Records inserted since daemon start */
+	uint32_t	numReads;		/* Page reads */
+	uint32_t	numWrites;		/* Page writes */
+} sbitsdInfo;
+
+typedef struct {
+	uint32_t	flags;			/* Bounds used (SBITSD_MIN_KEY, ...) */
+	int32_t		minKey;
+	int32_t		maxKey;
+	int32_t		minData;		/* Data bounds compare the first 4 bytes of data */
+	int32_t		maxData;
+} sbitsdQuery;
+
+typedef struct {
+	uint32_t	count;
+	int32_t		min;			/* Of first 4 bytes of data */
+	int32_t		max;
+	int64_t		sum;
+} sbitsdAggregate;
+
+#endif
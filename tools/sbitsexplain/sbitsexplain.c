@@ -0,0 +1,130 @@
+/******************************************************************************/
+/**
+@file		sbitsexplain.c
+@author		Ramon Lawrence
+@brief		Host tool that compiles a query and prints the plan chosen for a
+			SBITS configuration and amount of stored data.
+@details	Build on a host from the repository root:
+			gcc -O2 -Isrc -o sbitsexplain tools/sbitsexplain/sbitsexplain.c src/sbits_query.c src/sbits.c
+			Example:
+			./sbitsexplain -i -n 100000 "SELECT avg(c1) WHERE time BETWEEN 1000 AND 5000 AND c0 > 30 GROUP BY 5m"
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sbits.h"
+#include "sbits_query.h"
+
+/* Data value range covered by the 64 bucket bitmap */
+static int32_t bitmapMin = 320;
+static int32_t bitmapMax = 960;
+
+void updateBitmapRange64(void *data, void *bm)
+{
+	int32_t val = *((int32_t*) data);
+	int32_t bucket = 0;
+
+	if (val > bitmapMax)
+		bucket = 63;
+	else if (val > bitmapMin)
+		bucket = (int32_t) (((int64_t) (val - bitmapMin) * 64) / (bitmapMax - bitmapMin + 1));
+
+	((uint8_t*) bm)[bucket >> 3] |= 128 >> (bucket & 7);
+}
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [-d dataSize] [-p pageSize] [-i] [-x] [-n records] [-k keyDiff] [-s firstKey] [-l bitmapMin] [-h bitmapMax] query\n", prog);
+	printf("  -i  Use index of data page bitmaps\n");
+	printf("  -x  No data page bitmaps\n");
+}
+
+int main(int argc, char **argv)
+{
+	sbitsState state;
+	sbitsQueryPlan plan;
+	long numRecords = 100000;
+	int opt;
+
+	memset(&state, 0, sizeof(state));
+	state.keySize = 4;
+	state.dataSize = 12;
+	state.pageSize = 512;
+	state.bitmapSize = 8;
+	state.eraseSizeInPages = 4;
+	state.bufferSizeInBlocks = 4;
+	state.parameters = SBITS_USE_BMAP;
+	state.avgKeyDiff = 1;
+	state.updateBitmap = updateBitmapRange64;
+
+	while ((opt = getopt(argc, argv, "d:p:ixn:k:s:l:h:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':	state.dataSize = atoi(optarg);	break;
+			case 'p':	state.pageSize = atoi(optarg);	break;
+			case 'i':	state.parameters |= SBITS_USE_INDEX;	break;
+			case 'x':	state.parameters &= ~SBITS_USE_BMAP;	break;
+			case 'n':	numRecords = atol(optarg);	break;
+			case 'k':	state.avgKeyDiff = atoi(optarg);	break;
+			case 's':	state.minKey = atoi(optarg);	break;
+			case 'l':	bitmapMin = atoi(optarg);	break;
+			case 'h':	bitmapMax = atoi(optarg);	break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind != argc-1 || bitmapMax <= bitmapMin)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Layout and amount of stored data without creating files */
+	if (!SBITS_USING_BMAP(state.parameters))
+		state.parameters &= ~SBITS_USE_INDEX;
+	sbitsInitLayout(&state);
+	state.nextPageId = (numRecords + state.maxRecordsPerPage - 1) / state.maxRecordsPerPage;
+	printf("Records per page: %d  Data pages: %lu  Index: %d\n", state.maxRecordsPerPage, (unsigned long) state.nextPageId,
+				SBITS_USING_INDEX(state.parameters));
+
+	if (sbitsQueryCompile(&state, argv[optind], &plan) != 0)
+	{
+		printf("%s\n%*s^\n", argv[optind], plan.errorOffset, "");
+		return 1;
+	}
+	sbitsQueryExplain(&plan);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/******************************************************************************/
+/**
+@file		sbitslog.c
+@author		Ramon Lawrence
+@brief		Host tool that decodes SBITS telemetry frames into log messages.
+@details	Build on a host from the repository root:
+			gcc -O2 -Isrc -o sbitslog tools/sbitslog/sbitslog.c
+			Input is a capture of device output (file, serial device or stdin).
+			Bytes outside frames are printed unchanged, so printf output on the
+			same serial port is kept. Example:
+			./sbitslog /dev/ttyACM0
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sbits_log.h"
+
+typedef struct {
+	uint8_t 	id;
+	const char 	*format;
+	const char 	*name;
+} eventInfo;
+
+#define EVENT_INFO(e)	{ e, e##_FMT, #e },
+static const eventInfo events[] = { SBITS_EVENT_LIST(EVENT_INFO) };
+
+static const eventInfo* findEvent(uint8_t id)
+{
+	for (size_t i = 0; i < sizeof(events) / sizeof(eventInfo); i++)
+		if (events[i].id == id)
+			return &events[i];
+	return NULL;
+}
+
+/* Reads zigzag varint field. Returns 0 if input ended. */
+static int readField(FILE *in, int32_t *value)
+{
+	uint32_t v = 0;
+	int c, shift = 0;
+
+	do
+	{
+		if ((c = fgetc(in)) == EOF || shift > 28)
+			return 0;
+		v |= (uint32_t) (c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	*value = (int32_t) ((v >> 1) ^ (0 - (v & 1)));
+	return 1;
+}
+
+/* Prints format with fields. Fields are 32-bit so length modifiers of device format are ignored. */
+static void printEvent(const char *format, int32_t *fields, int numFields)
+{
+	char spec[16];
+	int f = 0;
+
+	for (const char *p = format; *p != 0; p++)
+	{
+		if (*p != '%')
+		{
+			putchar(*p);
+			continue;
+		}
+		if (*++p == '%')
+		{
+			putchar('%');
+			continue;
+		}
+		size_t len = 0;
+		spec[len++] = '%';
+		while (*p != 0 && strchr("-+ #0123456789.", *p) != NULL && len < sizeof(spec) - 3)
+			spec[len++] = *p++;
+		while (*p == 'l' || *p == 'h')
+			p++;
+		if (*p == 0)
+			break;
+		spec[len++] = 'l';
+		spec[len++] = *p;
+		spec[len] = 0;
+
+		int32_t v = f < numFields ? fields[f++] : 0;
+		if (*p == 'u' || *p == 'x' || *p == 'X')
+			printf(spec, (unsigned long) (uint32_t) v);
+		else
+			printf(spec, (long) v);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in = stdin;
+	int c;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0))
+	{
+		printf("Usage: %s [capture]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 2 && (in = fopen(argv[1], "rb")) == NULL)
+	{
+		printf("Unable to open: %s\n", argv[1]);
+		return 1;
+	}
+
+	while ((c = fgetc(in)) != EOF)
+	{
+		if (c != SBITS_TELEMETRY_SYNC)
+		{
+			putchar(c);
+			continue;
+		}
+
+		int id = fgetc(in);
+		int numFields = fgetc(in);
+		if (id == EOF || numFields == EOF || numFields > SBITS_TELEMETRY_MAX_FIELDS)
+		{
+			printf("[Invalid frame]\n");
+			continue;
+		}
+
+		int32_t fields[SBITS_TELEMETRY_MAX_FIELDS];
+		int i;
+		for (i = 0; i < numFields && readField(in, &fields[i]); i++)
+			;
+		if (i < numFields)
+			break;
+
+		const eventInfo *event = findEvent((uint8_t) id);
+		if (event != NULL)
+			printEvent(event->format, fields, numFields);
+		else
+		{
+			printf("[Event %d]", id);
+			for (i = 0; i < numFields; i++)
+				printf(" %ld", (long) fields[i]);
+			printf("\n");
+		}
+		fflush(stdout);
+	}
+
+	if (in != stdin)
+		fclose(in);
+	return 0;
+}
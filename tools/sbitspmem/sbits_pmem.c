@@ -0,0 +1,111 @@
+/******************************************************************************/
+/**
+@file		sbits_pmem.c
+@author		Ramon Lawrence
+@brief		Persistent memory for SBITS emulated by a memory mapped file.
+@details	Build on a POSIX host with the application and src/sbits.c:
+			gcc -O2 -Isrc -Itools/sbitspmem app.c tools/sbitspmem/sbits_pmem.c src/sbits.c
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sbits_pmem.h"
+
+/**
+@brief     	Reads bytes of mapped file.
+*/
+static void mapRead(void *pmem, uint32_t offset, void *data, uint32_t length)
+{
+	memcpy(data, (uint8_t*) pmem + offset, length);
+}
+
+/**
+@brief     	Writes bytes of mapped file. Writes are in the file once they return, even if the process crashes.
+*/
+static void mapWrite(void *pmem, uint32_t offset, const void *data, uint32_t length)
+{
+	memcpy((uint8_t*) pmem + offset, data, length);
+}
+
+int8_t sbitsPmemMapFile(sbitsState *state, const char *path)
+{
+	uint32_t size = sbitsPmemSize(state);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		printf("Error: Unable to open persistent memory file.\n");
+		return -1;
+	}
+
+	struct stat st;
+	int8_t created = fstat(fd, &st) != 0 || st.st_size < (off_t) size;
+	if (created && ftruncate(fd, size) != 0)
+	{
+		printf("Error: Unable to size persistent memory file.\n");
+		close(fd);
+		return -1;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("Error: Unable to map persistent memory file.\n");
+		return -1;
+	}
+
+	/* New memory has no valid slot */
+	if (created)
+		memset(map, 0xFF, size);
+
+	state->pmem = map;
+	state->pmemRead = mapRead;
+	state->pmemWrite = mapWrite;
+	state->parameters |= SBITS_USE_PMEM;
+	return 0;
+}
+
+void sbitsPmemUnmap(sbitsState *state)
+{
+	if (state->pmem != NULL)
+		munmap(state->pmem, sbitsPmemSize(state));
+	state->pmem = NULL;
+	state->pmemRead = NULL;
+	state->pmemWrite = NULL;
+	state->parameters &= ~SBITS_USE_PMEM;
+}
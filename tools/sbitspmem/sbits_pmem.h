@@ -0,0 +1,63 @@
+/******************************************************************************/
+/**
+@file		sbits_pmem.h
+@author		Ramon Lawrence
+@brief		Persistent memory for SBITS emulated by a memory mapped file.
+@details	Stands in for an FRAM or MRAM chip on a POSIX host. Mapping a
+			file sets SBITS_USE_PMEM. Records put before a crash are
+			restored by the next sbitsInit() with the same file.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(SBITS_PMEM_H_)
+#define SBITS_PMEM_H_
+
+#include "sbits.h"
+
+/**
+@brief     	Maps file as persistent memory of state. File is created (cleared) if it is smaller than
+			sbitsPmemSize(). Call before sbitsInit() after setting page size, storage addresses, erase size
+			and parameters. Sets SBITS_USE_PMEM.
+@param     	state
+                SBITS state structure
+@param		path
+				Path of persistent memory file
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsPmemMapFile(sbitsState *state, const char *path);
+
+/**
+@brief     	Unmaps persistent memory file of state.
+@param     	state
+                SBITS state structure
+*/
+void sbitsPmemUnmap(sbitsState *state);
+
+#endif
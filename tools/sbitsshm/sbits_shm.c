@@ -0,0 +1,441 @@
+/******************************************************************************/
+/**
+@file		sbits_shm.c
+@author		Ramon Lawrence
+@brief		Shared memory publishing of SBITS storage state so that reader
+			processes can run gets and iterators on memory mapped files.
+@details	Build on a POSIX host with the application and src/sbits.c:
+			gcc -O2 -Isrc -Itools/sbitsshm app.c tools/sbitsshm/sbits_shm.c src/sbits.c
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sbits_shm.h"
+
+#define SBITS_SHM_MAGIC		0x53425348
+
+/* Parameters that change page layout or how pages are decoded. Readers require same values as writer. */
+#define SBITS_SHM_LAYOUT_PARAMETERS	(SBITS_USE_INDEX | SBITS_USE_MAX_MIN | SBITS_USE_SUM | SBITS_USE_BMAP | SBITS_USE_FINE_BMAP | SBITS_USE_RECORD_DIR \
+			| SBITS_USE_HASH_BMAP | SBITS_USE_MULTI_DIM | SBITS_USE_DERIVED_BMAP | SBITS_USE_COMPRESSED_INDEX | SBITS_USE_RANGE_BMAP | SBITS_USE_ADAPTIVE_BMAP)
+
+/**
+@brief     	Starts update of shared header. Readers that copy the header during the update retry.
+*/
+static void beginUpdate(sbitsShmHeader *hdr)
+{
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+@brief     	Ends update of shared header.
+*/
+static void endUpdate(sbitsShmHeader *hdr)
+{
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+@brief     	Copies ring state of writer into shared header.
+*/
+static void publish(sbitsShm *shm, sbitsState *state)
+{
+	sbitsShmHeader *hdr = shm->header;
+
+	/* Pages must be in the files before readers can use the new state */
+	fflush(state->file);
+	if (state->indexFile != NULL)
+		fflush(state->indexFile);
+
+	beginUpdate(hdr);
+	hdr->nextPageId = state->nextPageId;
+	hdr->nextPageWriteId = state->nextPageWriteId;
+	hdr->firstDataPage = state->firstDataPage;
+	hdr->firstDataPageId = state->firstDataPageId;
+	hdr->erasedEndPage = state->erasedEndPage;
+	hdr->minKey = state->minKey;
+	hdr->avgKeyDiff = state->avgKeyDiff;
+	hdr->nextIdxPageId = state->nextIdxPageId;
+	hdr->nextIdxPageWriteId = state->nextIdxPageWriteId;
+	hdr->firstIdxPage = state->firstIdxPage;
+	hdr->erasedEndIdxPage = state->erasedEndIdxPage;
+	hdr->wrappedMemory = state->wrappedMemory;
+	hdr->wrappedIdxMemory = state->wrappedIdxMemory;
+	endUpdate(hdr);
+}
+
+/**
+@brief     	Publishes the logical ids of the pages about to be written before they overwrite older pages.
+@param		dataPage
+				1 if a data page will be written
+@param		indexPage
+				1 if an index page will be written
+*/
+static void publishWriting(sbitsShm *shm, sbitsState *state, int8_t dataPage, int8_t indexPage)
+{
+	beginUpdate(shm->header);
+	if (dataPage)
+		shm->header->writingPageId = state->nextPageId;
+	if (indexPage)
+		shm->header->writingIdxPageId = state->nextIdxPageId;
+	endUpdate(shm->header);
+}
+
+/**
+@brief     	Publishes page ids that the next flush or put that fills the output page will write.
+*/
+static void prepareWrite(sbitsShm *shm, sbitsState *state)
+{
+	int8_t indexPage = 0;
+	if (state->indexFile != NULL)
+	{
+		void *buf = state->buffer + state->pageSize*SBITS_INDEX_WRITE_BUFFER;
+		if (SBITS_USING_COMPRESSED_INDEX(state->parameters))
+			indexPage = SBITS_GET_IDX_USED(buf) + 2 * (1 + state->bitmapSize) > state->pageSize;	/* Record size is not known yet */
+		else
+			indexPage = SBITS_GET_COUNT(buf)+1 >= state->maxIdxRecordsPerPage;
+	}
+	publishWriting(shm, state, 1, indexPage);
+}
+
+/**
+@brief     	Creates shared header for an initialized writer and publishes the current state.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure (after sbitsInit())
+@param		path
+				Path of shared header file (e.g. /dev/shm/sbits)
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmCreate(sbitsShm *shm, sbitsState *state, const char *path)
+{
+	memset(shm, 0, sizeof(sbitsShm));
+	if (SBITS_USING_WEAR_LEVEL(state->parameters))
+	{	/* Readers map files and do not have the block map */
+		printf("Error: Shared readers do not support wear leveling.\n");
+		return -1;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(sbitsShmHeader)) != 0)
+	{
+		printf("Error: Can't create shared header %s\n", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	shm->header = mmap(NULL, sizeof(sbitsShmHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->header == MAP_FAILED)
+	{
+		shm->header = NULL;
+		return -1;
+	}
+
+	sbitsShmHeader *hdr = shm->header;
+	beginUpdate(hdr);
+	hdr->endAddress = state->endAddress;
+	hdr->pageSize = state->pageSize;
+	hdr->parameters = state->parameters & SBITS_SHM_LAYOUT_PARAMETERS;
+	hdr->recordSize = state->recordSize;
+	hdr->bitmapSize = state->bitmapSize;
+	hdr->rangeBitmapDir = state->rangeBitmapDir;
+	hdr->startDataPage = state->startDataPage;
+	hdr->endDataPage = state->endDataPage;
+	hdr->startIdxPage = state->startIdxPage;
+	hdr->endIdxPage = state->endIdxPage;
+	hdr->writingPageId = state->nextPageId > 0 ? state->nextPageId-1 : 0;
+	hdr->writingIdxPageId = state->nextIdxPageId > 0 ? state->nextIdxPageId-1 : 0;
+	endUpdate(hdr);
+	publish(shm, state);
+
+	/* Magic is set last so readers never see a partially initialized header */
+	__atomic_store_n(&hdr->magic, SBITS_SHM_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+@brief     	Puts a record and publishes the ring state if a page was written.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+@param     	key
+                Key for record
+@param     	data
+                Data for record
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmPut(sbitsShm *shm, sbitsState *state, void *key, void *data)
+{
+	id_t numWrites = state->numWrites;
+
+	/* Put writes the output page when it is full */
+	if (SBITS_GET_COUNT(state->buffer) >= state->maxRecordsPerPage)
+		prepareWrite(shm, state);
+
+	int8_t err = sbitsPut(state, key, data);
+	if (numWrites != state->numWrites)
+		publish(shm, state);
+	return err;
+}
+
+/**
+@brief     	Flushes output buffer and publishes the ring state so readers see all records.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmFlush(sbitsShm *shm, sbitsState *state)
+{
+	if (SBITS_GET_COUNT(state->buffer) == 0)
+		return 0;
+
+	/* Flush also writes the partial index page */
+	publishWriting(shm, state, 1, state->indexFile != NULL);
+	int8_t err = sbitsFlush(state);
+	publish(shm, state);
+	return err;
+}
+
+/**
+@brief     	Maps file read-only.
+@return		Return mapping or NULL if error.
+*/
+static void* mapFile(SD_FILE *fp, size_t size)
+{
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+@brief     	Opens a reader. The state must have the same sizes, parameters and functions as the writer
+			and a buffer of at least 2 pages (4 if using index). sbitsInit() is not called for a reader.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+@param		path
+				Path of shared header file
+@param		dataPath
+				Path of writer data file (datafile.bin)
+@param		indexPath
+				Path of writer index file (idxfile.bin) or NULL if not using index
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmOpenReader(sbitsShm *shm, sbitsState *state, const char *path, const char *dataPath, const char *indexPath)
+{
+	memset(shm, 0, sizeof(sbitsShm));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		printf("Error: Can't open shared header %s\n", path);
+		return -1;
+	}
+	shm->header = mmap(NULL, sizeof(sbitsShmHeader), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->header == MAP_FAILED)
+	{
+		shm->header = NULL;
+		return -1;
+	}
+
+	sbitsShmHeader *hdr = shm->header;
+	if (!SBITS_USING_INDEX(state->parameters))
+		indexPath = NULL;
+	sbitsInitLayout(state);
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SBITS_SHM_MAGIC || hdr->endAddress != state->endAddress
+			|| hdr->pageSize != state->pageSize || hdr->parameters != (state->parameters & SBITS_SHM_LAYOUT_PARAMETERS)
+			|| hdr->recordSize != state->recordSize || hdr->bitmapSize != state->bitmapSize || hdr->rangeBitmapDir != state->rangeBitmapDir)
+	{
+		printf("Error: Reader configuration does not match writer.\n");
+		munmap(shm->header, sizeof(sbitsShmHeader));
+		shm->header = NULL;
+		return -1;
+	}
+
+	state->startDataPage = hdr->startDataPage;
+	state->endDataPage = hdr->endDataPage;
+	state->startIdxPage = hdr->startIdxPage;
+	state->endIdxPage = hdr->endIdxPage;
+	state->queryCache = NULL;
+	state->queryCacheSize = 0;
+	state->parameters &= SBITS_SHM_LAYOUT_PARAMETERS;
+	state->bufferedPageId = -1;
+	state->bufferedIndexPageId = -1;
+	state->numHotPages = 0;
+	state->prefetching = 0;
+	state->indexFile = NULL;
+	state->indexMap = NULL;
+
+	/* Files are only opened to map them. Pages are read from the mappings. */
+	shm->mapSize = state->endAddress;
+	state->file = fopen(dataPath, "rb");
+	state->dataMap = state->file != NULL ? mapFile(state->file, shm->mapSize) : NULL;
+	if (indexPath != NULL)
+	{
+		state->indexFile = fopen(indexPath, "rb");
+		state->indexMap = state->indexFile != NULL ? mapFile(state->indexFile, shm->mapSize) : NULL;
+	}
+	if (state->dataMap == NULL || (indexPath != NULL && state->indexMap == NULL))
+	{
+		printf("Error: Can't map data files.\n");
+		sbitsShmClose(shm, state);
+		return -1;
+	}
+
+	resetStats(state);
+	shm->seq = 0;
+	sbitsShmBegin(shm, state);
+	return 0;
+}
+
+/**
+@brief     	Copies the published ring state into reader state. Call before each get or iterator.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+*/
+void sbitsShmBegin(sbitsShm *shm, sbitsState *state)
+{
+	sbitsShmHeader *hdr = shm->header;
+	sbitsShmHeader copy;
+	uint32_t seq;
+
+	do
+	{
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;		/* Writer is updating */
+		memcpy(&copy, hdr, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED));
+
+	state->nextPageId = copy.nextPageId;
+	state->nextPageWriteId = copy.nextPageWriteId;
+	state->firstDataPage = copy.firstDataPage;
+	state->firstDataPageId = copy.firstDataPageId;
+	state->erasedEndPage = copy.erasedEndPage;
+	state->minKey = copy.minKey;
+	state->avgKeyDiff = copy.avgKeyDiff;
+	state->nextIdxPageId = copy.nextIdxPageId;
+	state->nextIdxPageWriteId = copy.nextIdxPageWriteId;
+	state->firstIdxPage = copy.firstIdxPage;
+	state->erasedEndIdxPage = copy.erasedEndIdxPage;
+	state->wrappedMemory = copy.wrappedMemory;
+	state->wrappedIdxMemory = copy.wrappedIdxMemory;
+
+	/* Buffered pages may have been overwritten since they were read */
+	if (seq != shm->seq)
+	{
+		state->bufferedPageId = -1;
+		state->bufferedIndexPageId = -1;
+	}
+	shm->seq = seq;
+	shm->firstDataPageId = copy.firstDataPageId;
+	/* Oldest index page id still in the index ring */
+	id_t numIdxPages = state->endIdxPage - state->startIdxPage + 1;
+	shm->firstIdxPageId = copy.nextIdxPageId > numIdxPages ? copy.nextIdxPageId - numIdxPages : 0;
+}
+
+/**
+@brief     	Checks if the writer overwrote pages that the query since sbitsShmBegin() may have read.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+@return		Return 1 if query results may be invalid and query must be repeated, 0 otherwise.
+*/
+int8_t sbitsShmRetry(sbitsShm *shm, sbitsState *state)
+{
+	sbitsShmHeader *hdr = shm->header;
+	id_t writingPageId, writingIdxPageId;
+	uint32_t seq;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	do
+	{
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		writingPageId = hdr->writingPageId;
+		writingIdxPageId = hdr->writingIdxPageId;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED));
+
+	/* A page write replaces the page with logical id one ring size smaller */
+	id_t numDataPages = state->endDataPage - state->startDataPage;
+	if (writingPageId >= numDataPages && writingPageId - numDataPages >= shm->firstDataPageId)
+		return 1;
+
+	/* Index ring size is as in sbits.c where endIdxPage is the last index page */
+	id_t numIdxPages = state->endIdxPage - state->startIdxPage + 1;
+	if (state->indexFile != NULL && writingIdxPageId >= numIdxPages && writingIdxPageId - numIdxPages >= shm->firstIdxPageId)
+		return 1;
+	return 0;
+}
+
+/**
+@brief     	Unmaps shared header and files. Closes reader files.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+*/
+void sbitsShmClose(sbitsShm *shm, sbitsState *state)
+{
+	if (shm->header != NULL)
+		munmap(shm->header, sizeof(sbitsShmHeader));
+	shm->header = NULL;
+
+	if (shm->mapSize != 0)
+	{	/* Reader */
+		if (state->dataMap != NULL)
+			munmap(state->dataMap, shm->mapSize);
+		state->dataMap = NULL;
+		if (state->indexMap != NULL)
+			munmap(state->indexMap, shm->mapSize);
+		state->indexMap = NULL;
+		if (state->file != NULL)
+			fclose(state->file);
+		if (state->indexFile != NULL)
+			fclose(state->indexFile);
+		state->file = NULL;
+		state->indexFile = NULL;
+	}
+}
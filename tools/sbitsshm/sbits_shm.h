@@ -0,0 +1,170 @@
+/******************************************************************************/
+/**
+@file		sbits_shm.h
+@author		Ramon Lawrence
+@brief		Shared memory publishing of SBITS storage state so that reader
+			processes can run gets and iterators on memory mapped files.
+@details	The writer process publishes the data and index ring state in a
+			small shared header under a sequence lock after each page write.
+			Readers map the data and index files read-only and copy the ring
+			state before each query. The writer never waits for readers.
+			Readers retry a query if the writer overwrote a page the query
+			may have read.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#if !defined(SBITS_SHM_H_)
+#define SBITS_SHM_H_
+
+#include "sbits.h"
+
+/* Ring state published by writer. Copied into reader state before each query. */
+typedef struct {
+	uint32_t 	magic;
+	uint32_t 	seq;					/* Sequence lock. Odd while writer is updating. */
+	uint32_t 	endAddress;				/* Layout for reader validation */
+	count_t 	pageSize;
+	uint32_t 	parameters;
+	int8_t 		recordSize;
+	int8_t 		bitmapSize;
+	int8_t 		rangeBitmapDir;
+	id_t 		startDataPage;
+	id_t 		endDataPage;
+	id_t 		startIdxPage;
+	id_t 		endIdxPage;
+	id_t 		nextPageId;
+	id_t 		nextPageWriteId;
+	id_t 		firstDataPage;
+	id_t 		firstDataPageId;
+	id_t 		erasedEndPage;
+	int32_t 	minKey;
+	id_t 		avgKeyDiff;
+	id_t 		nextIdxPageId;
+	id_t 		nextIdxPageWriteId;
+	id_t 		firstIdxPage;
+	id_t 		erasedEndIdxPage;
+	int8_t 		wrappedMemory;
+	int8_t 		wrappedIdxMemory;
+	id_t 		writingPageId;			/* Logical id of data page being or last written */
+	id_t 		writingIdxPageId;		/* Logical id of index page being or last written */
+} sbitsShmHeader;
+
+typedef struct {
+	sbitsShmHeader	*header;			/* Shared header mapping */
+	void 		*dataMap;				/* Reader mapping of data file */
+	void 		*indexMap;				/* Reader mapping of index file */
+	size_t 		mapSize;				/* Size of data and index mappings */
+	id_t 		firstDataPageId;		/* Reader: first data page id when query started */
+	id_t 		firstIdxPageId;			/* Reader: first index page id when query started */
+	uint32_t 	seq;					/* Reader: sequence number of ring state in reader state */
+} sbitsShm;
+
+/**
+@brief     	Creates shared header for an initialized writer and publishes the current state.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure (after sbitsInit())
+@param		path
+				Path of shared header file (e.g. /dev/shm/sbits)
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmCreate(sbitsShm *shm, sbitsState *state, const char *path);
+
+/**
+@brief     	Puts a record and publishes the ring state if a page was written.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+@param     	key
+                Key for record
+@param     	data
+                Data for record
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmPut(sbitsShm *shm, sbitsState *state, void *key, void *data);
+
+/**
+@brief     	Flushes output buffer and publishes the ring state so readers see all records.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmFlush(sbitsShm *shm, sbitsState *state);
+
+/**
+@brief     	Opens a reader. The state must have the same sizes, parameters and functions as the writer
+			and a buffer of at least 2 pages (4 if using index). sbitsInit() is not called for a reader.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+@param		path
+				Path of shared header file
+@param		dataPath
+				Path of writer data file (datafile.bin)
+@param		indexPath
+				Path of writer index file (idxfile.bin) or NULL if not using index
+@return		Return 0 if success. Non-zero value if error.
+*/
+int8_t sbitsShmOpenReader(sbitsShm *shm, sbitsState *state, const char *path, const char *dataPath, const char *indexPath);
+
+/**
+@brief     	Copies the published ring state into reader state. Call before each get or iterator.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+*/
+void sbitsShmBegin(sbitsShm *shm, sbitsState *state);
+
+/**
+@brief     	Checks if the writer overwrote pages that the query since sbitsShmBegin() may have read.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure of reader
+@return		Return 1 if query results may be invalid and query must be repeated, 0 otherwise.
+*/
+int8_t sbitsShmRetry(sbitsShm *shm, sbitsState *state);
+
+/**
+@brief     	Unmaps shared header and files. Closes reader files.
+@param     	shm
+                Shared memory structure
+@param     	state
+                SBITS state structure
+*/
+void sbitsShmClose(sbitsShm *shm, sbitsState *state);
+
+#endif
@@ -0,0 +1,240 @@
+/******************************************************************************/
+/**
+@file		sbitsshmdemo.c
+@author		Ramon Lawrence
+@brief		Example driver for shared memory readers. A writer process inserts
+			records into a small store that wraps several times while a reader
+			process runs data range queries with sbitsShmBegin() and sbitsShmRetry().
+@details	Build and run on a POSIX host from the repository root:
+			gcc -O2 -Isrc -Itools/sbitsshm -o sbitsshmdemo tools/sbitsshm/sbitsshmdemo.c tools/sbitsshm/sbits_shm.c src/sbits.c
+			./sbitsshmdemo [numRecords]
+			Exits with 1 if a query that did not need a retry returned a wrong record.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sbits_shm.h"
+
+#define HEADER_PATH		"/tmp/sbitsshmdemo"
+
+/* Small store so that data and index rings wrap while the reader runs */
+#define PAGE_SIZE		512
+#define NUM_PAGES		200
+
+int32_t dataValue(int32_t key)
+{
+	return 320 + (key * 37) % 640;
+}
+
+/**
+@brief     	Sets bucket of data value in 64-bit bitmap. Buckets are equal width over [320, 960).
+*/
+void updateBitmap64(void *data, void *bm)
+{
+	int32_t bucket = (*((int32_t*) data) - 320) / 10;
+
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket > 63)
+		bucket = 63;
+	((uint8_t*) bm)[bucket >> 3] |= 128 >> (bucket & 7);
+}
+
+/**
+@brief     	Returns non-zero if bucket of data value is set in 64-bit bitmap.
+*/
+int8_t inBitmap64(void *data, void *bm)
+{
+	uint64_t tmpbm = 0;
+	updateBitmap64(data, &tmpbm);
+	return (tmpbm & *((uint64_t*) bm)) != 0;
+}
+
+int8_t int32Compare(void *a, void *b)
+{
+	int32_t x = *((int32_t*) a), y = *((int32_t*) b);
+	if (x < y) return -1;
+	if (x > y) return 1;
+	return 0;
+}
+
+/**
+@brief     	Allocates state. Writer and reader use the same configuration.
+*/
+sbitsState* createState()
+{
+	sbitsState *state = (sbitsState*) calloc(1, sizeof(sbitsState));
+	state->keySize = 4;
+	state->dataSize = 12;
+	state->pageSize = PAGE_SIZE;
+	state->bufferSizeInBlocks = 4;
+	state->buffer = calloc(4, PAGE_SIZE);
+	state->startAddress = 0;
+	state->endAddress = PAGE_SIZE * NUM_PAGES;
+	state->eraseSizeInPages = 4;
+	state->parameters = SBITS_USE_BMAP | SBITS_USE_INDEX;
+	state->bitmapSize = 8;
+	state->inBitmap = inBitmap64;
+	state->updateBitmap = updateBitmap64;
+	state->compareKey = int32Compare;
+	state->compareData = int32Compare;
+	return state;
+}
+
+/**
+@brief     	Inserts keys 1 to numRecords. Writes a byte to the pipe once the shared header exists.
+*/
+int runWriter(int numRecords, int readyFd)
+{
+	sbitsState *state = createState();
+	sbitsShm shm;
+	int32_t data[3] = {0, 0, 0};
+
+	if (sbitsInit(state) != 0 || sbitsShmCreate(&shm, state, HEADER_PATH) != 0)
+		return 1;
+	if (write(readyFd, "", 1) != 1)
+		return 1;
+	close(readyFd);
+
+	for (int32_t key = 1; key <= numRecords; key++)
+	{
+		data[0] = dataValue(key);
+		if (sbitsShmPut(&shm, state, &key, data) != 0)
+			return 1;
+	}
+	sbitsShmFlush(&shm, state);
+	sbitsShmClose(&shm, state);
+	return 0;
+}
+
+/**
+@brief     	Runs one data range query until no retry is needed.
+@param		bad
+				Set to number of records of last attempt that are out of range or have wrong data
+@param		maxKey
+				Set to largest key returned
+@return		Return number of records returned by last attempt.
+*/
+int32_t runQuery(sbitsShm *shm, sbitsState *state, int32_t *minData, int32_t *maxData, int32_t *bad, int32_t *maxKey, uint32_t *retries)
+{
+	sbitsIterator it;
+	int32_t *key, *data, count;
+
+	do
+	{
+		sbitsShmBegin(shm, state);
+		it.minKey = NULL;
+		it.maxKey = NULL;
+		it.minData = minData;
+		it.maxData = maxData;
+		sbitsInitIterator(state, &it);
+		count = 0;
+		*bad = 0;
+		*maxKey = 0;
+		while (sbitsNext(state, &it, (void**) &key, (void**) &data))
+		{
+			/* Records are checked but not their order. Index iteration after the index ring wraps is not in key order. */
+			if (data[0] != dataValue(*key) || (minData != NULL && data[0] < *minData) || (maxData != NULL && data[0] > *maxData))
+				(*bad)++;
+			if (*key > *maxKey)
+				*maxKey = *key;
+			count++;
+		}
+		(*retries)++;
+	} while (sbitsShmRetry(shm, state));
+	(*retries)--;
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	int32_t numRecords = argc > 1 ? atoi(argv[1]) : 50000;
+	int readyPipe[2];
+	char ready;
+
+	if (pipe(readyPipe) != 0)
+		return 1;
+	pid_t writer = fork();
+	if (writer < 0)
+		return 1;
+	if (writer == 0)
+	{
+		close(readyPipe[0]);
+		exit(runWriter(numRecords, readyPipe[1]));
+	}
+	close(readyPipe[1]);
+	if (read(readyPipe[0], &ready, 1) != 1)
+	{
+		printf("Writer failed to start.\n");
+		return 1;
+	}
+
+	sbitsState *state = createState();
+	sbitsShm shm;
+	if (sbitsShmOpenReader(&shm, state, HEADER_PATH, "datafile.bin", "idxfile.bin") != 0)
+	{
+		printf("Reader open error.\n");
+		return 1;
+	}
+
+	/* Query while writer inserts */
+	uint32_t queries = 0, retries = 0, errors = 0;
+	int32_t bad, maxKey, status;
+	while (waitpid(writer, &status, WNOHANG) == 0)
+	{
+		int32_t minData = 320 + (queries * 53) % 620, maxData = minData + 20;
+		runQuery(&shm, state, &minData, &maxData, &bad, &maxKey, &retries);
+		errors += bad > 0;
+		queries++;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		printf("Writer error.\n");
+		return 1;
+	}
+	printf("Queries during inserts: %u  Retries: %u  Queries with wrong records: %u\n", queries, retries, errors);
+
+	/* Writer flushed all records. The last key inserted must be visible. */
+	int32_t count = runQuery(&shm, state, NULL, NULL, &bad, &maxKey, &retries);
+	printf("Records after inserts: %d  Last key: %d  Wrong records: %d\n", count, maxKey, bad);
+	if (maxKey != numRecords)
+		errors++;
+	errors += bad > 0;
+
+	sbitsShmClose(&shm, state);
+	unlink(HEADER_PATH);
+	return errors > 0;
+}
@@ -0,0 +1,528 @@
+/******************************************************************************/
+/**
+@file		sbitssim.c
+@author		Ramon Lawrence
+@brief		Runs SBITS benchmark firmware (built with -DSBITS_SIM) on an ATmega2560
+			simulated by simavr and reports cycles, RAM and I/O per operation.
+@details	Build:	gcc -O2 -Isrc tools/sbitssim/sbitssim.c -lsimavr -lelf -o sbitssim
+			Run:	pio run -e megaatmega2560_sim
+					./sbitssim -d simdir .pio/build/megaatmega2560_sim/firmware.elf
+			Firmware files are files in the storage directory. The storage device
+			is on the SPI bus (see sbits_sim.h). Busy bytes before read data and
+			after write data model device latency.
+			Erase counts of each file are counted per erase block (-e bytes). A
+			write to the start of an erase block erases it.
+			Cycles of an operation are counted from its SBITS_SIM_BEGIN() marker to
+			its SBITS_SIM_END() marker. Stack depth is the lowest stack pointer
+			during the operation. RAM high-water mark is static data plus largest
+			heap plus deepest stack.
+@copyright	Copyright 2021
+			The University of British Columbia,
+			Ramon Lawrence
+@par Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+@par 1.Redistributions of source code must retain the above copyright notice,
+	this list of conditions and the following disclaimer.
+
+@par 2.Redistributions in binary form must reproduce the above copyright notice,
+	this list of conditions and the following disclaimer in the documentation
+	and/or other materials provided with the distribution.
+
+@par 3.Neither the name of the copyright holder nor the names of its contributors
+	may be used to endorse or promote products derived from this software without
+	specific prior written permission.
+
+@par THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_uart.h>
+#include <simavr/avr_spi.h>
+
+#include "sbits_sim.h"
+
+#define SIM_RAM_START		0x200		/* First SRAM address of ATmega2560 */
+#define SIM_MAX_TRANSFER	65535
+#define SIM_MAX_BUSY		1024
+#define SIM_MAX_WEAR_FILES	16
+
+/* Erase counts of erase blocks of a file */
+typedef struct {
+	char 		name[SBITS_SIM_MAX_NAME];
+	uint32_t 	*erases;
+	uint32_t 	numBlocks;
+} simWear;
+
+/* Emulated storage device */
+typedef struct {
+	const char 	*dir;
+	FILE 		*files[SBITS_SIM_MAX_FILES];
+	uint8_t 	cmd;							/* Command being received (0 if none) */
+	uint8_t 	arg[SBITS_SIM_MAX_NAME*2];		/* Command arguments received */
+	uint32_t 	argLen;
+	uint32_t 	dataLen;						/* Write data received */
+	uint8_t 	*data;
+	uint8_t 	*out;							/* Reply bytes not yet sent */
+	uint32_t 	outHead;
+	uint32_t 	outTail;
+	uint16_t 	readBusy;						/* Busy bytes before read data */
+	uint16_t 	writeBusy;						/* Busy bytes after write data */
+	uint32_t 	numReads;
+	uint32_t 	numWrites;
+	uint64_t 	bytesRead;
+	uint64_t 	bytesWritten;
+	uint32_t 	eraseSize;						/* Bytes in erase block */
+	simWear 	wear[SIM_MAX_WEAR_FILES];
+	uint8_t 	numWear;
+	uint8_t 	fileWear[SBITS_SIM_MAX_FILES];	/* Wear entry of open file (SIM_MAX_WEAR_FILES if none) */
+} simDevice;
+
+/* Measurements of one operation type */
+typedef struct {
+	uint32_t 	count;
+	uint64_t 	cycles;
+	uint64_t 	maxCycles;
+	uint64_t 	reads;
+	uint64_t 	writes;
+	uint16_t 	maxStack;
+} simOpStats;
+
+typedef struct {
+	avr_t 		*avr;
+	avr_irq_t 	*spiIn;
+	simDevice 	dev;
+	simOpStats 	ops[SBITS_SIM_NUM_OPS];
+	uint8_t 	op;								/* Current operation (SBITS_SIM_OP_NONE if none) */
+	avr_cycle_count_t opStart;
+	uint16_t 	opSp;							/* Stack pointer at start of operation */
+	uint16_t 	opMinSp;
+	uint32_t 	opReads;
+	uint32_t 	opWrites;
+	uint16_t 	minSp;
+	uint16_t 	heapPtrAddr;					/* Address of __brkval (0 if not known) */
+	uint16_t 	maxHeap;
+} simState;
+
+static const char *opNames[SBITS_SIM_NUM_OPS] = { "none", "init", "put", "flush", "get", "query" };
+
+static uint16_t getSp(avr_t *avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+static void reply(simDevice *dev, uint8_t b)
+{
+	dev->out[dev->outTail++] = b;
+}
+
+static void replyInt(simDevice *dev, uint32_t v, int8_t bytes)
+{
+	for (int8_t i = 0; i < bytes; i++)
+		reply(dev, (uint8_t) (v >> (8*i)));
+}
+
+/**
+@brief     	Opens file in storage directory. Returns handle or SBITS_SIM_NO_FILE.
+*/
+static uint8_t deviceOpen(simDevice *dev, const char *name, const char *mode)
+{
+	char path[1024];
+	uint8_t h;
+
+	for (h = 0; h < SBITS_SIM_MAX_FILES && dev->files[h] != NULL; h++)
+		;
+	if (h == SBITS_SIM_MAX_FILES)
+		return SBITS_SIM_NO_FILE;
+
+	snprintf(path, sizeof(path), "%s/%s", dev->dir, name);
+	FILE *fp;
+	if (mode[0] == 'w')
+		fp = fopen(path, "w+b");
+	else if (mode[0] == 'a')
+	{	/* Writes are positioned by device so file is not opened in append mode */
+		fp = fopen(path, "r+b");
+		if (fp == NULL)
+			fp = fopen(path, "w+b");
+	}
+	else
+		fp = fopen(path, strchr(mode, '+') != NULL ? "r+b" : "rb");
+	if (fp == NULL)
+		return SBITS_SIM_NO_FILE;
+	dev->files[h] = fp;
+
+	/* Erase counts are kept for file name when file is reopened or recreated */
+	uint8_t w;
+	for (w = 0; w < dev->numWear && strcmp(dev->wear[w].name, name) != 0; w++)
+		;
+	if (w == dev->numWear && w < SIM_MAX_WEAR_FILES)
+	{
+		snprintf(dev->wear[w].name, SBITS_SIM_MAX_NAME, "%s", name);
+		dev->numWear++;
+	}
+	dev->fileWear[h] = w;
+	return h;
+}
+
+/**
+@brief     	Counts erase of erase block of file if write starts at erase block.
+*/
+static void deviceErase(simDevice *dev, uint8_t h, uint32_t pos)
+{
+	if (dev->fileWear[h] >= dev->numWear || pos % dev->eraseSize != 0)
+		return;
+
+	simWear *w = &dev->wear[dev->fileWear[h]];
+	uint32_t block = pos / dev->eraseSize;
+	if (block >= w->numBlocks)
+	{
+		uint32_t *erases = realloc(w->erases, (block + 1) * sizeof(uint32_t));
+		if (erases == NULL)
+			return;
+		memset(erases + w->numBlocks, 0, (block + 1 - w->numBlocks) * sizeof(uint32_t));
+		w->erases = erases;
+		w->numBlocks = block + 1;
+	}
+	w->erases[block]++;
+}
+
+static FILE* deviceFile(simDevice *dev, uint8_t h)
+{
+	return h < SBITS_SIM_MAX_FILES ? dev->files[h] : NULL;
+}
+
+/**
+@brief     	Executes command once all its bytes are received.
+@return		Return 1 if command is complete, 0 if more bytes are needed.
+*/
+static int8_t deviceCommand(simDevice *dev)
+{
+	uint8_t *a = dev->arg;
+	uint32_t pos = a[1] | (a[2] << 8) | (a[3] << 16) | ((uint32_t) a[4] << 24);
+	uint16_t len = a[5] | (a[6] << 8);
+	FILE *fp = deviceFile(dev, a[0]);
+
+	switch (dev->cmd)
+	{
+		case SBITS_SIM_CMD_OPEN:
+		{	/* Name and mode strings */
+			char *mode = memchr(a, 0, dev->argLen);
+			if (mode == NULL || memchr(mode + 1, 0, dev->argLen - (mode + 1 - (char*) a)) == NULL)
+				return 0;
+			reply(dev, deviceOpen(dev, (char*) a, mode + 1));
+			return 1;
+		}
+		case SBITS_SIM_CMD_REMOVE:
+		{
+			char path[1024];
+			if (memchr(a, 0, dev->argLen) == NULL)
+				return 0;
+			snprintf(path, sizeof(path), "%s/%s", dev->dir, (char*) a);
+			reply(dev, unlink(path) == 0 ? SBITS_SIM_TOKEN : 0);
+			return 1;
+		}
+		case SBITS_SIM_CMD_SIZE:
+		{
+			long size = 0;
+			if (fp != NULL && fseek(fp, 0, SEEK_END) == 0)
+				size = ftell(fp);
+			replyInt(dev, (uint32_t) size, 4);
+			return 1;
+		}
+		case SBITS_SIM_CMD_CLOSE:
+			if (fp != NULL)
+			{
+				fclose(fp);
+				dev->files[a[0]] = NULL;
+			}
+			reply(dev, SBITS_SIM_TOKEN);
+			return 1;
+		case SBITS_SIM_CMD_READ:
+		{
+			if (dev->argLen < 7)
+				return 0;
+			size_t n = 0;
+			if (fp != NULL && fseek(fp, pos, SEEK_SET) == 0)
+				n = fread(dev->data, 1, len, fp);
+			memset(dev->data + n, 0, len - n);
+			for (uint16_t i = 0; i < dev->readBusy; i++)
+				reply(dev, 0xFF);
+			reply(dev, SBITS_SIM_TOKEN);
+			memcpy(dev->out + dev->outTail, dev->data, len);
+			dev->outTail += len;
+			replyInt(dev, (uint32_t) n, 2);
+			dev->numReads++;
+			dev->bytesRead += n;
+			return 1;
+		}
+		case SBITS_SIM_CMD_WRITE:
+			if (dev->argLen < 7 || dev->dataLen < len)
+				return 0;
+			if (fp != NULL && fseek(fp, pos, SEEK_SET) == 0 && fwrite(dev->data, 1, len, fp) == len)
+			{
+				deviceErase(dev, a[0], pos);
+				for (uint16_t i = 0; i < dev->writeBusy; i++)
+					reply(dev, 0x00);
+				reply(dev, SBITS_SIM_TOKEN);
+			}
+			else
+				reply(dev, 0x01);		/* Write error */
+			dev->numWrites++;
+			dev->bytesWritten += len;
+			return 1;
+		default:
+			return 1;		/* Fill byte or unknown command is ignored */
+	}
+}
+
+/**
+@brief     	Called with each byte sent by the SPI master. The reply byte is
+			shifted in during the same transfer.
+*/
+static void spiOutput(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	simState *sim = (simState*) param;
+	simDevice *dev = &sim->dev;
+	uint8_t b = (uint8_t) value;
+
+	if (dev->outHead < dev->outTail)
+	{	/* Master is reading reply. Byte sent is fill. */
+		avr_raise_irq(sim->spiIn, dev->out[dev->outHead++]);
+		if (dev->outHead == dev->outTail)
+			dev->outHead = dev->outTail = 0;
+		return;
+	}
+	avr_raise_irq(sim->spiIn, 0xFF);
+
+	if (dev->cmd == 0)
+	{	/* Start of command */
+		dev->cmd = b;
+		dev->argLen = 0;
+		dev->dataLen = 0;
+		if (b != SBITS_SIM_CMD_SIZE && b != SBITS_SIM_CMD_CLOSE && b != SBITS_SIM_CMD_OPEN && b != SBITS_SIM_CMD_READ
+				&& b != SBITS_SIM_CMD_WRITE && b != SBITS_SIM_CMD_REMOVE)
+			dev->cmd = 0;
+		return;
+	}
+
+	if (dev->cmd == SBITS_SIM_CMD_WRITE && dev->argLen == 7)
+		dev->data[dev->dataLen++] = b;
+	else if (dev->argLen < sizeof(dev->arg))
+		dev->arg[dev->argLen++] = b;
+
+	if (deviceCommand(dev))
+		dev->cmd = 0;
+}
+
+static void uartOutput(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	putchar((int) value);
+}
+
+/**
+@brief     	Called when firmware writes operation marker.
+*/
+static void markerWrite(struct avr_t *avr, avr_io_addr_t addr, uint8_t v, void *param)
+{
+	simState *sim = (simState*) param;
+
+	avr->data[addr] = v;
+	if (v == SBITS_SIM_OP_HEAP)
+	{
+		sim->heapPtrAddr = avr->data[SBITS_SIM_ARG_ADDR] | (avr->data[SBITS_SIM_ARG_ADDR+1] << 8);
+		return;
+	}
+
+	if (sim->op != SBITS_SIM_OP_NONE && sim->op < SBITS_SIM_NUM_OPS)
+	{	/* End current operation */
+		simOpStats *s = &sim->ops[sim->op];
+		uint64_t cycles = avr->cycle - sim->opStart;
+		s->count++;
+		s->cycles += cycles;
+		if (cycles > s->maxCycles)
+			s->maxCycles = cycles;
+		s->reads += sim->dev.numReads - sim->opReads;
+		s->writes += sim->dev.numWrites - sim->opWrites;
+		if (sim->opSp - sim->opMinSp > s->maxStack)
+			s->maxStack = sim->opSp - sim->opMinSp;
+	}
+
+	sim->op = v;
+	sim->opStart = avr->cycle;
+	sim->opSp = sim->opMinSp = getSp(avr);
+	sim->opReads = sim->dev.numReads;
+	sim->opWrites = sim->dev.numWrites;
+}
+
+static void printReport(simState *sim, elf_firmware_t *f)
+{
+	avr_t *avr = sim->avr;
+	double mhz = avr->frequency / 1000000.0;
+
+	printf("\nSIMULATOR RESULTS (%s at %.0f MHz)\n", f->mmcu, mhz);
+	printf("%-6s %8s %12s %12s %10s %8s %8s %6s\n", "op", "count", "avg cycles", "max cycles", "avg us", "reads", "writes", "stack");
+	for (int8_t i = 1; i < SBITS_SIM_NUM_OPS; i++)
+	{
+		simOpStats *s = &sim->ops[i];
+		if (s->count == 0)
+			continue;
+		printf("%-6s %8u %12.0f %12llu %10.1f %8.3f %8.3f %6u\n", opNames[i], s->count, (double) s->cycles / s->count,
+				(unsigned long long) s->maxCycles, (double) s->cycles / s->count / mhz,
+				(double) s->reads / s->count, (double) s->writes / s->count, s->maxStack);
+	}
+	printf("reads and writes are device commands per operation. stack is deepest stack in bytes during operation.\n");
+
+	uint16_t staticSize = f->datasize + f->bsssize;
+	uint16_t heapStart = SIM_RAM_START + staticSize;
+	uint16_t heap = sim->maxHeap > heapStart ? sim->maxHeap - heapStart : 0;
+	uint16_t stack = avr->ramend - sim->minSp;
+	printf("RAM high-water: %u of %u bytes (static: %u heap: %u stack: %u)\n", staticSize + heap + stack,
+			avr->ramend + 1 - SIM_RAM_START, staticSize, heap, stack);
+	printf("Device: reads: %u (%llu bytes) writes: %u (%llu bytes)\n", sim->dev.numReads, (unsigned long long) sim->dev.bytesRead,
+			sim->dev.numWrites, (unsigned long long) sim->dev.bytesWritten);
+	printf("Total cycles: %llu (%.3f s)\n", (unsigned long long) avr->cycle, avr->cycle / (double) avr->frequency);
+
+	printf("Wear (erase block %u bytes):\n", sim->dev.eraseSize);
+	for (uint8_t i = 0; i < sim->dev.numWear; i++)
+	{
+		simWear *w = &sim->dev.wear[i];
+		if (w->numBlocks == 0)
+			continue;
+		uint32_t minErases = w->erases[0], maxErases = 0;
+		uint64_t total = 0;
+		for (uint32_t b = 0; b < w->numBlocks; b++)
+		{
+			total += w->erases[b];
+			if (w->erases[b] < minErases)
+				minErases = w->erases[b];
+			if (w->erases[b] > maxErases)
+				maxErases = w->erases[b];
+		}
+		printf("%-16s blocks: %u  erases min: %u avg: %.1f max: %u\n", w->name, w->numBlocks, minErases,
+				(double) total / w->numBlocks, maxErases);
+	}
+}
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [-d directory] [-e eraseBytes] [-f MHz] [-r readBusy] [-w writeBusy] firmware.elf\n", prog);
+	printf("  -d  Storage directory (default .)\n");
+	printf("  -e  Bytes in erase block for wear counts (default 2048)\n");
+	printf("  -r  Busy bytes before read data (default 8)\n");
+	printf("  -w  Busy bytes after write data (default 64)\n");
+}
+
+int main(int argc, char **argv)
+{
+	static simState sim;
+	elf_firmware_t f;
+	int mhz = 16, opt;
+
+	memset(&f, 0, sizeof(f));
+	sim.dev.dir = ".";
+	sim.dev.readBusy = 8;
+	sim.dev.writeBusy = 64;
+	sim.dev.eraseSize = 2048;
+	while ((opt = getopt(argc, argv, "d:e:f:r:w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd':	sim.dev.dir = optarg;	break;
+			case 'e':	sim.dev.eraseSize = atoi(optarg);	break;
+			case 'f':	mhz = atoi(optarg);	break;
+			case 'r':	sim.dev.readBusy = atoi(optarg);	break;
+			case 'w':	sim.dev.writeBusy = atoi(optarg);	break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if (optind >= argc || mhz <= 0 || sim.dev.eraseSize == 0 || sim.dev.readBusy > SIM_MAX_BUSY || sim.dev.writeBusy > SIM_MAX_BUSY)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (elf_read_firmware(argv[optind], &f) != 0)
+	{
+		printf("Unable to read firmware: %s\n", argv[optind]);
+		return 1;
+	}
+	/* Arduino builds do not have simavr MCU section */
+	if (f.mmcu[0] == '\0')
+		strcpy(f.mmcu, "atmega2560");
+	if (f.frequency == 0)
+		f.frequency = mhz * 1000000;
+
+	sim.avr = avr_make_mcu_by_name(f.mmcu);
+	if (sim.avr == NULL)
+	{
+		printf("Unknown MCU: %s\n", f.mmcu);
+		return 1;
+	}
+	avr_init(sim.avr);
+	avr_load_firmware(sim.avr, &f);
+
+	sim.dev.data = malloc(SIM_MAX_TRANSFER);
+	sim.dev.out = malloc(SIM_MAX_TRANSFER + SIM_MAX_BUSY + 8);
+	if (sim.dev.data == NULL || sim.dev.out == NULL)
+		return 1;
+
+	/* Serial output to stdout */
+	uint32_t flags = 0;
+	avr_ioctl(sim.avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(sim.avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+	avr_irq_register_notify(avr_io_getirq(sim.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOutput, &sim);
+
+	/* Storage device on SPI bus */
+	sim.spiIn = avr_io_getirq(sim.avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(sim.avr, AVR_IOCTL_SPI_GETIRQ(0), SPI_IRQ_OUTPUT), spiOutput, &sim);
+
+	avr_register_io_write(sim.avr, SBITS_SIM_MARKER_ADDR, markerWrite, &sim);
+
+	/* Run until firmware sleeps with interrupts disabled */
+	sim.minSp = sim.avr->ramend;
+	int state = cpu_Running;
+	while (state != cpu_Done && state != cpu_Crashed)
+	{
+		state = avr_run(sim.avr);
+
+		uint16_t sp = getSp(sim.avr);
+		if (sp < sim.minSp && sp > SIM_RAM_START)
+			sim.minSp = sp;
+		if (sp < sim.opMinSp)
+			sim.opMinSp = sp;
+		if (sim.heapPtrAddr != 0)
+		{
+			uint16_t brk = sim.avr->data[sim.heapPtrAddr] | (sim.avr->data[sim.heapPtrAddr+1] << 8);
+			if (brk > sim.maxHeap)
+				sim.maxHeap = brk;
+		}
+	}
+	fflush(stdout);
+	if (state == cpu_Crashed)
+		printf("\nSimulated CPU crashed at pc 0x%x\n", sim.avr->pc);
+
+	printReport(&sim, &f);
+	avr_terminate(sim.avr);
+	return state == cpu_Crashed;
+}